@@ -15,6 +15,19 @@
  */
 
 
+/*
+ * Opens (and holds) lots of idle connections against a server, to see how
+ * it copes with them. Connects are non-blocking and driven by epoll, with
+ * at most -C of them in flight, optionally paced at -r per second. Going
+ * past the ~64K ephemeral ports towards a single server address needs more
+ * source addresses (-b), or an explicit source port range (-P).
+ * With -T, established connections trickle -B bytes of a never ending
+ * request header every interval (slowloris style).
+ * With -t PID, the target RSS and open file count are sampled from /proc,
+ * and reported along with the connection counts once per second.
+ */
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -25,48 +38,231 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 
 
 
-#define MAX_CONNECT_ERRORS 4
+#define MAX_CONNECT_ERRORS 1024
+#define MAX_SRC_ADDRS 256
+#define MAX_EVENTS 1024
+#define RETRY_NS 1000000000ULL
+#define TRICKLE_HDR "GET / HTTP/1.1\r\nHost: deadconn\r\n"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+
+
+enum conn_states {
+	CS_IDLE,
+	CS_CONNECTING,
+	CS_ESTABLISHED,
+	CS_CLOSED
+};
+
+struct dconn {
+	int fd, state;
+	unsigned long tpos;
+	unsigned long long retry;
+};
+
+static volatile int stop_test;
+static struct in_addr src_addrs[MAX_SRC_ADDRS];
+static int nsrc_addrs;
+static int lo_port, hi_port;
+static unsigned long nbinds;
+
+
 
 
+static unsigned long long getnstime(void) {
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-static int tconnect(struct sockaddr_in const *addr) {
-	int sfd;
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sig_int(int sig) {
+
+	stop_test = 1;
+}
+
+/*
+ * Parses a comma separated list of IPv4 addresses and FIRST-LAST ranges.
+ */
+static int parse_addrs(char *list) {
+	char *tok, *auxptr, *last;
+	struct in_addr first, end;
+	unsigned long a;
+
+	for (tok = strtok_r(list, ",", &auxptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &auxptr)) {
+		if ((last = strchr(tok, '-')) != NULL)
+			*last++ = '\0';
+		if (inet_aton(tok, &first) == 0 ||
+		    (last != NULL && inet_aton(last, &end) == 0)) {
+			fprintf(stderr, "invalid address: %s\n", tok);
+			return -1;
+		}
+		if (last == NULL)
+			end = first;
+		for (a = ntohl(first.s_addr); a <= ntohl(end.s_addr); a++) {
+			if (nsrc_addrs == MAX_SRC_ADDRS) {
+				fprintf(stderr, "too many source addresses\n");
+				return -1;
+			}
+			src_addrs[nsrc_addrs++].s_addr = htonl(a);
+		}
+	}
 
-	if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	return 0;
+}
+
+/*
+ * Source addresses are used round robin. With a port range, every
+ * (address, port) pair is bound explicitly, otherwise the port is left
+ * to connect(2), which (with IP_BIND_ADDRESS_NO_PORT) only needs the
+ * whole 4-tuple to be unique.
+ */
+static int bind_source(int sfd) {
+	int one = 1;
+	unsigned long idx = nbinds++;
+	struct sockaddr_in addr;
+
+	if (nsrc_addrs == 0 && lo_port == 0)
+		return 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (nsrc_addrs > 0) {
+		addr.sin_addr = src_addrs[idx % nsrc_addrs];
+		idx /= nsrc_addrs;
+	}
+	if (lo_port > 0) {
+		addr.sin_port = htons((short int) (lo_port + idx % (hi_port - lo_port + 1)));
+		setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	} else
+		setsockopt(sfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+	if (bind(sfd, (struct sockaddr const *) &addr, sizeof(addr)) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int tconnect(int epfd, struct sockaddr_in const *addr, struct dconn *dc) {
+	struct epoll_event ev;
+
+	if ((dc->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
 		perror("socket");
 		return -1;
 	}
-	if (connect(sfd, (struct sockaddr const *) addr, sizeof(*addr)) < 0) {
-		perror("connect");
-		close(sfd);
+	if (bind_source(dc->fd) < 0 ||
+	    (connect(dc->fd, (struct sockaddr const *) addr, sizeof(*addr)) < 0 &&
+	     errno != EINPROGRESS)) {
+		close(dc->fd);
+		dc->fd = -1;
 		return -1;
 	}
+	ev.events = EPOLLOUT | EPOLLRDHUP;
+	ev.data.ptr = dc;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, dc->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		close(dc->fd);
+		dc->fd = -1;
+		return -1;
+	}
+	dc->state = CS_CONNECTING;
+
+	return 0;
+}
+
+/*
+ * Sends the next @n bytes of the trickled request, whose header lines
+ * never end.
+ */
+static void trickle(struct dconn *dc, int n) {
+	int len;
+	unsigned long hlen = sizeof(TRICKLE_HDR) - 1, off;
+	char buf[256];
+
+	for (len = 0; len < n && len < (int) sizeof(buf); len++) {
+		off = dc->tpos + len;
+		buf[len] = off < hlen ? TRICKLE_HDR[off]:
+			"X-Deadconn: trickle\r\n"[(off - hlen) % 21];
+	}
+	if ((len = send(dc->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT)) > 0)
+		dc->tpos += len;
+}
+
+static long read_rss(pid_t pid) {
+	long rss = -1;
+	char path[64], ln[256];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+	if ((file = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(ln, sizeof(ln), file) != NULL)
+		if (strncmp(ln, "VmRSS:", 6) == 0) {
+			rss = atol(ln + 6);
+			break;
+		}
+	fclose(file);
+
+	return rss;
+}
+
+static long count_fds(pid_t pid) {
+	long n = 0;
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+	while ((ent = readdir(dir)) != NULL)
+		if (ent->d_name[0] != '.')
+			n++;
+	closedir(dir);
 
-	return sfd;
+	return n;
 }
 
 static void usage(char const *prg) {
 
-	fprintf(stderr, "use: %s -s SERVER -p PORT -n NUMCONN [-R INITREQ] [-h]\n", prg);
+	fprintf(stderr, "use: %s -s SERVER -p PORT -n NUMCONN [-R INITREQ] [-b SRCADDRS]\n"
+		"\t[-P LOPORT-HIPORT] [-r CONNRATE] [-C MAXPENDING] [-H HOLDSEC]\n"
+		"\t[-T TRICKLEMS] [-B TRICKLEBYTES] [-t PID] [-K] [-h]\n", prg);
 }
 
 int main(int ac, char **av) {
-	int i, sfd, errors, port = -1, nconns = -1;
+	int i, n, epfd, error, port = -1, nconns = -1, maxpend = 256, hold = 0,
+		rconn = 0, tbytes = 1, errors = 0;
+	long rate = 0, tms = 0, rss, nfds, rss0 = -1, nfds0 = -1;
+	pid_t tpid = 0;
+	socklen_t len;
+	unsigned long launched = 0, pending = 0, estab = 0, failed = 0, dropped = 0,
+		peak = 0;
+	unsigned long long tstart, tnow, tnext, ttrickle = 0, thold = 0;
 	char const *server = NULL, *req = NULL;
+	char *ptr, buf[4096];
 	struct hostent *he;
 	struct in_addr inadr;
 	struct sockaddr_in addr;
+	struct rlimit rlim;
+	struct dconn *dconns, *dc;
+	struct epoll_event ev, *evs;
 
 	for (i = 1; i < ac; i++) {
 		if (strcmp(av[i], "-s") == 0) {
@@ -81,12 +277,42 @@ int main(int ac, char **av) {
 		} else if (strcmp(av[i], "-R") == 0) {
 			if (++i < ac)
 				req = av[i];
+		} else if (strcmp(av[i], "-b") == 0) {
+			if (++i < ac && parse_addrs(av[i]) < 0)
+				return 1;
+		} else if (strcmp(av[i], "-P") == 0) {
+			if (++i < ac) {
+				lo_port = hi_port = atoi(av[i]);
+				if ((ptr = strchr(av[i], '-')) != NULL)
+					hi_port = atoi(ptr + 1);
+			}
+		} else if (strcmp(av[i], "-r") == 0) {
+			if (++i < ac)
+				rate = atol(av[i]);
+		} else if (strcmp(av[i], "-C") == 0) {
+			if (++i < ac)
+				maxpend = atoi(av[i]);
+		} else if (strcmp(av[i], "-H") == 0) {
+			if (++i < ac)
+				hold = atoi(av[i]);
+		} else if (strcmp(av[i], "-T") == 0) {
+			if (++i < ac)
+				tms = atol(av[i]);
+		} else if (strcmp(av[i], "-B") == 0) {
+			if (++i < ac)
+				tbytes = atoi(av[i]);
+		} else if (strcmp(av[i], "-t") == 0) {
+			if (++i < ac)
+				tpid = (pid_t) atoi(av[i]);
+		} else if (strcmp(av[i], "-K") == 0) {
+			rconn = 1;
 		} else if (strcmp(av[i], "-h") == 0) {
 			usage(av[0]);
 			return 1;
 		}
 	}
-	if (server == NULL || port < 0 || nconns < 0) {
+	if (server == NULL || port < 0 || nconns < 0 || maxpend < 1 ||
+	    hi_port < lo_port || tbytes < 1) {
 		usage(av[0]);
 		return 1;
 	}
@@ -101,24 +327,154 @@ int main(int ac, char **av) {
 	addr.sin_family = AF_INET;
 	memcpy(&addr.sin_addr, &inadr.s_addr, 4);
 	addr.sin_port = htons((short int) port);
-	for (i = 0; i < nconns; i++) {
-		errors = 0;
-		retry:
-		if ((sfd = tconnect(&addr)) != -1) {
-			if (req != NULL)
-				write(sfd, req, strlen(req));
-			errors = 0;
-			printf("%d\n", i);
-		} else {
-			sleep(1);
-			if (++errors < MAX_CONNECT_ERRORS)
-				goto retry;
-			break;
+
+	/*
+	 * We need one file descriptor per connection, plus some slack.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+	    rlim.rlim_cur < (rlim_t) nconns + 64) {
+		rlim.rlim_cur = (rlim_t) nconns + 64;
+		if (rlim.rlim_max < rlim.rlim_cur)
+			rlim.rlim_max = rlim.rlim_cur;
+		if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+			perror("setrlimit(RLIMIT_NOFILE)");
+	}
+	if ((dconns = (struct dconn *) calloc(nconns, sizeof(struct dconn))) == NULL ||
+	    (evs = (struct epoll_event *) malloc(MAX_EVENTS * sizeof(struct epoll_event))) == NULL) {
+		perror("malloc");
+		return 3;
+	}
+	for (i = 0; i < nconns; i++)
+		dconns[i].fd = -1;
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		return 3;
+	}
+	signal(SIGINT, sig_int);
+	signal(SIGPIPE, SIG_IGN);
+	if (tpid > 0) {
+		rss0 = read_rss(tpid);
+		nfds0 = count_fds(tpid);
+	}
+
+	fprintf(stdout, "%8s %9s %8s %8s %8s %10s %9s %10s\n", "time", "estab",
+		"pending", "failed", "dropped", "rss-kb", "fds", "b/conn");
+	tstart = getnstime();
+	tnext = tstart + 1000000000ULL;
+	while (!stop_test) {
+		tnow = getnstime();
+
+		/*
+		 * Launch new connects, within the ramp rate and the pending
+		 * limit. Failed ones are retried after a while, unless we got
+		 * too many failures in a row.
+		 */
+		for (i = 0; i < nconns && launched < (unsigned long) nconns &&
+			     pending < (unsigned long) maxpend &&
+			     (rate == 0 || launched < (tnow - tstart) * rate / 1000000000ULL) &&
+			     errors < MAX_CONNECT_ERRORS; i++) {
+			dc = &dconns[(launched + i) % nconns];
+			if (dc->state != CS_IDLE || dc->retry > tnow)
+				continue;
+			if (tconnect(epfd, &addr, dc) < 0) {
+				failed++;
+				errors++;
+				dc->retry = tnow + RETRY_NS;
+				continue;
+			}
+			pending++;
+			launched++;
+			i--;
 		}
+
+		n = epoll_wait(epfd, evs, MAX_EVENTS, 10);
+		for (i = 0; i < n; i++) {
+			dc = (struct dconn *) evs[i].data.ptr;
+			if (dc->state == CS_CONNECTING) {
+				pending--;
+				len = sizeof(error);
+				if (getsockopt(dc->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+				    error != 0) {
+					close(dc->fd);
+					dc->fd = -1;
+					dc->state = CS_IDLE;
+					dc->retry = getnstime() + RETRY_NS;
+					launched--;
+					failed++;
+					errors++;
+					continue;
+				}
+				errors = 0;
+				dc->state = CS_ESTABLISHED;
+				dc->tpos = 0;
+				ev.events = EPOLLIN | EPOLLRDHUP;
+				ev.data.ptr = dc;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, dc->fd, &ev);
+				if (req != NULL)
+					write(dc->fd, req, strlen(req));
+				if (++estab > peak)
+					peak = estab;
+				continue;
+			}
+			/*
+			 * Whatever the server sends is discarded, and a peer
+			 * close is a dropped connection.
+			 */
+			while ((error = recv(dc->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+			if (error == 0 || (error < 0 && errno != EAGAIN) ||
+			    (evs[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				close(dc->fd);
+				dc->fd = -1;
+				estab--;
+				dropped++;
+				if (rconn) {
+					dc->state = CS_IDLE;
+					dc->retry = 0;
+					launched--;
+				} else
+					dc->state = CS_CLOSED;
+			}
+		}
+
+		tnow = getnstime();
+		if (tms > 0 && tnow >= ttrickle) {
+			for (i = 0; i < nconns; i++)
+				if (dconns[i].state == CS_ESTABLISHED)
+					trickle(&dconns[i], tbytes);
+			ttrickle = tnow + tms * 1000000ULL;
+		}
+		if (tnow >= tnext) {
+			rss = nfds = -1;
+			if (tpid > 0) {
+				rss = read_rss(tpid);
+				nfds = count_fds(tpid);
+			}
+			fprintf(stdout, "%8.1f %9lu %8lu %8lu %8lu %10ld %9ld %10.0f\n",
+				(tnow - tstart) / 1e9, estab, pending, failed, dropped,
+				rss, nfds, estab > 0 && rss >= 0 && rss0 >= 0 ?
+				(rss - rss0) * 1024.0 / estab: 0.0);
+			fflush(stdout);
+			tnext += 1000000000ULL;
+		}
+		if (launched == (unsigned long) nconns && pending == 0 && thold == 0) {
+			fprintf(stdout, "%lu connections created in %.3lf s\n", estab,
+				(tnow - tstart) / 1e9);
+			thold = tnow;
+		}
+		if (errors >= MAX_CONNECT_ERRORS && pending == 0 && thold == 0) {
+			fprintf(stdout, "too many connect errors, holding %lu connections\n",
+				estab);
+			thold = tnow;
+		}
+		if (hold > 0 && thold > 0 && tnow - thold >= hold * 1000000000ULL)
+			break;
 	}
-	fprintf(stdout, "%d connections created, press Ctrl-C to exit ...\n", i);
-	for (;;)
-		sleep(10);
+
+	fprintf(stdout, "peak %lu connections, %lu failed connects, %lu dropped\n",
+		peak, failed, dropped);
+	if (tpid > 0 && rss0 >= 0 && nfds0 >= 0 && peak > 0)
+		fprintf(stdout, "target grew %ld KB RSS and %ld fds (%ld KB RSS now)\n",
+			read_rss(tpid) - rss0, count_fds(tpid) - nfds0, read_rss(tpid));
 
 	return 0;
 }
@@ -0,0 +1,332 @@
+#!/bin/sh
+#    Copyright 2023 Davide Libenzi
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+
+#
+# Runs thrhttp/thrplhttp configurations against httpload on localhost,
+# over a generated document tree, sweeping file size classes and client
+# concurrency. Every run becomes one line of a TSV table, with the load
+# generator throughput and latency percentiles, and the server CPU usage
+# and context switches taken out of /proc.
+#
+
+SRCDIR=$(dirname $0)
+BINDIR=""
+WORKDIR=""
+PORT=8099
+DURATION=5
+WARMUP=1
+LTHREADS=2
+CONCS="1 16 64 256"
+SIZES="1k 16k 256k 4m"
+NFILES=64
+RATE=0
+PIPELINE=1
+CONFFILE=""
+OUTFILE=""
+KEEP=0
+TMPWORK=0
+DEBUG=0
+
+#
+# Default server configurations: "NAME ARGS...", where NAME is the server
+# binary. Transmit modes are the mmap (default), sendfile (-S) and, for
+# thrplhttp, zerocopy (-Z) ones, the latter also with bodies sent in TX
+# quanta (-U), which only kicks in for the sizes above the quantum.
+#
+DEFCONFS="thrhttp
+thrhttp -S
+thrhttp -K
+thrplhttp
+thrplhttp -S
+thrplhttp -Z
+thrplhttp -U 65536
+thrplhttp -Z -U 65536
+thrplhttp -T 4
+thrplhttp -T 64
+thrplhttp -Q 8
+thrplhttp -Q 256
+thrplhttp -R 1
+thrplhttp -K -S"
+
+
+usage()
+{
+    printf "Usage: %s [-Dk] [-b BINDIR] [-w WORKDIR] [-f CONFFILE] [-o OUTFILE]\n" $(basename $1) >&2
+    printf "\t[-p PORT] [-d SEC] [-W SEC] [-t NUM] [-c LIST] [-s LIST] [-n NUM] [-r RATE] [-P NUM]\n" >&2
+    printf "\t-D         Sets debug mode\n" >&2
+    printf "\t-k         Keep the temporary work directory (document tree and logs)\n" >&2
+    printf "\t-b BINDIR  Directory with the thrhttp, thrplhttp and httpload binaries\n" >&2
+    printf "\t           (built from %s into the work directory if missing)\n" "$SRCDIR" >&2
+    printf "\t-w WORKDIR Work directory (a temporary one)\n" >&2
+    printf "\t-f FILE    Server configurations, one \"SERVER ARGS...\" per line\n" >&2
+    printf "\t-o FILE    Output TSV file (stdout)\n" >&2
+    printf "\t-p PORT    Server port (%d)\n" $PORT >&2
+    printf "\t-d SEC     Measurement time of each run (%d)\n" $DURATION >&2
+    printf "\t-W SEC     Warmup time of each run (%d)\n" $WARMUP >&2
+    printf "\t-t NUM     Load generator threads (%d)\n" $LTHREADS >&2
+    printf "\t-c LIST    Client concurrency sweep (\"%s\")\n" "$CONCS" >&2
+    printf "\t-s LIST    File size class sweep (\"%s\")\n" "$SIZES" >&2
+    printf "\t-n NUM     Files per size class (%d)\n" $NFILES >&2
+    printf "\t-r RATE    Open-loop request rate, 0 for closed-loop (%d)\n" $RATE >&2
+    printf "\t-P NUM     Client pipeline depth (%d)\n" $PIPELINE >&2
+
+    exit 1
+}
+
+dbg()
+{
+    if [ $DEBUG -ne 0 ]; then
+        echo "$1" >&2
+    fi
+}
+
+tobytes()
+{
+    case $1 in
+        *k|*K)
+            expr ${1%?} \* 1024
+            ;;
+        *m|*M)
+            expr ${1%?} \* 1048576
+            ;;
+        *)
+            echo $1
+            ;;
+    esac
+}
+
+#
+# Builds the SIZE class: NFILES files whose sizes are log-uniformly spread
+# over [SIZE/2, SIZE*2), with a fixed seed so that every run (and every
+# invocation) sees the same tree. Also writes the request list, in random
+# order, which httpload replays.
+#
+mktree()
+{
+    MTSIZE=$(tobytes $1)
+    mkdir -p "$WORKDIR/www/$1"
+    awk -v n=$NFILES -v size=$MTSIZE -v seed=$MTSIZE 'BEGIN {
+        srand(seed);
+        for (i = 0; i < n; i++)
+            printf("%d %d\n", i, int(size / 2 * exp(rand() * log(4))));
+    }' | while read MTIDX MTFSIZE; do
+        head -c $MTFSIZE /dev/urandom > "$WORKDIR/www/$1/f$MTIDX.bin"
+    done
+    awk -v n=$NFILES -v cls=$1 -v seed=$MTSIZE 'BEGIN {
+        srand(seed + 1);
+        for (i = 0; i < 16 * n; i++)
+            printf("/%s/f%d.bin\n", cls, int(rand() * n));
+    }' > "$WORKDIR/$1.lst"
+}
+
+build()
+{
+    if [ -x "$BINDIR/$1" ]; then
+        return 0
+    fi
+    dbg "building $1"
+    cc -O2 -o "$BINDIR/$1" "$SRCDIR/$1.c" -lpthread -lm
+}
+
+#
+# Sum of user and system time (in clock ticks) of PID, which also covers
+# the threads which already exited.
+#
+cputicks()
+{
+    awk '{ print $14 + $15 }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+#
+# Voluntary and involuntary context switches of the live threads of PID.
+# Threads which already exited (thrhttp ones without the thread cache)
+# are not accounted.
+#
+ctxsw()
+{
+    cat /proc/$1/task/*/status 2>/dev/null | awk '
+        /^voluntary_ctxt_switches/ { v += $2 }
+        /^nonvoluntary_ctxt_switches/ { n += $2 }
+        END { printf("%d %d\n", v, n) }'
+}
+
+#
+# Busy and total jiffies of the whole machine, client included.
+#
+syscpu()
+{
+    awk '/^cpu / { print $2 + $3 + $4 + $7 + $8, $2 + $3 + $4 + $5 + $6 + $7 + $8 }' /proc/stat
+}
+
+#
+# Extracts the columns we want out of the httpload report. In open-loop
+# mode the first percentile block is the one measured from the intended
+# send times.
+#
+parseload()
+{
+    awk '
+        /^Requests / { gsub(/[(]/, "", $4); rps = $4 }
+        /^Total Bytes / { gsub(/[(]/, "", $5); mbs = $5 }
+        /^Errors / { err = $3; unfin = $5 }
+        /^  Min\/Avg\/Max / && avg == "" { avg = $5 }
+        /% \.+:/ && !($1 in pct) { pct[$1] = $3 }
+        END {
+            printf("%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", rps == "" ? 0: rps,
+                   mbs == "" ? 0: mbs, avg == "" ? "-": avg,
+                   pct["50.000%"] == "" ? "-": pct["50.000%"],
+                   pct["90.000%"] == "" ? "-": pct["90.000%"],
+                   pct["99.000%"] == "" ? "-": pct["99.000%"],
+                   pct["99.900%"] == "" ? "-": pct["99.900%"],
+                   pct["100.000%"] == "" ? "-": pct["100.000%"],
+                   err == "" ? 0: err, unfin == "" ? 0: unfin)
+        }' "$1"
+}
+
+
+#
+# Here the start of all ...
+#
+while getopts 'Dkb:w:f:o:p:d:W:t:c:s:n:r:P:' OPTION
+do
+    case $OPTION in
+        D)
+            DEBUG=1
+            ;;
+        k)
+            KEEP=1
+            ;;
+        b)
+            BINDIR="$OPTARG"
+            ;;
+        w)
+            WORKDIR="$OPTARG"
+            ;;
+        f)
+            CONFFILE="$OPTARG"
+            ;;
+        o)
+            OUTFILE="$OPTARG"
+            ;;
+        p)
+            PORT=$OPTARG
+            ;;
+        d)
+            DURATION=$OPTARG
+            ;;
+        W)
+            WARMUP=$OPTARG
+            ;;
+        t)
+            LTHREADS=$OPTARG
+            ;;
+        c)
+            CONCS="$OPTARG"
+            ;;
+        s)
+            SIZES="$OPTARG"
+            ;;
+        n)
+            NFILES=$OPTARG
+            ;;
+        r)
+            RATE=$OPTARG
+            ;;
+        P)
+            PIPELINE=$OPTARG
+            ;;
+        ?)
+            usage $0
+            ;;
+    esac
+done
+shift $(($OPTIND - 1))
+
+if [ -z "$WORKDIR" ]; then
+    WORKDIR=$(mktemp -d /tmp/httpbench.XXXXXX) || exit 2
+    TMPWORK=1
+else
+    mkdir -p "$WORKDIR" || exit 2
+fi
+if [ -z "$BINDIR" ]; then
+    BINDIR="$WORKDIR"
+fi
+for b in thrhttp thrplhttp httpload; do
+    if ! build $b; then
+        echo "unable to build $b, use -b to point to prebuilt binaries" >&2
+        exit 3
+    fi
+done
+
+if [ -n "$CONFFILE" ]; then
+    CONFS=$(grep -v '^[[:space:]]*\(#\|$\)' "$CONFFILE")
+else
+    CONFS="$DEFCONFS"
+fi
+
+for s in $SIZES; do
+    dbg "generating the $s size class"
+    mktree $s
+done
+
+if [ -n "$OUTFILE" ]; then
+    exec > "$OUTFILE"
+fi
+CLKTCK=$(getconf CLK_TCK)
+
+printf "server\targs\tsize\tconc\trate\treq_s\tmb_s\tavg_us\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\terrors\tunfinished\tsrv_cpu_pct\tsrv_vcsw\tsrv_ivcsw\tsys_cpu_pct\n"
+
+echo "$CONFS" | while read SRV ARGS; do
+    CNAME=$(echo "$SRV $ARGS" | tr -c 'A-Za-z0-9\n' '_')
+    for s in $SIZES; do
+        for c in $CONCS; do
+            dbg "running $SRV $ARGS, size $s, concurrency $c"
+            "$BINDIR/$SRV" -p $PORT -r "$WORKDIR/www" $ARGS \
+                > "$WORKDIR/$CNAME.$s.$c.srv" 2>&1 < /dev/null &
+            SPID=$!
+            sleep 1
+            if ! kill -0 $SPID 2>/dev/null; then
+                echo "$SRV $ARGS failed to start, see $WORKDIR/$CNAME.$s.$c.srv" >&2
+                continue
+            fi
+            if [ $WARMUP -gt 0 ]; then
+                "$BINDIR/httpload" -p $PORT -t $LTHREADS -c $c -P $PIPELINE \
+                    -d $WARMUP -l "$WORKDIR/$s.lst" > /dev/null 2>&1 < /dev/null
+            fi
+            T0=$(cputicks $SPID)
+            S0=$(syscpu)
+            "$BINDIR/httpload" -p $PORT -t $LTHREADS -c $c -P $PIPELINE \
+                -d $DURATION -r $RATE -l "$WORKDIR/$s.lst" \
+                > "$WORKDIR/$CNAME.$s.$c.load" 2>&1 < /dev/null
+            T1=$(cputicks $SPID)
+            S1=$(syscpu)
+            CSW=$(ctxsw $SPID)
+            kill -INT $SPID
+            wait $SPID
+            printf "%s\t%s\t%s\t%s\t%s\t%s\t%.1f\t%s\t%s\t%.1f\n" "$SRV" "$ARGS" $s $c $RATE \
+                "$(parseload "$WORKDIR/$CNAME.$s.$c.load")" \
+                $(echo "$T0 $T1 $CLKTCK $DURATION" | awk '{ print 100 * ($2 - $1) / $3 / $4 }') \
+                $(echo $CSW | cut -d ' ' -f 1) $(echo $CSW | cut -d ' ' -f 2) \
+                $(echo "$S0 $S1" | awk '{ print $4 == $2 ? 0: 100 * ($3 - $1) / ($4 - $2) }')
+        done
+    done
+done
+
+if [ $KEEP -eq 0 ] && [ $TMPWORK -ne 0 ]; then
+    rm -rf "$WORKDIR"
+else
+    echo "results and logs in $WORKDIR" >&2
+fi
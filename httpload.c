@@ -0,0 +1,1056 @@
+/*    Copyright 2023 Davide Libenzi
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ *
+ */
+
+
+/*
+ * HTTP/1.1 load generator for thrhttp and thrplhttp. Every thread drives
+ * its share of the connections out of its own epoll set.
+ *
+ * In closed-loop mode (no --rate) each connection keeps --pipeline
+ * requests in flight, and the throughput is whatever the server sustains.
+ * In open-loop mode requests are issued on a fixed schedule, and latency
+ * is measured from the time a request was supposed to be sent, not from
+ * when a free connection finally got to send it. A stalling server then
+ * shows up in the percentiles, instead of silently throttling the load
+ * (coordinated omission). The plain service time is reported as well.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+
+
+#define MAX_URLS 256
+#define MAX_PIPELINE 64
+#define REQ_MAXSIZE 1280
+#define HOST_MAXSIZE 128
+#define HDR_MAXSIZE 8192
+#define RDBUF_SIZE (64 * 1024)
+#define MAX_EVENTS 256
+#define RECONNECT_NS 10000000ULL
+
+/*
+ * Log-linear latency histogram (nanoseconds), in the HdrHistogram style:
+ * values below 2048 are counted exactly, above that each power of two
+ * range is split in 1024 buckets, which keeps 3 significant digits.
+ */
+#define HIST_SUBBITS 10
+#define HIST_SUBCOUNT (1 << HIST_SUBBITS)
+#define HIST_MAXSHIFT 30
+#define HIST_SIZE (2 * HIST_SUBCOUNT + HIST_MAXSHIFT * HIST_SUBCOUNT)
+
+
+
+enum conn_states {
+	CS_DEAD,
+	CS_CONNECTING,
+	CS_READY
+};
+
+struct url {
+	char const *path;
+	unsigned long weight;
+};
+
+struct hist {
+	unsigned long long count, sum, min, max;
+	double sumsq;
+	unsigned long long *buckets;
+};
+
+/*
+ * @tint is the time each in-flight request was meant to go out, @tsend the
+ * time it actually did. They are rings of @depth entries, @rhead being the
+ * oldest request, which is the one the next response belongs to.
+ */
+struct hconn {
+	int fd, state, inq;
+	int inflight, rhead, nsent;
+	unsigned long long tint[MAX_PIPELINE], tsend[MAX_PIPELINE];
+	unsigned long long retry;
+	char *obuf;
+	size_t olen, ooff;
+	char hdr[HDR_MAXSIZE];
+	size_t hlen;
+	int inbody, tillclose, cclose, status;
+	long long bleft;
+};
+
+struct load_thread {
+	pthread_t thid;
+	int idx, epfd, tmrfd;
+	int nconns;
+	struct hconn *conns;
+	int *cq, cqhead, cqcount;
+	unsigned long long rng;
+	size_t rpos;
+	/* Open-loop schedule: request k is due at t0 + k * iv */
+	unsigned long long t0, iv, nextk;
+	unsigned long long reqs, bytes, conns_made, conn_errs, io_errs;
+	unsigned long long st2xx, stother, unfinished, late, lagmax;
+	struct hist lat, svc;
+	char *rdbuf;
+};
+
+static volatile int stop_load, measuring;
+static struct sockaddr_in saddr;
+static char const *host = "127.0.0.1";
+static int port = 80;
+static int pipeline = 1, keepalive = 1;
+static unsigned long long rate;
+static struct url urls[MAX_URLS];
+static int nurls;
+static unsigned long long *ucumw;
+static char **rpaths;
+static size_t nrpaths;
+
+
+
+static void *xmalloc(size_t size)
+{
+	void *data = malloc(size);
+
+	if (data == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	return data;
+}
+
+static unsigned long long get_nstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long xorshift64(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int hist_index(unsigned long long v)
+{
+	int shift;
+
+	if (v < 2 * HIST_SUBCOUNT)
+		return (int) v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUBBITS;
+	if (shift > HIST_MAXSHIFT)
+		return HIST_SIZE - 1;
+
+	return 2 * HIST_SUBCOUNT + (shift - 1) * HIST_SUBCOUNT +
+		(int) ((v >> shift) - HIST_SUBCOUNT);
+}
+
+/*
+ * Highest value which lands in bucket @idx.
+ */
+static unsigned long long hist_value(int idx)
+{
+	int shift;
+	unsigned long long sub;
+
+	if (idx < 2 * HIST_SUBCOUNT)
+		return (unsigned long long) idx;
+	shift = (idx - 2 * HIST_SUBCOUNT) / HIST_SUBCOUNT + 1;
+	sub = (idx - 2 * HIST_SUBCOUNT) % HIST_SUBCOUNT + HIST_SUBCOUNT;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+static void hist_init(struct hist *h)
+{
+	h->count = h->sum = h->max = 0;
+	h->min = ~0ULL;
+	h->sumsq = 0.0;
+	h->buckets = (unsigned long long *)
+		xmalloc(HIST_SIZE * sizeof(unsigned long long));
+	memset(h->buckets, 0, HIST_SIZE * sizeof(unsigned long long));
+}
+
+static void hist_add(struct hist *h, unsigned long long v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	h->sumsq += (double) v * v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *h, struct hist const *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_SIZE; i++)
+		h->buckets[i] += src->buckets[i];
+	h->count += src->count;
+	h->sum += src->sum;
+	h->sumsq += src->sumsq;
+	if (src->min < h->min)
+		h->min = src->min;
+	if (src->max > h->max)
+		h->max = src->max;
+}
+
+static unsigned long long hist_percentile(struct hist const *h, double pct)
+{
+	int i;
+	unsigned long long cnt = 0, target;
+
+	target = (unsigned long long) ceil(pct / 100.0 * h->count);
+	if (target == 0)
+		target = 1;
+	for (i = 0; i < HIST_SIZE; i++)
+		if ((cnt += h->buckets[i]) >= target)
+			break;
+
+	return i < HIST_SIZE ? (hist_value(i) < h->max ? hist_value(i): h->max):
+		h->max;
+}
+
+static void hist_report(struct hist const *h, char const *name)
+{
+	int i;
+	double avg, stdev;
+	static double const pcts[] = {
+		50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 99.999, 100.0
+	};
+
+	if (h->count == 0)
+		return;
+	avg = (double) h->sum / h->count;
+	stdev = sqrt(h->sumsq / h->count - avg * avg);
+	fprintf(stdout,
+		"%s\n"
+		"  Min/Avg/Max ...: %.3lf / %.3lf / %.3lf us\n"
+		"  Stdev .........: %.3lf us\n", name, h->min / 1e3, avg / 1e3,
+		h->max / 1e3, stdev / 1e3);
+	for (i = 0; i < (int) (sizeof(pcts) / sizeof(pcts[0])); i++)
+		fprintf(stdout, "  %8.3lf%% ......: %.3lf us\n", pcts[i],
+			hist_percentile(h, pcts[i]) / 1e3);
+}
+
+/*
+ * The HdrHistogram percentile distribution output, with five ticks per
+ * halving of the distance to 100%. It can be fed to the usual plotting
+ * tools.
+ */
+static void hist_spectrum(struct hist const *h, char const *name)
+{
+	int i, ticks = 5;
+	unsigned long long cnt = 0;
+	double pct, next = 0.0, half = 50.0;
+
+	if (h->count == 0)
+		return;
+	fprintf(stdout, "\n%s\n%12s %14s %12s %14s\n\n", name, "Value(us)",
+		"Percentile", "TotalCount", "1/(1-Percentile)");
+	for (i = 0; i < HIST_SIZE; i++) {
+		if (h->buckets[i] == 0)
+			continue;
+		cnt += h->buckets[i];
+		pct = 100.0 * cnt / h->count;
+		if (pct < next && cnt < h->count)
+			continue;
+		if (cnt < h->count)
+			fprintf(stdout, "%12.3lf %14.12lf %12llu %14.2lf\n",
+				hist_value(i) / 1e3, pct / 100.0, cnt,
+				1.0 / (1.0 - pct / 100.0));
+		else
+			fprintf(stdout, "%12.3lf %14.12lf %12llu %14s\n",
+				h->max / 1e3, 1.0, cnt, "inf");
+		while (next <= pct && half > 1e-9) {
+			next += half / ticks;
+			if (next >= 100.0 - half + 1e-12)
+				half /= 2.0;
+		}
+	}
+	fprintf(stdout,
+		"#[Mean    = %12.3lf, StdDeviation   = %12.3lf]\n"
+		"#[Max     = %12.3lf, Total count    = %12llu]\n",
+		(double) h->sum / h->count / 1e3,
+		sqrt(h->sumsq / h->count - ((double) h->sum / h->count) *
+		     ((double) h->sum / h->count)) / 1e3, h->max / 1e3,
+		h->count);
+}
+
+/*
+ * Accepts either a bare path, or a Common/Combined Log Format line, from
+ * which the path of the (GET) request is taken.
+ */
+static char *log_path(char *ln)
+{
+	char *ptr, *end;
+
+	if ((ptr = strstr(ln, "\"GET ")) != NULL)
+		ptr += 5;
+	else if (strstr(ln, "\"") != NULL)
+		return NULL;
+	else
+		for (ptr = ln; *ptr == ' ' || *ptr == '\t'; ptr++);
+	if (*ptr != '/')
+		return NULL;
+	for (end = ptr; *end != '\0' && *end != ' ' && *end != '\t' &&
+		     *end != '\r' && *end != '\n'; end++);
+	*end = '\0';
+
+	return end - ptr < REQ_MAXSIZE - 256 ? ptr: NULL;
+}
+
+static int load_replay(char const *path)
+{
+	size_t size = 0;
+	char *ptr, ln[4096];
+	FILE *file;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(ln, sizeof(ln), file) != NULL) {
+		if ((ptr = log_path(ln)) == NULL)
+			continue;
+		if (nrpaths == size) {
+			size = size ? 2 * size: 1024;
+			if ((rpaths = (char **) realloc(rpaths, size * sizeof(char *))) == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		rpaths[nrpaths++] = strdup(ptr);
+	}
+	fclose(file);
+	if (nrpaths == 0) {
+		fprintf(stderr, "no requests found in %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static char const *next_path(struct load_thread *lth)
+{
+	int lo, hi, mid;
+	unsigned long long w;
+
+	if (nrpaths > 0) {
+		if (lth->rpos >= nrpaths)
+			lth->rpos = 0;
+		return rpaths[lth->rpos++];
+	}
+	if (nurls == 1)
+		return urls[0].path;
+	w = xorshift64(&lth->rng) % ucumw[nurls - 1];
+	for (lo = 0, hi = nurls - 1; lo < hi;) {
+		mid = (lo + hi) / 2;
+		if (w < ucumw[mid])
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return urls[lo].path;
+}
+
+static void conn_enqueue(struct load_thread *lth, struct hconn *conn)
+{
+	if (conn->inq)
+		return;
+	conn->inq = 1;
+	lth->cq[(lth->cqhead + lth->cqcount++) % lth->nconns] =
+		(int) (conn - lth->conns);
+}
+
+static int conn_can_send(struct hconn const *conn)
+{
+	return conn->state == CS_READY && conn->olen == 0 &&
+		conn->inflight < pipeline && (keepalive || conn->nsent == 0);
+}
+
+static void conn_open(struct load_thread *lth, struct hconn *conn)
+{
+	int one = 1;
+	struct epoll_event ev;
+
+	conn->inflight = conn->rhead = conn->nsent = 0;
+	conn->olen = conn->ooff = conn->hlen = 0;
+	conn->inbody = 0;
+	if ((conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		perror("socket");
+		goto failed;
+	}
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(conn->fd, (struct sockaddr *) &saddr, sizeof(saddr)) != 0 &&
+	    errno != EINPROGRESS)
+		goto failed;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(lth->epfd, EPOLL_CTL_ADD, conn->fd, &ev) != 0) {
+		perror("epoll_ctl");
+		goto failed;
+	}
+	conn->state = CS_CONNECTING;
+
+	return;
+
+failed:
+	if (conn->fd != -1)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->state = CS_DEAD;
+	conn->retry = get_nstime() + RECONNECT_NS;
+	lth->conn_errs++;
+}
+
+/*
+ * Requests still in flight on a connection going down are lost, and so
+ * counted as errors. The connection is reopened right away (or after a
+ * short delay, if the connect itself failed).
+ */
+static void conn_reset(struct load_thread *lth, struct hconn *conn, int error)
+{
+	if (error)
+		lth->io_errs += conn->inflight;
+	close(conn->fd);
+	conn->fd = -1;
+	conn->state = CS_DEAD;
+	if (!stop_load)
+		conn_open(lth, conn);
+}
+
+static int conn_flush(struct load_thread *lth, struct hconn *conn)
+{
+	ssize_t n;
+	struct epoll_event ev;
+
+	while (conn->ooff < conn->olen) {
+		if ((n = send(conn->fd, conn->obuf + conn->ooff,
+			      conn->olen - conn->ooff, MSG_NOSIGNAL)) < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			ev.events = EPOLLIN | EPOLLOUT;
+			ev.data.ptr = conn;
+			epoll_ctl(lth->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+			return 0;
+		}
+		conn->ooff += n;
+	}
+	conn->olen = conn->ooff = 0;
+
+	return 0;
+}
+
+/*
+ * Queues a request meant to be sent at @tint into the connection output
+ * buffer, which is flushed by the caller.
+ */
+static void conn_add_req(struct load_thread *lth, struct hconn *conn,
+			 unsigned long long tint, unsigned long long now)
+{
+	int slot, n;
+	size_t room = pipeline * REQ_MAXSIZE - conn->olen;
+
+	slot = (conn->rhead + conn->inflight) % MAX_PIPELINE;
+	conn->tint[slot] = tint;
+	conn->tsend[slot] = now;
+	conn->inflight++;
+	conn->nsent++;
+	n = snprintf(conn->obuf + conn->olen, room,
+		     "GET %s HTTP/1.1\r\n"
+		     "Host: %s\r\n"
+		     "%s"
+		     "\r\n", next_path(lth), host,
+		     keepalive ? "": "Connection: close\r\n");
+	/*
+	 * Host and paths are checked against REQ_MAXSIZE up front, so this
+	 * is a bug rather than something to recover from.
+	 */
+	if (n < 0 || (size_t) n >= room) {
+		fprintf(stderr, "request does not fit the output buffer\n");
+		abort();
+	}
+	conn->olen += n;
+	if (now - tint > 1000000ULL && measuring) {
+		lth->late++;
+		if (now - tint > lth->lagmax)
+			lth->lagmax = now - tint;
+	}
+}
+
+static void dispatch(struct load_thread *lth)
+{
+	int n;
+	unsigned long long now, due;
+	struct hconn *conn;
+	struct itimerspec its;
+
+	now = get_nstime();
+	due = rate > 0 ? (now >= lth->t0 ? (now - lth->t0) / lth->iv + 1: 0):
+		~0ULL;
+	while (lth->nextk < due && lth->cqcount > 0) {
+		conn = lth->conns + lth->cq[lth->cqhead];
+		lth->cqhead = (lth->cqhead + 1) % lth->nconns;
+		lth->cqcount--;
+		conn->inq = 0;
+		if (!conn_can_send(conn))
+			continue;
+		for (n = 0; conn->inflight < pipeline && lth->nextk < due &&
+			     (keepalive || n == 0); n++)
+			conn_add_req(lth, conn, rate > 0 ?
+				     lth->t0 + lth->nextk++ * lth->iv: now, now);
+		if (conn_flush(lth, conn) < 0) {
+			conn_reset(lth, conn, 1);
+			continue;
+		}
+		if (conn_can_send(conn))
+			conn_enqueue(lth, conn);
+	}
+	/*
+	 * If we are behind schedule, the next completion is what unblocks
+	 * us, otherwise sleep until the next request is due.
+	 */
+	if (rate > 0 && lth->nextk >= due) {
+		due = lth->t0 + lth->nextk * lth->iv;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = due / 1000000000ULL;
+		its.it_value.tv_nsec = due % 1000000000ULL;
+		timerfd_settime(lth->tmrfd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+}
+
+static void req_done(struct load_thread *lth, struct hconn *conn)
+{
+	unsigned long long now = get_nstime();
+
+	if (measuring) {
+		hist_add(&lth->lat, now - conn->tint[conn->rhead]);
+		hist_add(&lth->svc, now - conn->tsend[conn->rhead]);
+		lth->reqs++;
+		if (conn->status >= 200 && conn->status < 300)
+			lth->st2xx++;
+		else
+			lth->stother++;
+	}
+	conn->rhead = (conn->rhead + 1) % MAX_PIPELINE;
+	conn->inflight--;
+	conn->inbody = 0;
+	conn->hlen = 0;
+}
+
+static int parse_header(struct hconn *conn)
+{
+	char *ptr, *eol;
+
+	if (strncmp(conn->hdr, "HTTP/1.", 7) != 0 ||
+	    (ptr = strchr(conn->hdr, ' ')) == NULL)
+		return -1;
+	conn->status = atoi(ptr + 1);
+	conn->bleft = 0;
+	conn->tillclose = 1;
+	conn->cclose = strncmp(conn->hdr, "HTTP/1.0", 8) == 0;
+	for (ptr = strstr(conn->hdr, "\r\n"); ptr != NULL; ptr = eol) {
+		ptr += 2;
+		if ((eol = strstr(ptr, "\r\n")) == NULL || eol == ptr)
+			break;
+		if (strncasecmp(ptr, "Content-Length:", 15) == 0) {
+			conn->bleft = atoll(ptr + 15);
+			conn->tillclose = 0;
+		} else if (strncasecmp(ptr, "Connection:", 11) == 0) {
+			for (ptr += 11; *ptr == ' '; ptr++);
+			if (strncasecmp(ptr, "close", 5) == 0)
+				conn->cclose = 1;
+			else if (strncasecmp(ptr, "keep-alive", 10) == 0)
+				conn->cclose = 0;
+		}
+	}
+	if (conn->status == 204 || conn->status == 304)
+		conn->tillclose = 0;
+
+	return 0;
+}
+
+/*
+ * Feeds received data to the response parser. Returns the number of
+ * responses completed, or -1 on protocol errors.
+ */
+static int conn_input(struct load_thread *lth, struct hconn *conn,
+		      char const *data, size_t n)
+{
+	int ndone = 0;
+	size_t cnt, start;
+	char *eoh;
+
+	while (n > 0) {
+		if (conn->inflight == 0)
+			return -1;
+		if (conn->inbody) {
+			cnt = conn->tillclose || (long long) n < conn->bleft ?
+				n: (size_t) conn->bleft;
+			conn->bleft -= cnt;
+			if (measuring)
+				lth->bytes += cnt;
+			data += cnt;
+			n -= cnt;
+			if (!conn->tillclose && conn->bleft == 0) {
+				req_done(lth, conn);
+				ndone++;
+			}
+			continue;
+		}
+		start = conn->hlen > 3 ? conn->hlen - 3: 0;
+		cnt = n < HDR_MAXSIZE - 1 - conn->hlen ? n:
+			HDR_MAXSIZE - 1 - conn->hlen;
+		memcpy(conn->hdr + conn->hlen, data, cnt);
+		conn->hdr[conn->hlen + cnt] = '\0';
+		if ((eoh = strstr(conn->hdr + start, "\r\n\r\n")) == NULL) {
+			if ((conn->hlen += cnt) == HDR_MAXSIZE - 1)
+				return -1;
+			data += cnt;
+			n -= cnt;
+			continue;
+		}
+		cnt = (size_t) (eoh + 4 - conn->hdr) - conn->hlen;
+		eoh[2] = '\0';
+		if (parse_header(conn) < 0)
+			return -1;
+		if (measuring)
+			lth->bytes += conn->hlen + cnt;
+		data += cnt;
+		n -= cnt;
+		conn->inbody = 1;
+		if (!conn->tillclose && conn->bleft == 0) {
+			req_done(lth, conn);
+			ndone++;
+		}
+	}
+
+	return ndone;
+}
+
+static void conn_event(struct load_thread *lth, struct hconn *conn,
+		       unsigned int events)
+{
+	int error, ndone = 0;
+	socklen_t len = sizeof(error);
+	ssize_t n;
+	struct epoll_event ev;
+
+	if (conn->state == CS_CONNECTING) {
+		if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 ||
+		    error != 0) {
+			epoll_ctl(lth->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+			close(conn->fd);
+			conn->fd = -1;
+			conn->state = CS_DEAD;
+			conn->retry = get_nstime() + RECONNECT_NS;
+			lth->conn_errs++;
+			return;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		epoll_ctl(lth->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+		conn->state = CS_READY;
+		lth->conns_made++;
+		conn_enqueue(lth, conn);
+		return;
+	}
+	if (events & EPOLLOUT) {
+		if (conn_flush(lth, conn) < 0) {
+			conn_reset(lth, conn, 1);
+			return;
+		}
+		if (conn->olen == 0) {
+			ev.events = EPOLLIN;
+			ev.data.ptr = conn;
+			epoll_ctl(lth->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+		}
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		while ((n = recv(conn->fd, lth->rdbuf, RDBUF_SIZE, 0)) > 0) {
+			if ((error = conn_input(lth, conn, lth->rdbuf, n)) < 0) {
+				conn_reset(lth, conn, 1);
+				return;
+			}
+			ndone += error;
+			if (n < RDBUF_SIZE)
+				break;
+		}
+		if (n == 0 || (n < 0 && errno != EAGAIN)) {
+			/*
+			 * A response delimited by the connection close.
+			 */
+			if (n == 0 && conn->inbody && conn->tillclose)
+				req_done(lth, conn);
+			conn_reset(lth, conn, conn->inflight > 0);
+			return;
+		}
+		if (ndone > 0 && conn->inflight == 0 &&
+		    (!keepalive || conn->cclose)) {
+			conn_reset(lth, conn, 0);
+			return;
+		}
+	}
+	if (conn_can_send(conn))
+		conn_enqueue(lth, conn);
+}
+
+static void *load_thproc(void *data)
+{
+	int i, n, timeo;
+	unsigned long long now, tnext;
+	struct load_thread *lth = (struct load_thread *) data;
+	struct hconn *conn;
+	struct epoll_event ev, evs[MAX_EVENTS];
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(lth->epfd, EPOLL_CTL_ADD, lth->tmrfd, &ev);
+	for (i = 0; i < lth->nconns; i++)
+		conn_open(lth, lth->conns + i);
+
+	while (!stop_load) {
+		for (i = 0, tnext = ~0ULL; i < lth->nconns; i++)
+			if (lth->conns[i].state == CS_DEAD &&
+			    lth->conns[i].retry < tnext)
+				tnext = lth->conns[i].retry;
+		now = get_nstime();
+		timeo = tnext == ~0ULL ? 100: tnext > now ?
+			(int) ((tnext - now) / 1000000ULL) + 1: 0;
+		if ((n = epoll_wait(lth->epfd, evs, MAX_EVENTS, timeo)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if ((conn = (struct hconn *) evs[i].data.ptr) == NULL) {
+				read(lth->tmrfd, &now, sizeof(now));
+				continue;
+			}
+			conn_event(lth, conn, evs[i].events);
+		}
+		if (tnext != ~0ULL)
+			for (i = 0, now = get_nstime(); i < lth->nconns; i++)
+				if (lth->conns[i].state == CS_DEAD &&
+				    lth->conns[i].retry <= now)
+					conn_open(lth, lth->conns + i);
+		dispatch(lth);
+	}
+
+	for (i = 0; i < lth->nconns; i++)
+		if (lth->conns[i].fd != -1) {
+			lth->unfinished += lth->conns[i].inflight;
+			close(lth->conns[i].fd);
+		}
+	/*
+	 * Requests which became due, but never found a connection.
+	 */
+	if (rate > 0 && (now = get_nstime()) > lth->t0 &&
+	    (now - lth->t0) / lth->iv + 1 > lth->nextk)
+		lth->unfinished += (now - lth->t0) / lth->iv + 1 - lth->nextk;
+
+	return NULL;
+}
+
+static void usage(char const *prg)
+{
+	fprintf(stderr,
+		"Use: %s [-h,--help] [-s,--server HOST] [-p,--port PORTNO]\n"
+		"\t[-c,--conns NUM] [-t,--threads NUM] [-d,--duration SEC]\n"
+		"\t[-w,--warmup SEC] [-r,--rate REQS] [-P,--pipeline NUM]\n"
+		"\t[-K,--no-keepalive] [-u,--url PATH[,WEIGHT]]...\n"
+		"\t[-l,--replay LOGFILE] [-H,--hdr-spectrum]\n", prg);
+}
+
+static void sig_int(int sig)
+{
+	stop_load = 1;
+}
+
+int main(int ac, char **av)
+{
+	int i, j, nthreads = 2, nconns = 16, duration = 10, warmup = 0,
+		spectrum = 0;
+	char *ptr;
+	char const *replay = NULL;
+	unsigned long long tstart, tend, reqs, bytes, conns_made, conn_errs,
+		io_errs, st2xx, stother, unfinished, late, lagmax;
+	double secs;
+	struct hostent *he;
+	struct load_thread *lths, *lth;
+	struct hist lat, svc;
+
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "--server") == 0 ||
+		    strcmp(av[i], "-s") == 0) {
+			if (++i < ac)
+				host = av[i];
+		} else if (strcmp(av[i], "--port") == 0 ||
+			   strcmp(av[i], "-p") == 0) {
+			if (++i < ac)
+				port = atoi(av[i]);
+		} else if (strcmp(av[i], "--conns") == 0 ||
+			   strcmp(av[i], "-c") == 0) {
+			if (++i < ac)
+				nconns = atoi(av[i]);
+		} else if (strcmp(av[i], "--threads") == 0 ||
+			   strcmp(av[i], "-t") == 0) {
+			if (++i < ac)
+				nthreads = atoi(av[i]);
+		} else if (strcmp(av[i], "--duration") == 0 ||
+			   strcmp(av[i], "-d") == 0) {
+			if (++i < ac)
+				duration = atoi(av[i]);
+		} else if (strcmp(av[i], "--warmup") == 0 ||
+			   strcmp(av[i], "-w") == 0) {
+			if (++i < ac)
+				warmup = atoi(av[i]);
+		} else if (strcmp(av[i], "--rate") == 0 ||
+			   strcmp(av[i], "-r") == 0) {
+			if (++i < ac)
+				rate = strtoull(av[i], NULL, 0);
+		} else if (strcmp(av[i], "--pipeline") == 0 ||
+			   strcmp(av[i], "-P") == 0) {
+			if (++i < ac)
+				pipeline = atoi(av[i]);
+		} else if (strcmp(av[i], "--no-keepalive") == 0 ||
+			   strcmp(av[i], "-K") == 0) {
+			keepalive = 0;
+		} else if (strcmp(av[i], "--url") == 0 ||
+			   strcmp(av[i], "-u") == 0) {
+			if (++i < ac && nurls < MAX_URLS) {
+				urls[nurls].weight = 1;
+				if ((ptr = strrchr(av[i], ',')) != NULL) {
+					*ptr++ = '\0';
+					urls[nurls].weight = strtoul(ptr, NULL, 0);
+				}
+				urls[nurls++].path = av[i];
+			}
+		} else if (strcmp(av[i], "--replay") == 0 ||
+			   strcmp(av[i], "-l") == 0) {
+			if (++i < ac)
+				replay = av[i];
+		} else if (strcmp(av[i], "--hdr-spectrum") == 0 ||
+			   strcmp(av[i], "-H") == 0) {
+			spectrum = 1;
+		} else {
+			usage(av[0]);
+			return 1;
+		}
+	}
+	if (nthreads < 1 || nconns < 1 || duration < 1 || pipeline < 1 ||
+	    pipeline > MAX_PIPELINE) {
+		usage(av[0]);
+		return 1;
+	}
+	if (!keepalive)
+		pipeline = 1;
+	if (nthreads > nconns)
+		nthreads = nconns;
+	if (nurls == 0) {
+		urls[0].path = "/";
+		urls[0].weight = 1;
+		nurls = 1;
+	}
+	ucumw = (unsigned long long *) xmalloc(nurls * sizeof(unsigned long long));
+	for (i = 0; i < nurls; i++) {
+		if (*urls[i].path != '/' ||
+		    strlen(urls[i].path) >= REQ_MAXSIZE - 256 ||
+		    urls[i].weight == 0) {
+			fprintf(stderr, "invalid URL: %s\n", urls[i].path);
+			return 1;
+		}
+		ucumw[i] = (i > 0 ? ucumw[i - 1]: 0) + urls[i].weight;
+	}
+	/*
+	 * Paths get REQ_MAXSIZE - 256 bytes, which leaves the host and the
+	 * fixed part of the request the rest.
+	 */
+	if (strlen(host) >= HOST_MAXSIZE) {
+		fprintf(stderr, "host name too long: %s\n", host);
+		return 1;
+	}
+	if (replay != NULL && load_replay(replay) < 0)
+		return 2;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons((short int) port);
+	if (inet_aton(host, &saddr.sin_addr) == 0) {
+		if ((he = gethostbyname(host)) == NULL) {
+			fprintf(stderr, "unable to resolve: %s\n", host);
+			return 2;
+		}
+		memcpy(&saddr.sin_addr, he->h_addr_list[0], 4);
+	}
+
+	signal(SIGINT, sig_int);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stdout,
+		"Target                      : %s:%d\n"
+		"Number of Thread(s)         : %d\n"
+		"Number of Connection(s)     : %d\n"
+		"Pipeline Depth              : %d\n"
+		"Keep-Alive                  : %s\n", host, port, nthreads,
+		nconns, pipeline, keepalive ? "yes": "no");
+	if (rate > 0)
+		fprintf(stdout,
+			"Mode                        : open loop, %llu req/s\n",
+			rate);
+	else
+		fprintf(stdout,
+			"Mode                        : closed loop\n");
+	if (nrpaths > 0)
+		fprintf(stdout,
+			"Replayed Request(s)         : %zu\n", nrpaths);
+	else
+		fprintf(stdout,
+			"URL Mix                     : %d URL(s)\n", nurls);
+	fflush(stdout);
+
+	measuring = warmup == 0;
+	tstart = get_nstime();
+	lths = (struct load_thread *) xmalloc(nthreads * sizeof(struct load_thread));
+	for (i = 0; i < nthreads; i++) {
+		lth = lths + i;
+		memset(lth, 0, sizeof(*lth));
+		lth->idx = i;
+		lth->nconns = nconns / nthreads + (i < nconns % nthreads);
+		lth->conns = (struct hconn *) xmalloc(lth->nconns * sizeof(struct hconn));
+		for (j = 0; j < lth->nconns; j++) {
+			lth->conns[j].fd = -1;
+			lth->conns[j].state = CS_DEAD;
+			lth->conns[j].inq = 0;
+			lth->conns[j].obuf = (char *) xmalloc(pipeline * REQ_MAXSIZE);
+		}
+		lth->cq = (int *) xmalloc(lth->nconns * sizeof(int));
+		lth->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+		lth->rpos = nrpaths * i / nthreads;
+		if (rate > 0) {
+			lth->iv = 1000000000ULL * nthreads / rate;
+			if (lth->iv == 0)
+				lth->iv = 1;
+			lth->t0 = tstart + lth->iv * i / nthreads;
+		}
+		hist_init(&lth->lat);
+		hist_init(&lth->svc);
+		lth->rdbuf = (char *) xmalloc(RDBUF_SIZE);
+		if ((lth->epfd = epoll_create1(0)) == -1 ||
+		    (lth->tmrfd = timerfd_create(CLOCK_MONOTONIC,
+						 TFD_NONBLOCK)) == -1) {
+			perror("epoll/timerfd");
+			return 3;
+		}
+		if (pthread_create(&lth->thid, NULL, load_thproc, lth) != 0) {
+			perror("pthread_create");
+			return 3;
+		}
+	}
+
+	if (warmup > 0) {
+		sleep(warmup);
+		measuring = 1;
+	}
+	tstart = get_nstime();
+	for (i = 0; i < duration && !stop_load; i++)
+		sleep(1);
+	/*
+	 * Connections closed by the threads exiting first could unblock
+	 * requests on the others, which must not make it into the stats.
+	 */
+	measuring = 0;
+	stop_load = 1;
+	tend = get_nstime();
+
+	hist_init(&lat);
+	hist_init(&svc);
+	reqs = bytes = conns_made = conn_errs = io_errs = st2xx = stother = 0;
+	unfinished = late = lagmax = 0;
+	for (i = 0; i < nthreads; i++) {
+		lth = lths + i;
+		pthread_join(lth->thid, NULL);
+		hist_merge(&lat, &lth->lat);
+		hist_merge(&svc, &lth->svc);
+		reqs += lth->reqs;
+		bytes += lth->bytes;
+		conns_made += lth->conns_made;
+		conn_errs += lth->conn_errs;
+		io_errs += lth->io_errs;
+		st2xx += lth->st2xx;
+		stother += lth->stother;
+		unfinished += lth->unfinished;
+		late += lth->late;
+		if (lth->lagmax > lagmax)
+			lagmax = lth->lagmax;
+	}
+	secs = (tend - tstart) / 1e9;
+
+	fprintf(stdout,
+		"\n"
+		"Duration ........: %.3lf s\n"
+		"Connections .....: %llu made, %llu failed\n"
+		"Requests ........: %llu (%.1lf req/s)\n"
+		"Responses .......: %llu 2xx, %llu other\n"
+		"Errors ..........: %llu I/O, %llu unfinished\n"
+		"Total Bytes .....: %llu (%.2lf MB/s)\n", secs, conns_made,
+		conn_errs, reqs, reqs / secs, st2xx, stother, io_errs, unfinished,
+		bytes, bytes / secs / (1024.0 * 1024.0));
+	if (rate > 0) {
+		fprintf(stdout,
+			"Late Sends ......: %llu (>1ms behind schedule), %.3lf us max lag\n",
+			late, lagmax / 1e3);
+		hist_report(&lat, "Latency (from intended send time):");
+		hist_report(&svc, "Service Time (from actual send time):");
+	} else
+		hist_report(&lat, "Latency:");
+	if (spectrum)
+		hist_spectrum(&lat, "Latency Percentile Spectrum:");
+
+	return 0;
+}
+
@@ -24,6 +24,8 @@
 #include <pthread.h>
 #include <sched.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <math.h>
 
 
@@ -38,6 +40,15 @@
 #define NR_ITERS	100
 #define MAX_CPUS	128
 
+#define QS_LOCKED	(1U << 0)
+#define QS_PENDING	(1U << 8)
+#define QS_LOCKED_MASK	0xffU
+#define QS_LP_MASK	0xffffU
+#define QS_TAIL_SHIFT	16
+#define QS_TAIL_MASK	0xffff0000U
+
+#define ADAPTIVE_SPIN	10000
+
 
 
 #define rdtscll(val) do { \
@@ -58,11 +69,71 @@ typedef struct {
 	unsigned int slock;
 } __attribute__((__aligned__(128))) spinlock_t;
 
+/*
+ * MCS queue node, also used by the queued spinlock. Every thread owns one
+ * node, which is enough since a thread never holds, or waits for, more
+ * than one lock at a time in the ring test.
+ */
+struct mcs_node {
+	struct mcs_node *next;
+	int locked;
+} __attribute__((__aligned__(128)));
+
+typedef struct {
+	struct mcs_node *tail;
+} __attribute__((__aligned__(128))) mcslock_t;
+
+struct clh_node {
+	int locked;
+} __attribute__((__aligned__(128)));
+
+typedef struct {
+	struct clh_node *tail;
+} __attribute__((__aligned__(128))) clhlock_t;
+
+/*
+ * Linux-style queued spinlock word: locked byte, pending bit and, in the
+ * upper 16 bits, the MCS tail as the queued thread index plus one.
+ */
+typedef struct {
+	union {
+		unsigned int val;
+		struct {
+			unsigned char locked;
+			unsigned char pending;
+		};
+		struct {
+			unsigned short locked_pending;
+			unsigned short tail;
+		};
+	};
+} __attribute__((__aligned__(128))) qspinlock_t;
+
+/*
+ * Futex mutex word: 0 unlocked, 1 locked, 2 locked with (maybe) waiters.
+ */
+typedef struct {
+	int val;
+} __attribute__((__aligned__(128))) fmutex_t;
+
+typedef struct {
+	pthread_mutex_t mtx;
+} __attribute__((__aligned__(128))) ptmutex_t;
+
+/*
+ * Cycle stamp taken by the thread which last released a lock.
+ */
+struct rel_stamp {
+	unsigned long long ts;
+} __attribute__((__aligned__(128)));
+
 struct thread_ctx {
 	int cpu;
 	pthread_t tid;
 	unsigned long long samples[MAX_SAMPLES];
 	double avg, sig;
+	unsigned long long tstart, tend;
+	unsigned long long hsum, hmax;
 };
 
 struct test_desc {
@@ -74,9 +145,27 @@ struct test_desc {
 
 static tspinlock_t tspin[MAX_CPUS];
 static spinlock_t spin[MAX_CPUS];
+static mcslock_t mcs[MAX_CPUS];
+static clhlock_t clh[MAX_CPUS];
+static qspinlock_t qspin[MAX_CPUS];
+static fmutex_t fmtx[MAX_CPUS];
+static fmutex_t amtx[MAX_CPUS];
+static ptmutex_t ptmtx[MAX_CPUS];
+static struct rel_stamp relts[MAX_CPUS];
+static struct mcs_node mcs_nodes[MAX_CPUS];
+/*
+ * The first MAX_CPUS CLH nodes are the initial thread ones, the others
+ * are the initial (unlocked) tails of the locks.
+ */
+static struct clh_node clh_nodes[2 * MAX_CPUS];
+static __thread struct mcs_node *mcs_self;
+static __thread struct clh_node *clh_self, *clh_pred;
 static int sched_prio = 90;
 static int sched_policy = SCHED_FIFO;
 static int num_threads = 1;
+static int num_cpus = 1;
+static unsigned long long spin_cycles = ADAPTIVE_SPIN;
+static volatile int hog_stop;
 static struct thread_ctx *tctx;
 static int go;
 
@@ -127,6 +216,153 @@ static inline void spin_unlock(spinlock_t *lock) {
 	asm volatile ("movl $1,%0\n\t" : "=m" (lock->slock) : : "memory");
 }
 
+static inline void mcs_lock_init(mcslock_t *lock) {
+
+	lock->tail = NULL;
+}
+
+static inline void mcs_lock(mcslock_t *lock) {
+	struct mcs_node *node = mcs_self, *prev;
+
+	node->next = NULL;
+	node->locked = 0;
+	prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (likely(prev == NULL))
+		return;
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static inline void mcs_unlock(mcslock_t *lock) {
+	struct mcs_node *node = mcs_self, *next, *tmp = node;
+
+	if ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+		if (__atomic_compare_exchange_n(&lock->tail, &tmp, NULL, 0,
+						__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		/*
+		 * A successor swapped the tail, but did not link yet.
+		 */
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+	__atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+static inline void clh_lock_init(clhlock_t *lock, struct clh_node *node) {
+
+	node->locked = 0;
+	lock->tail = node;
+}
+
+/*
+ * CLH spins on the predecessor node, and on release the thread adopts it,
+ * leaving its own node to the successor.
+ */
+static inline void clh_lock(clhlock_t *lock) {
+	struct clh_node *node = clh_self, *pred;
+
+	node->locked = 1;
+	pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	while (__atomic_load_n(&pred->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	clh_pred = pred;
+}
+
+static inline void clh_unlock(clhlock_t *lock) {
+	struct clh_node *node = clh_self;
+
+	clh_self = clh_pred;
+	__atomic_store_n(&node->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline void qspin_lock_init(qspinlock_t *lock) {
+
+	lock->val = 0;
+}
+
+/*
+ * Slow path of the queued spinlock, following the kernel one: the first
+ * contender spins on the lock word with the pending bit set, the others
+ * queue on MCS nodes and only the queue head spins on the lock word.
+ */
+static void qspin_lock_slowpath(qspinlock_t *lock, unsigned int val) {
+	struct mcs_node *node, *prev, *next;
+	unsigned int tail, old;
+
+	/*
+	 * Pending to locked handoff in progress, give it a moment.
+	 */
+	if (val == QS_PENDING) {
+		cpu_relax();
+		val = __atomic_load_n(&lock->val, __ATOMIC_RELAXED);
+	}
+	if (val & ~QS_LOCKED_MASK)
+		goto queue;
+
+	val = __atomic_fetch_or(&lock->val, QS_PENDING, __ATOMIC_ACQUIRE);
+	if (!(val & ~QS_LOCKED_MASK)) {
+		if (val & QS_LOCKED_MASK)
+			while (__atomic_load_n(&lock->locked, __ATOMIC_ACQUIRE))
+				cpu_relax();
+		/*
+		 * Clear pending and set locked in a single store, since
+		 * nobody else touches the low half with pending set.
+		 */
+		__atomic_store_n(&lock->locked_pending, QS_LOCKED, __ATOMIC_RELAXED);
+		return;
+	}
+	/*
+	 * Somebody else showed up while we were setting pending, undo it
+	 * if it was ours, and queue.
+	 */
+	if (!(val & QS_PENDING))
+		__atomic_fetch_and(&lock->val, ~QS_PENDING, __ATOMIC_RELAXED);
+
+queue:
+	node = mcs_self;
+	node->next = NULL;
+	node->locked = 0;
+	tail = (unsigned int) (node - mcs_nodes) + 1;
+	old = __atomic_exchange_n(&lock->tail, (unsigned short) tail,
+				  __ATOMIC_ACQ_REL);
+	if (old) {
+		prev = &mcs_nodes[old - 1];
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+
+	/*
+	 * We are the queue head, wait for the owner and the pending one to go.
+	 */
+	while ((val = __atomic_load_n(&lock->val, __ATOMIC_ACQUIRE)) & QS_LP_MASK)
+		cpu_relax();
+	if ((val & QS_TAIL_MASK) == (tail << QS_TAIL_SHIFT) &&
+	    __atomic_compare_exchange_n(&lock->val, &val, QS_LOCKED, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_store_n(&lock->locked, QS_LOCKED, __ATOMIC_RELAXED);
+	while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+		cpu_relax();
+	__atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+static inline void qspin_lock(qspinlock_t *lock) {
+	unsigned int val = 0;
+
+	if (likely(__atomic_compare_exchange_n(&lock->val, &val, QS_LOCKED, 0,
+					       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+		return;
+	qspin_lock_slowpath(lock, val);
+}
+
+static inline void qspin_unlock(qspinlock_t *lock) {
+
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
 static inline unsigned long long get_cycles(void) {
 	unsigned long long ret;
 
@@ -134,17 +370,100 @@ static inline unsigned long long get_cycles(void) {
 	return ret;
 }
 
+static inline void futex_wait(int *addr, int val) {
+
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int nr) {
+
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static inline void fmutex_init(fmutex_t *lock) {
+
+	lock->val = 0;
+}
+
+/*
+ * Drepper's three state mutex ("Futexes Are Tricky", mutex 2): the
+ * uncontended paths never enter the kernel, and the unlocker only issues
+ * a FUTEX_WAKE when the word says there may be waiters.
+ */
+static inline void fmutex_lock_wait(fmutex_t *lock, int c) {
+
+	if (c != 2)
+		c = __atomic_exchange_n(&lock->val, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		futex_wait(&lock->val, 2);
+		c = __atomic_exchange_n(&lock->val, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static inline void fmutex_lock(fmutex_t *lock) {
+	int c = 0;
+
+	if (likely(__atomic_compare_exchange_n(&lock->val, &c, 1, 0,
+					       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+		return;
+	fmutex_lock_wait(lock, c);
+}
+
+static inline void fmutex_unlock(fmutex_t *lock) {
+
+	if (__atomic_fetch_sub(&lock->val, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&lock->val, 0, __ATOMIC_RELEASE);
+		futex_wake(&lock->val, 1);
+	}
+}
+
+/*
+ * Same word as the futex mutex, but the contended path spins (reading
+ * only) for up to spin_cycles before going to sleep.
+ */
+static inline void amutex_lock(fmutex_t *lock) {
+	int c = 0;
+	unsigned long long tmo;
+
+	if (likely(__atomic_compare_exchange_n(&lock->val, &c, 1, 0,
+					       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+		return;
+	for (tmo = get_cycles() + spin_cycles; get_cycles() < tmo;) {
+		cpu_relax();
+		if ((c = __atomic_load_n(&lock->val, __ATOMIC_RELAXED)) == 0 &&
+		    __atomic_compare_exchange_n(&lock->val, &c, 1, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	}
+	fmutex_lock_wait(lock, c);
+}
+
+static inline void ptmutex_init(ptmutex_t *lock) {
+
+	pthread_mutex_init(&lock->mtx, NULL);
+}
+
+static inline void ptmutex_lock(ptmutex_t *lock) {
+
+	pthread_mutex_lock(&lock->mtx);
+}
+
+static inline void ptmutex_unlock(ptmutex_t *lock) {
+
+	pthread_mutex_unlock(&lock->mtx);
+}
+
 static int thread_setched(int cpu) {
 	cpu_set_t mask;
 	struct sched_param param;
 
 	CPU_ZERO(&mask);
-	CPU_SET(cpu, &mask);
+	CPU_SET(cpu % num_cpus, &mask);
 
 	if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
 		perror("sched_setaffinity"), exit(1);
 	memset(&param, 0, sizeof(param));
-	param.sched_priority = sched_prio;
+	param.sched_priority = sched_policy == SCHED_OTHER ? 0: sched_prio;
 	if (sched_setscheduler(0, sched_policy, &param) == -1)
 		perror("sched_setscheduler"), exit(1);
 
@@ -154,58 +473,80 @@ static int thread_setched(int cpu) {
 static int thread_setup(struct thread_ctx *ctx) {
 
 	thread_setched(ctx->cpu);
+	mcs_self = &mcs_nodes[ctx->cpu];
+	clh_self = &clh_nodes[ctx->cpu];
 
 	return 0;
 }
 
-static void *tspin_thread(void *arg) {
-	struct thread_ctx *ctx = (struct thread_ctx *) arg;
-	int i, j, k = ctx->cpu;
-	unsigned long long ts, te;
-
-	thread_setup(ctx);
-	tspin_lock(&tspin[k]);
-	while (!go)
-		sched_yield();
-
-	for (j = 0; j < MAX_SAMPLES; j++) {
-		ts = get_cycles();
-		for (i = 0; i < NR_ITERS; i++) {
-			tspin_unlock(&tspin[k]);
-			if (++k >= num_threads)
-				k = 0;
-			tspin_lock(&tspin[k]);
-		}
-		te = get_cycles();
-		ctx->samples[j] = te - ts;
-	}
-	tspin_unlock(&tspin[k]);
-
-	return NULL;
+/*
+ * Every thread grabs the lock with its index, then keeps releasing the
+ * one it holds and grabbing the next one in the ring. The handoff time
+ * is the one the lock stayed free while we were waiting for it, that is
+ * from the latest among its release and our lock call, to our return.
+ */
+#define RING_THREAD(name, locks, lockfn, unlockfn)			\
+static void *name(void *arg) {						\
+	struct thread_ctx *ctx = (struct thread_ctx *) arg;		\
+	int i, j, k = ctx->cpu;						\
+	unsigned long long ts, te, tw, ta, h;				\
+									\
+	thread_setup(ctx);						\
+	lockfn(&locks[k]);						\
+	while (!go)							\
+		sched_yield();						\
+									\
+	ctx->tstart = get_cycles();					\
+	for (j = 0; j < MAX_SAMPLES; j++) {				\
+		ts = get_cycles();					\
+		for (i = 0; i < NR_ITERS; i++) {			\
+			relts[k].ts = get_cycles();			\
+			unlockfn(&locks[k]);				\
+			if (++k >= num_threads)				\
+				k = 0;					\
+			tw = get_cycles();				\
+			lockfn(&locks[k]);				\
+			ta = get_cycles();				\
+			if (relts[k].ts > tw)				\
+				tw = relts[k].ts;			\
+			h = ta > tw ? ta - tw: 0;			\
+			ctx->hsum += h;					\
+			if (h > ctx->hmax)				\
+				ctx->hmax = h;				\
+		}							\
+		te = get_cycles();					\
+		ctx->samples[j] = te - ts;				\
+	}								\
+	ctx->tend = get_cycles();					\
+	unlockfn(&locks[k]);						\
+									\
+	return NULL;							\
 }
 
-static void *spin_thread(void *arg) {
-	struct thread_ctx *ctx = (struct thread_ctx *) arg;
-	int i, j, k = ctx->cpu;
-	unsigned long long ts, te;
-
-	thread_setup(ctx);
-	spin_lock(&spin[k]);
-	while (!go)
-		sched_yield();
+RING_THREAD(tspin_thread, tspin, tspin_lock, tspin_unlock)
+RING_THREAD(spin_thread, spin, spin_lock, spin_unlock)
+RING_THREAD(mcs_thread, mcs, mcs_lock, mcs_unlock)
+RING_THREAD(clh_thread, clh, clh_lock, clh_unlock)
+RING_THREAD(qspin_thread, qspin, qspin_lock, qspin_unlock)
+RING_THREAD(fmutex_thread, fmtx, fmutex_lock, fmutex_unlock)
+RING_THREAD(amutex_thread, amtx, amutex_lock, fmutex_unlock)
+RING_THREAD(ptmutex_thread, ptmtx, ptmutex_lock, ptmutex_unlock)
+
+/*
+ * Background load, a CPU bound SCHED_OTHER thread on every CPU in turn.
+ */
+static void *hog_thread(void *arg) {
+	int cpu = (int) (long) arg;
+	cpu_set_t mask;
+	struct sched_param param;
 
-	for (j = 0; j < MAX_SAMPLES; j++) {
-		ts = get_cycles();
-		for (i = 0; i < NR_ITERS; i++) {
-			spin_unlock(&spin[k]);
-			if (++k >= num_threads)
-				k = 0;
-			spin_lock(&spin[k]);
-		}
-		te = get_cycles();
-		ctx->samples[j] = te - ts;
-	}
-	spin_unlock(&spin[k]);
+	CPU_ZERO(&mask);
+	CPU_SET(cpu % num_cpus, &mask);
+	sched_setaffinity(0, sizeof(mask), &mask);
+	memset(&param, 0, sizeof(param));
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	while (!hog_stop)
+		;
 
 	return NULL;
 }
@@ -217,12 +558,21 @@ static int cmp_ull(void const *p1, void const *p2) {
 }
 
 int main(int ac, char **av) {
-	int i, j, ncpus;
-	struct test_desc tspin_desc = { "TICKLOCK", tspin_thread };
-	struct test_desc spin_desc = { "SPINLOCK", spin_thread };
-	struct test_desc *tdesc = &tspin_desc;
-	unsigned long long ts, te, uscycles;
+	int i, j, oversub = 0, num_hogs = 0;
+	static struct test_desc const tests[] = {
+		{ "TICKLOCK", tspin_thread },
+		{ "SPINLOCK", spin_thread },
+		{ "MCSLOCK", mcs_thread },
+		{ "CLHLOCK", clh_thread },
+		{ "QSPINLOCK", qspin_thread },
+		{ "FUTEX", fmutex_thread },
+		{ "ADAPTIVE", amutex_thread },
+		{ "PTMUTEX", ptmutex_thread },
+	};
+	struct test_desc const *tdesc = &tests[0];
+	unsigned long long ts, te, uscycles, tstart, tend, hsum, hmax;
 	struct timespec ts1, ts2;
+	pthread_t *hogs = NULL;
 
 	for (i = 1; i < ac; i++) {
 		if (!strcmp(av[i], "-n")) {
@@ -232,21 +582,54 @@ int main(int ac, char **av) {
 			if (++i < ac)
 				sched_prio = atoi(av[i]);
 		} else if (!strcmp(av[i], "-s")) {
-			tdesc = &spin_desc;
+			tdesc = &tests[1];
+		} else if (!strcmp(av[i], "-L")) {
+			if (++i >= ac)
+				break;
+			for (j = 0; j < (int) (sizeof(tests) / sizeof(tests[0])); j++)
+				if (!strcasecmp(av[i], tests[j].name))
+					break;
+			if (j == (int) (sizeof(tests) / sizeof(tests[0]))) {
+				fprintf(stderr, "unknown lock '%s', one of:", av[i]);
+				for (j = 0; j < (int) (sizeof(tests) / sizeof(tests[0])); j++)
+					fprintf(stderr, " %s", tests[j].name);
+				fprintf(stderr, "\n");
+				return 1;
+			}
+			tdesc = &tests[j];
 		} else if (!strcmp(av[i], "-F")) {
 			sched_policy = SCHED_FIFO;
 		} else if (!strcmp(av[i], "-O")) {
 			sched_policy = SCHED_OTHER;
 		} else if (!strcmp(av[i], "-R")) {
 			sched_policy = SCHED_RR;
+		} else if (!strcmp(av[i], "-o")) {
+			oversub = 1;
+		} else if (!strcmp(av[i], "-b")) {
+			if (++i < ac)
+				num_hogs = atoi(av[i]);
+		} else if (!strcmp(av[i], "-S")) {
+			if (++i < ac)
+				spin_cycles = strtoull(av[i], NULL, 0);
 		}
 	}
-	ncpus = sysconf(_SC_NPROCESSORS_CONF);
-	if (num_threads > ncpus) {
+	num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	/*
+	 * With -o threads are pinned round robin over the CPUs. Only sleeping
+	 * locks make sense there, a spinning waiter pinned on its holder CPU
+	 * never lets it run under SCHED_FIFO, and wastes its slices under
+	 * SCHED_OTHER.
+	 */
+	if (num_threads > num_cpus && !oversub) {
 		fprintf(stderr,
 			"number of threads (%d) greater than number cpus (%d)\n"
-			"\tdowngrading threads to %d\n", num_threads, ncpus, ncpus);
-		num_threads = ncpus;
+			"\tdowngrading threads to %d (use -o to oversubscribe)\n",
+			num_threads, num_cpus, num_cpus);
+		num_threads = num_cpus;
+	}
+	if (num_threads > MAX_CPUS) {
+		fprintf(stderr, "downgrading threads to %d\n", MAX_CPUS);
+		num_threads = MAX_CPUS;
 	}
 
 	tctx = (struct thread_ctx *) malloc(num_threads * sizeof(struct thread_ctx));
@@ -255,6 +638,12 @@ int main(int ac, char **av) {
 	for (i = 0; i < num_threads; i++) {
 		tspin_lock_init(&tspin[i]);
 		spin_lock_init(&spin[i]);
+		mcs_lock_init(&mcs[i]);
+		clh_lock_init(&clh[i], &clh_nodes[MAX_CPUS + i]);
+		qspin_lock_init(&qspin[i]);
+		fmutex_init(&fmtx[i]);
+		fmutex_init(&amtx[i]);
+		ptmutex_init(&ptmtx[i]);
 	}
 
 	fprintf(stdout, "now testing: %s\n", tdesc->name);
@@ -273,6 +662,14 @@ int main(int ac, char **av) {
 				(ts2.tv_nsec - ts1.tv_nsec) / 1000);
 	fprintf(stdout, "uscycles=%llu\n", uscycles);
 
+	if (num_hogs > 0) {
+		hogs = (pthread_t *) malloc(num_hogs * sizeof(pthread_t));
+		for (i = 0; i < num_hogs; i++)
+			if (pthread_create(&hogs[i], NULL, hog_thread,
+					   (void *) (long) i) != 0)
+				perror("pthread_create"), exit(1);
+	}
+
 	for (i = 0; i < num_threads; i++) {
 		tctx[i].cpu = i;
 		if (pthread_create(&tctx[i].tid, NULL, tdesc->tproc,
@@ -306,6 +703,36 @@ int main(int ac, char **av) {
 			"SIG[%d]: %lf\n", i, avg, i, sig);
 	}
 
+	/*
+	 * Throughput is over the whole run, from the first thread to start
+	 * to the last one to finish.
+	 */
+	tstart = tctx[0].tstart;
+	tend = tctx[0].tend;
+	for (i = 0, hsum = hmax = 0; i < num_threads; i++) {
+		if (tctx[i].tstart < tstart)
+			tstart = tctx[i].tstart;
+		if (tctx[i].tend > tend)
+			tend = tctx[i].tend;
+		hsum += tctx[i].hsum;
+		if (tctx[i].hmax > hmax)
+			hmax = tctx[i].hmax;
+	}
+	fprintf(stdout,
+		"THROUGHPUT: %.0lf handoffs/s\n"
+		"HANDOFF: %.3lf us avg, %.3lf us max\n",
+		1e6 * num_threads * MAX_SAMPLES * NR_ITERS * uscycles /
+		(double) (tend - tstart),
+		(double) hsum / ((double) num_threads * MAX_SAMPLES * NR_ITERS) /
+		uscycles, (double) hmax / uscycles);
+
+	if (num_hogs > 0) {
+		hog_stop = 1;
+		for (i = 0; i < num_hogs; i++)
+			pthread_join(hogs[i], NULL);
+		free(hogs);
+	}
+
 	return 0;
 }
 
@@ -14,9 +14,21 @@
  * 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 /*
@@ -36,7 +48,9 @@ struct list_head {
 #define LIST_HEAD(name) \
 	struct list_head name = LIST_HEAD_INIT(name)
 
+#ifndef offsetof
 #define offsetof(type, member) ((long) &((type *) 0)->member)
+#endif
 #define container_of(ptr, type, member) ({			\
         const typeof( ((type *)0)->member ) *__mptr = (ptr);	\
         (type *)( (char *)__mptr - offsetof(type,member) );})
@@ -159,6 +173,12 @@ extern struct rb_node *rb_first(struct rb_root *);
 extern struct rb_node *rb_last(struct rb_root *);
 
 /* Fast replacement of a single node without remove/rebalance/add/rebalance */
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+
+extern void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data);
+extern struct rb_node *rb_augment_erase_begin(struct rb_node *node);
+extern void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data);
+
 extern void rb_replace_node(struct rb_node *victim, struct rb_node *new,
 			    struct rb_root *root);
 
@@ -531,6 +551,79 @@ void rb_replace_node(struct rb_node *victim, struct rb_node *new,
 	*new = *victim;
 }
 
+/*
+ * Augmented rbtree support (as in 2.6.35 lib/rbtree.c). The callback
+ * recomputes the node data out of its children, and these walk the
+ * paths which the insert and erase rotations touched.
+ */
+static void rb_augment_path(struct rb_node *node, rb_augment_f func, void *data)
+{
+	struct rb_node *parent;
+
+up:
+	func(node, data);
+	parent = rb_parent(node);
+	if (!parent)
+		return;
+
+	if (node == parent->rb_left && parent->rb_right)
+		func(parent->rb_right, data);
+	else if (parent->rb_left)
+		func(parent->rb_left, data);
+
+	node = parent;
+	goto up;
+}
+
+/*
+ * after inserting @node into the tree, update the tree to account for
+ * both the new entry and any damage done by rebalance
+ */
+void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data)
+{
+	if (node->rb_left)
+		node = node->rb_left;
+	else if (node->rb_right)
+		node = node->rb_right;
+
+	rb_augment_path(node, func, data);
+}
+
+/*
+ * before removing the node, find the deepest node on the rebalance path
+ * that will still be there after @node gets removed
+ */
+struct rb_node *rb_augment_erase_begin(struct rb_node *node)
+{
+	struct rb_node *deepest;
+
+	if (!node->rb_right && !node->rb_left)
+		deepest = rb_parent(node);
+	else if (!node->rb_right)
+		deepest = node->rb_left;
+	else if (!node->rb_left)
+		deepest = node->rb_right;
+	else {
+		deepest = rb_next(node);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (rb_parent(deepest) != node)
+			deepest = rb_parent(deepest);
+	}
+
+	return deepest;
+}
+
+/*
+ * after removal, update the tree to account for the removed entry
+ * and any rebalance damage.
+ */
+void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data)
+{
+	if (node)
+		rb_augment_path(node, func, data);
+}
+
 
 typedef unsigned long long nstime_t;
 
@@ -608,15 +701,221 @@ struct cfs_task *cfs_dequeue(struct cfs_rq *rq) {
 	return next;
 }
 
+/*
+ * Removes the task with the latest time, the one which the CPU needs
+ * the least soon (that is what a work stealer takes).
+ */
+struct cfs_task *cfs_dequeue_last(struct cfs_rq *rq) {
+	struct rb_node *last = rb_last(&rq->tasks_timeline);
+	struct cfs_task *tsk;
+
+	if (unlikely(last == NULL))
+		return NULL;
+	tsk = rb_entry(last, struct cfs_task, run_node);
+	__dequeue_task_fair(rq, tsk);
+
+	return tsk;
+}
+
+
+
+/*
+ * Weighted vruntime and EEVDF code. Tasks carry a nice level weight, and
+ * their virtual time advances by the time they run scaled by NICE_0_LOAD
+ * over their weight. The weighted CFS just picks the smallest vruntime,
+ * with the cfs_rq code above. EEVDF keeps tasks ordered by vruntime
+ * (their eligible time) and picks, among the eligible ones (vruntime not
+ * past the weighted average V of the queue), the one with the earliest
+ * virtual deadline, vruntime plus the task slice scaled by its weight.
+ * Every node caches the minimum deadline of its subtree, which makes the
+ * pick a single root to leaf walk. V is kept as a weighted sum of the
+ * vruntimes relative to a base, the leftmost vruntime.
+ */
+#define NICE_0_LOAD	1024
+
+static int const prio_to_weight[40] = {
+	/* -20 */     88761,     71755,     56483,     46273,     36291,
+	/* -15 */     29154,     23254,     18705,     14949,     11916,
+	/* -10 */      9548,      7620,      6100,      4904,      3906,
+	/*  -5 */      3121,      2501,      1991,      1586,      1277,
+	/*   0 */      1024,       820,       655,       526,       423,
+	/*   5 */       335,       272,       215,       172,       137,
+	/*  10 */       110,        87,        70,        56,        45,
+	/*  15 */        36,        29,        23,        18,        15,
+};
+
+struct ev_task {
+	struct rb_node run_node;
+	nstime_t ve, vd, min_vd;
+	unsigned long weight;
+	/* ... */
+};
+
+struct ev_rq {
+	struct rb_root tasks_timeline;
+	nstime_t base;
+	__int128 vsum;
+	unsigned long long wsum;
+};
+
+
+static inline nstime_t calc_delta_fair(nstime_t delta, unsigned long weight) {
+	return weight == NICE_0_LOAD ? delta: delta * NICE_0_LOAD / weight;
+}
+
+void ev_rqinit(struct ev_rq *rq) {
+	rq->tasks_timeline = RB_ROOT;
+	rq->base = 0;
+	rq->vsum = 0;
+	rq->wsum = 0;
+}
+
+static void ev_update_min(struct rb_node *node, void *data) {
+	struct ev_task *tsk = rb_entry(node, struct ev_task, run_node), *child;
+	nstime_t min_vd = tsk->vd;
+
+	(void) data;
+
+	if (node->rb_left) {
+		child = rb_entry(node->rb_left, struct ev_task, run_node);
+		if (child->min_vd < min_vd)
+			min_vd = child->min_vd;
+	}
+	if (node->rb_right) {
+		child = rb_entry(node->rb_right, struct ev_task, run_node);
+		if (child->min_vd < min_vd)
+			min_vd = child->min_vd;
+	}
+	tsk->min_vd = min_vd;
+}
+
+/*
+ * Moves the base up to the leftmost vruntime, so that the relative
+ * vruntimes stay small.
+ */
+static void ev_update_base(struct ev_rq *rq) {
+	struct rb_node *first = rb_first(&rq->tasks_timeline);
+	nstime_t ve;
+
+	if (first == NULL)
+		return;
+	ve = rb_entry(first, struct ev_task, run_node)->ve;
+	if (ve > rq->base) {
+		rq->vsum -= (__int128) (ve - rq->base) * rq->wsum;
+		rq->base = ve;
+	}
+}
+
+void ev_queue(struct ev_task *tsk, struct ev_rq *rq) {
+	struct rb_node **link = &rq->tasks_timeline.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (tsk->ve < rb_entry(parent, struct ev_task, run_node)->ve)
+			link = &(*link)->rb_left;
+		else
+			link = &(*link)->rb_right;
+	}
+	tsk->min_vd = tsk->vd;
+	rb_link_node(&tsk->run_node, parent, link);
+	rb_insert_color(&tsk->run_node, &rq->tasks_timeline);
+	rb_augment_insert(&tsk->run_node, ev_update_min, NULL);
+	rq->vsum += (__int128) ((long long) (tsk->ve - rq->base)) * tsk->weight;
+	rq->wsum += tsk->weight;
+}
+
+void ev_erase(struct ev_task *tsk, struct ev_rq *rq) {
+	struct rb_node *deepest = rb_augment_erase_begin(&tsk->run_node);
+
+	rb_erase(&tsk->run_node, &rq->tasks_timeline);
+	rb_augment_erase_end(deepest, ev_update_min, NULL);
+	rq->vsum -= (__int128) ((long long) (tsk->ve - rq->base)) * tsk->weight;
+	rq->wsum -= tsk->weight;
+}
+
+/*
+ * Same as (ve - base) <= vsum / wsum, without the division.
+ */
+static inline int ev_eligible(struct ev_rq *rq, struct ev_task *tsk) {
+	return (__int128) ((long long) (tsk->ve - rq->base)) * rq->wsum <= rq->vsum;
+}
+
+struct ev_task *ev_pick(struct ev_rq *rq) {
+	struct rb_node *node = rq->tasks_timeline.rb_node, *sub = NULL;
+	struct ev_task *tsk, *best = NULL, *left;
+	nstime_t min_vd = ~0ULL;
+
+	ev_update_base(rq);
+	/*
+	 * An eligible node makes its whole left subtree eligible, whose best
+	 * deadline is cached in the left child. So walk down remembering the
+	 * best eligible node or subtree, going right past eligible nodes and
+	 * left past the others.
+	 */
+	while (node) {
+		tsk = rb_entry(node, struct ev_task, run_node);
+		if (!ev_eligible(rq, tsk)) {
+			node = node->rb_left;
+			continue;
+		}
+		if (node->rb_left) {
+			left = rb_entry(node->rb_left, struct ev_task, run_node);
+			if (left->min_vd < min_vd) {
+				min_vd = left->min_vd;
+				sub = node->rb_left;
+				best = NULL;
+			}
+		}
+		if (tsk->vd < min_vd) {
+			min_vd = tsk->vd;
+			best = tsk;
+			sub = NULL;
+		}
+		node = node->rb_right;
+	}
+	/*
+	 * Then find the MIN_VD node within the best subtree.
+	 */
+	for (node = sub; best == NULL && node != NULL;) {
+		tsk = rb_entry(node, struct ev_task, run_node);
+		if (node->rb_left &&
+		    rb_entry(node->rb_left, struct ev_task, run_node)->min_vd == min_vd)
+			node = node->rb_left;
+		else if (tsk->vd == min_vd)
+			best = tsk;
+		else
+			node = node->rb_right;
+	}
+
+	return best;
+}
+
 
 
 /*
- * Timed ring code
+ * Timed ring code. MAX_RQ is the default slot count (runtime one with
+ * tr_rqinit()), and it is also the fixed slot count of the multi-producer
+ * ring. Rings larger than a few words can keep a summary bitmap on top
+ * of the slot one (one bit per non-empty word, up to TR_MAX_LEVELS
+ * levels), so that finding the next busy slot costs a few ffs whatever
+ * the ring size, or scan the flat map 256 bits at a time with AVX2.
  */
+#ifndef MAX_RQ
 #define MAX_RQ		(1 << 8)
+#endif
 #define RQ_MASK		(MAX_RQ - 1)
 #define MAP_LONGS	(MAX_RQ / BITS_X_LONG)
+#ifndef NS_SLOT
 #define NS_SLOT		(5 * 1000000UL)
+#endif
+#define TR_MAX_LEVELS	4
+
+enum {
+	TR_SCAN_LINEAR,
+	TR_SCAN_SUMMARY,
+	TR_SCAN_AVX2
+};
 
 struct tr_task {
 	struct list_head lnk;
@@ -627,37 +926,180 @@ struct tr_task {
 struct tr_rq {
 	unsigned int ibase;
 	nstime_t tbase;
-	struct list_head tsks[MAX_RQ];
-	unsigned long map[MAP_LONGS];
+	unsigned int nslots, mask, scan, nlevels;
+	struct list_head *tsks;
+	/*
+	 * map[0] is the slot bitmap, and map[L] has one bit for every word
+	 * of map[L - 1].
+	 */
+	unsigned long *map[TR_MAX_LEVELS];
+	unsigned int nlongs[TR_MAX_LEVELS];
 };
 
 
-void tr_rqinit(struct tr_rq *rq) {
-	int i;
+void tr_rqinit(struct tr_rq *rq, unsigned int nslots, unsigned int scan) {
+	unsigned int i, n;
 
+	for (n = BITS_X_LONG; n < nslots; n <<= 1);
 	rq->ibase = 0;
 	rq->tbase = 0;
-	for (i = 0; i < MAX_RQ; i++)
+	rq->nslots = n;
+	rq->mask = n - 1;
+	rq->scan = scan;
+	rq->tsks = (struct list_head *) malloc(n * sizeof(struct list_head));
+	for (i = 0; i < n; i++)
 		INIT_LIST_HEAD(&rq->tsks[i]);
-	memset(rq->map, 0, sizeof(rq->map));
+	rq->nlevels = 0;
+	do {
+		n = (n + BITS_X_LONG - 1) / BITS_X_LONG;
+		rq->nlongs[rq->nlevels] = n;
+		if (posix_memalign((void **) &rq->map[rq->nlevels], 64,
+				   n * sizeof(unsigned long)))
+			perror("posix_memalign"), exit(1);
+		memset(rq->map[rq->nlevels], 0, n * sizeof(unsigned long));
+		rq->nlevels++;
+	} while (scan == TR_SCAN_SUMMARY && n > 1 && rq->nlevels < TR_MAX_LEVELS);
 }
 
-static int rel_ffs(struct tr_rq *rq) {
-	unsigned int i, b, n;
-	unsigned long mask;
+void tr_rqfini(struct tr_rq *rq) {
+	unsigned int l;
 
-	i = rq->ibase / BITS_X_LONG;
-	b = rq->ibase % BITS_X_LONG;
-	mask = ~((1UL << b) - 1);
-	for (n = MAP_LONGS; n; n--) {
-		unsigned long v = rq->map[i] & mask;
+	for (l = 0; l < rq->nlevels; l++)
+		free(rq->map[l]);
+	free(rq->tsks);
+}
 
-		if (likely(v))
-			return i * BITS_X_LONG + __ffs(v);
-		i = (i + 1) % MAP_LONGS;
-		mask = ~0UL;
+static inline void tr_map_set(struct tr_rq *rq, unsigned int idx) {
+	unsigned int l;
+
+	__set_bit(idx, rq->map[0]);
+	for (l = 1; l < rq->nlevels; l++) {
+		idx /= BITS_X_LONG;
+		__set_bit(idx, rq->map[l]);
 	}
-	return MAX_RQ;
+}
+
+static inline void tr_map_clear(struct tr_rq *rq, unsigned int idx) {
+	unsigned int l;
+
+	__clear_bit(idx, rq->map[0]);
+	for (l = 1; l < rq->nlevels; l++) {
+		idx /= BITS_X_LONG;
+		if (rq->map[l - 1][idx])
+			break;
+		__clear_bit(idx, rq->map[l]);
+	}
+}
+
+#ifdef __AVX2__
+/*
+ * Returns the first non zero word of MAP at or after W, or N.
+ */
+static unsigned int tr_avx2_next(unsigned long const *map, unsigned int w,
+				 unsigned int n) {
+	__m256i v;
+
+	for (; w < n && (w & 3); w++)
+		if (map[w])
+			return w;
+	for (; w + 4 <= n; w += 4) {
+		v = _mm256_load_si256((__m256i const *) (map + w));
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+	for (; w < n; w++)
+		if (map[w])
+			return w;
+
+	return n;
+}
+#endif
+
+/*
+ * Returns the first busy slot at or after IDX, or nslots. The top level
+ * (the slot map itself, without summary) is scanned linearly.
+ */
+static unsigned int tr_map_next(struct tr_rq *rq, unsigned int idx) {
+	unsigned int l = 0, w, top = rq->nlevels - 1;
+	unsigned long v;
+
+	for (;;) {
+		w = idx / BITS_X_LONG;
+		if ((v = rq->map[l][w] & (~0UL << (idx % BITS_X_LONG))) != 0)
+			break;
+		if (l == top) {
+#ifdef __AVX2__
+			if (rq->scan == TR_SCAN_AVX2) {
+				if ((w = tr_avx2_next(rq->map[l], w + 1, rq->nlongs[l])) ==
+				    rq->nlongs[l])
+					return rq->nslots;
+				v = rq->map[l][w];
+				break;
+			}
+#endif
+			while (++w < rq->nlongs[l])
+				if ((v = rq->map[l][w]) != 0)
+					break;
+			if (w == rq->nlongs[l])
+				return rq->nslots;
+			break;
+		}
+		if ((idx = w + 1) >= rq->nlongs[l])
+			return rq->nslots;
+		l++;
+	}
+	idx = w * BITS_X_LONG + __ffs(v);
+	while (l > 0) {
+		l--;
+		idx = idx * BITS_X_LONG + __ffs(rq->map[l][idx]);
+	}
+
+	return idx;
+}
+
+static inline unsigned int __fls_long(unsigned long v) {
+	return BITS_X_LONG - 1 - __builtin_clzl(v);
+}
+
+/*
+ * Returns the last busy slot at or before IDX, or nslots.
+ */
+static unsigned int tr_map_prev(struct tr_rq *rq, unsigned int idx) {
+	unsigned int l = 0, w, b, top = rq->nlevels - 1;
+	unsigned long v;
+
+	for (;;) {
+		w = idx / BITS_X_LONG;
+		b = idx % BITS_X_LONG;
+		v = rq->map[l][w] & (b == BITS_X_LONG - 1 ? ~0UL: (1UL << (b + 1)) - 1);
+		if (v != 0)
+			break;
+		if (l == top) {
+			while (w > 0)
+				if ((v = rq->map[l][--w]) != 0)
+					break;
+			if (v == 0)
+				return rq->nslots;
+			break;
+		}
+		if (w == 0)
+			return rq->nslots;
+		idx = w - 1;
+		l++;
+	}
+	idx = w * BITS_X_LONG + __fls_long(v);
+	while (l > 0) {
+		l--;
+		idx = idx * BITS_X_LONG + __fls_long(rq->map[l][idx]);
+	}
+
+	return idx;
+}
+
+static unsigned int rel_ffs(struct tr_rq *rq) {
+	unsigned int idx = tr_map_next(rq, rq->ibase);
+
+	return idx != rq->nslots || rq->ibase == 0 ? idx: tr_map_next(rq, 0);
 }
 
 struct tr_task *tr_dequeue(struct tr_rq *rq) {
@@ -665,102 +1107,2277 @@ struct tr_task *tr_dequeue(struct tr_rq *rq) {
 	struct tr_task *tsk;
 
 	idx = rel_ffs(rq);
-	if (unlikely(idx == MAX_RQ)) {
+	if (unlikely(idx == rq->nslots)) {
 		rq->tbase = 0;
 		return NULL;
 	}
 	tsk = list_entry(rq->tsks[idx].next, struct tr_task, lnk);
 	list_del(&tsk->lnk);
 	if (list_empty(&rq->tsks[idx]))
-		__clear_bit(idx, rq->map);
-	d = (idx - rq->ibase) & RQ_MASK;
+		tr_map_clear(rq, idx);
+	d = (idx - rq->ibase) & rq->mask;
 	rq->ibase = idx;
 	rq->tbase += NS_SLOT * d;
 
 	return tsk;
 }
 
+/*
+ * Like rel_ffs(), but walking backward from the farthest slot (the one
+ * right behind ibase).
+ */
+static unsigned int rel_fls(struct tr_rq *rq) {
+	unsigned int idx = rq->ibase > 0 ? tr_map_prev(rq, rq->ibase - 1): rq->nslots;
+
+	return idx != rq->nslots ? idx: tr_map_prev(rq, rq->mask);
+}
+
+struct tr_task *tr_dequeue_last(struct tr_rq *rq) {
+	unsigned int idx;
+	struct tr_task *tsk;
+
+	idx = rel_fls(rq);
+	if (unlikely(idx == rq->nslots))
+		return NULL;
+	tsk = list_entry(rq->tsks[idx].prev, struct tr_task, lnk);
+	list_del(&tsk->lnk);
+	if (list_empty(&rq->tsks[idx]))
+		tr_map_clear(rq, idx);
+
+	return tsk;
+}
+
 void tr_queue(struct tr_task *tsk, struct tr_rq *rq, nstime_t t) {
+	nstime_t d;
 	unsigned int idx;
 
 	if (unlikely(rq->tbase == 0))
 		rq->tbase = tsk->t /* sched_clock() */;
 	tsk->t = t;
-	idx = (unsigned int) ((t - rq->tbase) / NS_SLOT);
-	if (unlikely(idx >= MAX_RQ))
-		idx = MAX_RQ - 1;
-	idx = (idx + rq->ibase) & RQ_MASK;
+	d = (t - rq->tbase) / NS_SLOT;
+	if (unlikely(d >= rq->nslots))
+		d = rq->nslots - 1;
+	idx = ((unsigned int) d + rq->ibase) & rq->mask;
 	list_add_tail(&tsk->lnk, &rq->tsks[idx]);
-	__set_bit(idx, rq->map);
+	tr_map_set(rq, idx);
 }
 
 
 
+/*
+ * Multi-producer timed ring code. Same slots as the timed ring, but each
+ * slot is a Treiber stack which producers push to with a CAS, and the
+ * busy slots bitmap is updated with atomic ops. The single consumer never
+ * pops single tasks, it takes whole slot stacks with an exchange (so
+ * there is no ABA issue) and serves them in FIFO order out of a private
+ * list. Slot positions are absolute (time / NS_SLOT), relative to the
+ * consumer slot (cslot) which producers read. A producer racing with the
+ * consumer moving past its slot notices it, after having published the
+ * task, by reading cslot again, and flags the slot as late. The consumer
+ * serves late slots first. The store-load race, where the consumer skips
+ * a slot right when a producer publishes into it, is caught by the
+ * consumer scanning the skipped slots again after having published the
+ * new cslot.
+ */
+struct mtr_task {
+	struct mtr_task *next;
+	nstime_t t;
+	/* ... */
+};
 
-void cfs_test(int ntasks, int times, int loops) {
-	int i;
-	unsigned long long ts, te;
-	struct cfs_task *tasks, *tsk;
-	struct cfs_rq rq;
+struct mtr_rq {
+	struct mtr_task *heads[MAX_RQ];
+	unsigned long map[MAP_LONGS];
+	unsigned long latemap[MAP_LONGS];
+	int late;
+	nstime_t cslot;
+	/*
+	 * Consumer private data, away from the producer cache lines.
+	 */
+	unsigned int ibase __attribute__((__aligned__(128)));
+	struct mtr_task *cur, **ctail;
+};
 
-	tasks = (struct cfs_task *) malloc(ntasks * sizeof(struct cfs_task));
-	cfs_rqinit(&rq);
-	for (i = 0; i < ntasks; i++) {
-		tasks[i].t = 0;
-		cfs_queue(&tasks[i], &rq, (nstime_t) (rand() % times) * NS_SLOT);
-	}
-	rdtscll(ts);
-	for (i = 0; i < loops; i++) {
-		tsk = cfs_dequeue(&rq);
-		cfs_queue(tsk, &rq, tsk->t + (nstime_t) (times / 7) * NS_SLOT);
-	}
-	rdtscll(te);
-	free(tasks);
 
-	fprintf(stdout, "CFS = %.2lf cycles/loop\n", (double) (te - ts) / loops);
+void mtr_rqinit(struct mtr_rq *rq) {
+	memset(rq, 0, sizeof(*rq));
+	rq->ctail = &rq->cur;
 }
 
-void tr_test(int ntasks, int times, int loops) {
-	int i;
-	unsigned long long ts, te;
-	struct tr_task *tasks, *tsk;
-	struct tr_rq rq;
+static int mtr_ffs(struct mtr_rq *rq, unsigned int ibase) {
+	unsigned int i, b, n;
+	unsigned long mask;
 
-	tasks = (struct tr_task *) malloc(ntasks * sizeof(struct tr_task));
-	tr_rqinit(&rq);
-	for (i = 0; i < ntasks; i++) {
-		tasks[i].t = 0;
-		tr_queue(&tasks[i], &rq, (nstime_t) (rand() % times) * NS_SLOT);
-	}
-	rdtscll(ts);
-	for (i = 0; i < loops; i++) {
-		tsk = tr_dequeue(&rq);
-		tr_queue(tsk, &rq, tsk->t + (nstime_t) (times / 7) * NS_SLOT);
-	}
-	rdtscll(te);
-	free(tasks);
+	i = ibase / BITS_X_LONG;
+	b = ibase % BITS_X_LONG;
+	mask = ~((1UL << b) - 1);
+	for (n = MAP_LONGS + 1; n; n--) {
+		unsigned long v = __atomic_load_n(&rq->map[i], __ATOMIC_RELAXED) & mask;
 
-	fprintf(stdout, "TR  = %.2lf cycles/loop\n", (double) (te - ts) / loops);
+		if (likely(v))
+			return i * BITS_X_LONG + __ffs(v);
+		i = (i + 1) % MAP_LONGS;
+		mask = ~0UL;
+	}
+	return MAX_RQ;
 }
 
+/*
+ * Takes the whole IDX slot stack, and appends it in FIFO order to the
+ * consumer list. The bit goes first, so that a producer pushing in
+ * between sets it again.
+ */
+static void mtr_grab(struct mtr_rq *rq, unsigned int idx) {
+	struct mtr_task *tsk, *next, *fifo = NULL;
+
+	__atomic_fetch_and(&rq->map[idx / BITS_X_LONG],
+			   ~(1UL << (idx % BITS_X_LONG)), __ATOMIC_SEQ_CST);
+	tsk = __atomic_exchange_n(&rq->heads[idx], NULL, __ATOMIC_ACQUIRE);
+	for (; tsk != NULL; tsk = next) {
+		next = tsk->next;
+		tsk->next = fifo;
+		fifo = tsk;
+	}
+	if (fifo != NULL) {
+		*rq->ctail = fifo;
+		for (; fifo->next != NULL; fifo = fifo->next);
+		rq->ctail = &fifo->next;
+	}
+}
 
+static void mtr_grab_late(struct mtr_rq *rq) {
+	unsigned int i;
+	unsigned long v;
 
-int main(int ac, char **av) {
-	int i, ntasks = 128, loops = 200000;
+	for (i = 0; i < MAP_LONGS; i++)
+		for (v = __atomic_exchange_n(&rq->latemap[i], 0, __ATOMIC_ACQUIRE);
+		     v != 0; v &= v - 1)
+			mtr_grab(rq, i * BITS_X_LONG + __ffs(v));
+}
 
-	for (i = 1; i < ac; i++) {
-		if (!strcmp(av[i], "-n")) {
-			if (++i < ac)
-				ntasks = atoi(av[i]);
-		} else if (!strcmp(av[i], "-l")) {
-			if (++i < ac)
-				loops = atoi(av[i]);
+static void mtr_fill(struct mtr_rq *rq) {
+	unsigned int idx, r, d;
+
+	if (unlikely(__atomic_load_n(&rq->late, __ATOMIC_RELAXED)) &&
+	    __atomic_exchange_n(&rq->late, 0, __ATOMIC_ACQUIRE))
+		mtr_grab_late(rq);
+	while (rq->cur == NULL) {
+		idx = mtr_ffs(rq, rq->ibase);
+		if (unlikely(idx == MAX_RQ))
+			return;
+		if ((d = (idx - rq->ibase) & RQ_MASK) != 0) {
+			__atomic_store_n(&rq->cslot, rq->cslot + d, __ATOMIC_SEQ_CST);
+			for (r = mtr_ffs(rq, (rq->ibase + 1) & RQ_MASK);
+			     r != MAX_RQ && ((r - rq->ibase) & RQ_MASK) < d;
+			     r = mtr_ffs(rq, (r + 1) & RQ_MASK))
+				mtr_grab(rq, r);
+			rq->ibase = idx;
 		}
+		mtr_grab(rq, idx);
 	}
+}
 
-	cfs_test(ntasks, MAX_RQ, loops);
-	tr_test(ntasks, MAX_RQ, loops);
+struct mtr_task *mtr_dequeue(struct mtr_rq *rq) {
+	struct mtr_task *tsk;
 
-	return 0;
+	if (rq->cur == NULL) {
+		mtr_fill(rq);
+		if (unlikely(rq->cur == NULL))
+			return NULL;
+	}
+	tsk = rq->cur;
+	if ((rq->cur = tsk->next) == NULL)
+		rq->ctail = &rq->cur;
+
+	return tsk;
+}
+
+void mtr_queue(struct mtr_task *tsk, struct mtr_rq *rq, nstime_t t) {
+	unsigned int idx;
+	nstime_t cslot, slot = t / NS_SLOT;
+	struct mtr_task *head;
+
+	tsk->t = t;
+	cslot = __atomic_load_n(&rq->cslot, __ATOMIC_ACQUIRE);
+	if (unlikely(slot < cslot))
+		slot = cslot;
+	else if (unlikely(slot - cslot >= MAX_RQ))
+		slot = cslot + MAX_RQ - 1;
+	idx = (unsigned int) slot & RQ_MASK;
+	head = __atomic_load_n(&rq->heads[idx], __ATOMIC_RELAXED);
+	do {
+		tsk->next = head;
+	} while (!__atomic_compare_exchange_n(&rq->heads[idx], &head, tsk, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_fetch_or(&rq->map[idx / BITS_X_LONG], 1UL << (idx % BITS_X_LONG),
+			  __ATOMIC_SEQ_CST);
+	if (unlikely(slot < __atomic_load_n(&rq->cslot, __ATOMIC_SEQ_CST))) {
+		__atomic_fetch_or(&rq->latemap[idx / BITS_X_LONG],
+				  1UL << (idx % BITS_X_LONG), __ATOMIC_RELEASE);
+		__atomic_store_n(&rq->late, 1, __ATOMIC_RELEASE);
+	}
 }
 
+
+
+/*
+ * Hierarchical timing wheel code. Slots of level L are 2^(8 * L) ns wide,
+ * and a task sits at the level of the most significant byte in which its
+ * time differs from the wheel clock (the time of the last dequeued task).
+ * So the 8 levels cover the whole 64 bit range with exact ordering. When
+ * level 0 runs dry, the clock advances to the first busy slot of the
+ * lowest busy level, whose tasks cascade down. Every task cascades at
+ * most HTW_LEVELS - 1 times, so both operations are O(1) amortized.
+ * Times behind the clock are due right away, and go in the clock slot.
+ */
+#define HTW_LEVELS	8
+#define HTW_BITS	8
+#define HTW_SLOTS	(1 << HTW_BITS)
+#define HTW_MASK	(HTW_SLOTS - 1)
+#define HTW_MAP_LONGS	(HTW_SLOTS / BITS_X_LONG)
+
+struct htw_task {
+	struct list_head lnk;
+	nstime_t t;
+	/* ... */
+};
+
+struct htw_level {
+	struct list_head tsks[HTW_SLOTS];
+	unsigned long map[HTW_MAP_LONGS];
+};
+
+struct htw_rq {
+	nstime_t clk;
+	unsigned int lmap;
+	struct htw_level lvl[HTW_LEVELS];
+};
+
+
+void htw_rqinit(struct htw_rq *rq) {
+	int i, l;
+
+	rq->clk = 0;
+	rq->lmap = 0;
+	for (l = 0; l < HTW_LEVELS; l++) {
+		for (i = 0; i < HTW_SLOTS; i++)
+			INIT_LIST_HEAD(&rq->lvl[l].tsks[i]);
+		memset(rq->lvl[l].map, 0, sizeof(rq->lvl[l].map));
+	}
+}
+
+static void __htw_add(struct htw_rq *rq, struct htw_task *tsk) {
+	unsigned int l, idx;
+	nstime_t d;
+
+	if (likely(tsk->t > rq->clk)) {
+		d = tsk->t ^ rq->clk;
+		l = (63 - __builtin_clzll(d)) / HTW_BITS;
+		idx = (unsigned int) (tsk->t >> (l * HTW_BITS)) & HTW_MASK;
+	} else {
+		l = 0;
+		idx = (unsigned int) rq->clk & HTW_MASK;
+	}
+	list_add_tail(&tsk->lnk, &rq->lvl[l].tsks[idx]);
+	__set_bit(idx, rq->lvl[l].map);
+	rq->lmap |= 1U << l;
+}
+
+/*
+ * Busy slots of a level are all past the clock slot, so there is no need
+ * to wrap around.
+ */
+static unsigned int htw_ffs(struct htw_level const *lvl, unsigned int start) {
+	unsigned int i = start / BITS_X_LONG;
+	unsigned long v = lvl->map[i] & (~0UL << (start % BITS_X_LONG));
+
+	for (;;) {
+		if (v)
+			return i * BITS_X_LONG + __ffs(v);
+		if (++i == HTW_MAP_LONGS)
+			return HTW_SLOTS;
+		v = lvl->map[i];
+	}
+}
+
+static void htw_slot_drained(struct htw_rq *rq, unsigned int l, unsigned int idx) {
+	unsigned int i;
+
+	__clear_bit(idx, rq->lvl[l].map);
+	for (i = 0; i < HTW_MAP_LONGS; i++)
+		if (rq->lvl[l].map[i])
+			return;
+	rq->lmap &= ~(1U << l);
+}
+
+struct htw_task *htw_dequeue(struct htw_rq *rq) {
+	unsigned int l, idx, shift;
+	nstime_t hmask;
+	struct list_head *head;
+	struct htw_task *tsk;
+
+	while (likely(rq->lmap)) {
+		l = __ffs(rq->lmap);
+		shift = l * HTW_BITS;
+		idx = htw_ffs(&rq->lvl[l], (unsigned int) (rq->clk >> shift) & HTW_MASK);
+		head = &rq->lvl[l].tsks[idx];
+		if (l == 0) {
+			tsk = list_entry(head->next, struct htw_task, lnk);
+			list_del(&tsk->lnk);
+			if (list_empty(head))
+				htw_slot_drained(rq, 0, idx);
+			if (tsk->t > rq->clk)
+				rq->clk = tsk->t;
+			return tsk;
+		}
+		hmask = l == HTW_LEVELS - 1 ? 0: ~0ULL << (shift + HTW_BITS);
+		rq->clk = (rq->clk & hmask) | ((nstime_t) idx << shift);
+		while (!list_empty(head)) {
+			tsk = list_entry(head->next, struct htw_task, lnk);
+			list_del(&tsk->lnk);
+			__htw_add(rq, tsk);
+		}
+		htw_slot_drained(rq, l, idx);
+	}
+
+	return NULL;
+}
+
+void htw_queue(struct htw_task *tsk, struct htw_rq *rq, nstime_t t) {
+	tsk->t = t;
+	__htw_add(rq, tsk);
+}
+
+
+
+/*
+ * Implicit D-ary heap code. The heap array holds the keys next to the
+ * task pointers, so that sifting does not touch the tasks at all.
+ */
+struct hp_task {
+	nstime_t t;
+	/* ... */
+};
+
+struct hp_ent {
+	nstime_t t;
+	struct hp_task *tsk;
+};
+
+struct hp_rq {
+	int n, size;
+	struct hp_ent *ents;
+};
+
+
+void hp_rqinit(struct hp_rq *rq, int size) {
+	rq->n = 0;
+	rq->size = size;
+	rq->ents = (struct hp_ent *) malloc(size * sizeof(struct hp_ent));
+}
+
+void hp_rqfini(struct hp_rq *rq) {
+	free(rq->ents);
+}
+
+static inline void __hp_queue(struct hp_rq *rq, struct hp_task *tsk, nstime_t t,
+			      int d) {
+	int i, p;
+	struct hp_ent *ents = rq->ents;
+
+	tsk->t = t;
+	for (i = rq->n++; i > 0; i = p) {
+		p = (i - 1) / d;
+		if (ents[p].t <= t)
+			break;
+		ents[i] = ents[p];
+	}
+	ents[i].t = t;
+	ents[i].tsk = tsk;
+}
+
+static inline struct hp_task *__hp_dequeue(struct hp_rq *rq, int d) {
+	int i, c, j, m, n;
+	struct hp_ent *ents = rq->ents, last;
+	struct hp_task *tsk;
+
+	if (unlikely(rq->n == 0))
+		return NULL;
+	tsk = ents[0].tsk;
+	n = --rq->n;
+	last = ents[n];
+	for (i = 0; (c = d * i + 1) < n; i = m) {
+		m = c;
+		for (j = c + 1; j < c + d && j < n; j++)
+			if (ents[j].t < ents[m].t)
+				m = j;
+		if (last.t <= ents[m].t)
+			break;
+		ents[i] = ents[m];
+	}
+	ents[i] = last;
+
+	return tsk;
+}
+
+void bh_queue(struct hp_task *tsk, struct hp_rq *rq, nstime_t t) {
+	__hp_queue(rq, tsk, t, 2);
+}
+
+struct hp_task *bh_dequeue(struct hp_rq *rq) {
+	return __hp_dequeue(rq, 2);
+}
+
+void qh_queue(struct hp_task *tsk, struct hp_rq *rq, nstime_t t) {
+	__hp_queue(rq, tsk, t, 4);
+}
+
+struct hp_task *qh_dequeue(struct hp_rq *rq) {
+	return __hp_dequeue(rq, 4);
+}
+
+
+
+/*
+ * Pairing heap code (two-pass pairing on delete-min).
+ */
+struct ph_task {
+	struct ph_task *child, *next;
+	nstime_t t;
+	/* ... */
+};
+
+struct ph_rq {
+	struct ph_task *root;
+};
+
+
+void ph_rqinit(struct ph_rq *rq) {
+	rq->root = NULL;
+}
+
+static inline struct ph_task *ph_meld(struct ph_task *a, struct ph_task *b) {
+	if (b->t < a->t) {
+		struct ph_task *tmp = a;
+
+		a = b;
+		b = tmp;
+	}
+	b->next = a->child;
+	a->child = b;
+
+	return a;
+}
+
+void ph_queue(struct ph_task *tsk, struct ph_rq *rq, nstime_t t) {
+	tsk->t = t;
+	tsk->child = tsk->next = NULL;
+	rq->root = rq->root != NULL ? ph_meld(rq->root, tsk): tsk;
+}
+
+struct ph_task *ph_dequeue(struct ph_rq *rq) {
+	struct ph_task *tsk = rq->root, *a, *b, *next, *pairs = NULL, *res;
+
+	if (unlikely(tsk == NULL))
+		return NULL;
+	/*
+	 * First pass pairs up the children left to right, chaining the
+	 * results in reverse order, and the second one melds them back
+	 * right to left.
+	 */
+	for (a = tsk->child; a != NULL; a = next) {
+		if ((b = a->next) == NULL) {
+			a->next = pairs;
+			pairs = a;
+			break;
+		}
+		next = b->next;
+		a->next = b->next = NULL;
+		res = ph_meld(a, b);
+		res->next = pairs;
+		pairs = res;
+	}
+	for (res = NULL; pairs != NULL; pairs = next) {
+		next = pairs->next;
+		pairs->next = NULL;
+		res = res != NULL ? ph_meld(res, pairs): pairs;
+	}
+	rq->root = res;
+
+	return tsk;
+}
+
+
+
+/*
+ * Radix heap code. A monotone queue: bucket 0 holds the tasks whose time
+ * equals the one of the last dequeued task, and bucket B the ones whose
+ * time first differs from it at bit B - 1. When bucket 0 runs dry, the
+ * lowest busy bucket is redistributed around its minimum, every task
+ * moving to a lower bucket. Times behind the last one go in bucket 0.
+ */
+#define RH_BUCKETS	65
+
+struct rh_task {
+	struct list_head lnk;
+	nstime_t t;
+	/* ... */
+};
+
+struct rh_rq {
+	nstime_t last;
+	unsigned long long map;
+	struct list_head bkts[RH_BUCKETS];
+};
+
+
+void rh_rqinit(struct rh_rq *rq) {
+	int i;
+
+	rq->last = 0;
+	rq->map = 0;
+	for (i = 0; i < RH_BUCKETS; i++)
+		INIT_LIST_HEAD(&rq->bkts[i]);
+}
+
+static inline void __rh_add(struct rh_rq *rq, struct rh_task *tsk) {
+	int b;
+
+	if (likely(tsk->t > rq->last)) {
+		b = 64 - __builtin_clzll(tsk->t ^ rq->last);
+		rq->map |= 1ULL << (b - 1);
+	} else
+		b = 0;
+	list_add_tail(&tsk->lnk, &rq->bkts[b]);
+}
+
+void rh_queue(struct rh_task *tsk, struct rh_rq *rq, nstime_t t) {
+	tsk->t = t;
+	__rh_add(rq, tsk);
+}
+
+struct rh_task *rh_dequeue(struct rh_rq *rq) {
+	int b;
+	struct list_head *pos, *head;
+	struct rh_task *tsk;
+
+	if (list_empty(&rq->bkts[0])) {
+		if (unlikely(rq->map == 0))
+			return NULL;
+		b = __ffs(rq->map) + 1;
+		head = &rq->bkts[b];
+		rq->last = ~0ULL;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			tsk = list_entry(pos, struct rh_task, lnk);
+			if (tsk->t < rq->last)
+				rq->last = tsk->t;
+		}
+		rq->map &= ~(1ULL << (b - 1));
+		while (!list_empty(head)) {
+			tsk = list_entry(head->next, struct rh_task, lnk);
+			list_del(&tsk->lnk);
+			__rh_add(rq, tsk);
+		}
+	}
+	tsk = list_entry(rq->bkts[0].next, struct rh_task, lnk);
+	list_del(&tsk->lnk);
+
+	return tsk;
+}
+
+
+
+/*
+ * Calendar queue code (R. Brown, CACM 1988). Buckets are "days" of a
+ * power of two width, each holding a sorted list, and the dequeue walks
+ * the days of the current "year" looking for a task due within it. The
+ * number of days tracks the queue size (doubled above 2 tasks per day,
+ * halved below 1/2), and the day width is re-estimated at every resize,
+ * from the separation of the earliest tasks.
+ */
+#define CQ_MIN_BUCKETS	16
+#define CQ_SAMPLES	25
+
+struct cq_task {
+	struct list_head lnk;
+	nstime_t t;
+	/* ... */
+};
+
+struct cq_rq {
+	struct list_head *bkts;
+	unsigned int nbkts, mask, wshift;
+	unsigned long n;
+	unsigned int cur;
+	nstime_t top;
+	int noresize;
+};
+
+
+static void cq_alloc(struct cq_rq *rq, unsigned int nbkts, unsigned int wshift) {
+	unsigned int i;
+
+	rq->bkts = (struct list_head *) malloc(nbkts * sizeof(struct list_head));
+	for (i = 0; i < nbkts; i++)
+		INIT_LIST_HEAD(&rq->bkts[i]);
+	rq->nbkts = nbkts;
+	rq->mask = nbkts - 1;
+	rq->wshift = wshift;
+	rq->cur = 0;
+	rq->top = 1ULL << wshift;
+}
+
+void cq_rqinit(struct cq_rq *rq) {
+	rq->n = 0;
+	rq->noresize = 0;
+	cq_alloc(rq, CQ_MIN_BUCKETS, 20);
+}
+
+void cq_rqfini(struct cq_rq *rq) {
+	free(rq->bkts);
+}
+
+static void __cq_add(struct cq_rq *rq, struct cq_task *tsk) {
+	unsigned int b = (unsigned int) (tsk->t >> rq->wshift) & rq->mask;
+	struct list_head *head = &rq->bkts[b], *pos;
+
+	/*
+	 * Requeues mostly land at the end of the day, so walk it backward.
+	 */
+	for (pos = head->prev; pos != head &&
+		     list_entry(pos, struct cq_task, lnk)->t > tsk->t; pos = pos->prev);
+	__list_add(&tsk->lnk, pos, pos->next);
+	/*
+	 * A task earlier than the current day moves the calendar back.
+	 */
+	if (tsk->t < rq->top - (1ULL << rq->wshift)) {
+		rq->cur = b;
+		rq->top = ((tsk->t >> rq->wshift) + 1) << rq->wshift;
+	}
+	rq->n++;
+}
+
+static struct cq_task *__cq_dequeue(struct cq_rq *rq) {
+	unsigned int i, b;
+	nstime_t tmin;
+	struct list_head *head;
+	struct cq_task *tsk;
+
+	if (unlikely(rq->n == 0))
+		return NULL;
+	for (i = 0; i < rq->nbkts; i++) {
+		head = &rq->bkts[rq->cur];
+		if (!list_empty(head) &&
+		    (tsk = list_entry(head->next, struct cq_task, lnk))->t < rq->top)
+			goto found;
+		rq->cur = (rq->cur + 1) & rq->mask;
+		rq->top += 1ULL << rq->wshift;
+	}
+	/*
+	 * Nothing within a year, jump straight to the earliest task.
+	 */
+	for (i = 0, tmin = ~0ULL, b = 0; i < rq->nbkts; i++)
+		if (!list_empty(&rq->bkts[i]) &&
+		    list_entry(rq->bkts[i].next, struct cq_task, lnk)->t < tmin) {
+			tmin = list_entry(rq->bkts[i].next, struct cq_task, lnk)->t;
+			b = i;
+		}
+	rq->cur = b;
+	rq->top = ((tmin >> rq->wshift) + 1) << rq->wshift;
+	tsk = list_entry(rq->bkts[b].next, struct cq_task, lnk);
+
+found:
+	list_del(&tsk->lnk);
+	rq->n--;
+
+	return tsk;
+}
+
+/*
+ * The new day width is three times the average separation of the
+ * earliest tasks, leaving out the separations larger than twice the
+ * plain average. Zero separations are left out as well, or a bunch of
+ * tasks sharing the same time would shrink the days to nothing.
+ */
+static unsigned int cq_width(struct cq_rq *rq) {
+	int i, n, m;
+	nstime_t sum, avg, sep;
+	struct cq_task *smp[CQ_SAMPLES];
+
+	for (n = 0; n < CQ_SAMPLES && (smp[n] = __cq_dequeue(rq)) != NULL; n++);
+	for (i = n - 1; i >= 0; i--)
+		__cq_add(rq, smp[i]);
+	for (i = 1, sum = 0, m = 0; i < n; i++)
+		if ((sep = smp[i]->t - smp[i - 1]->t) != 0) {
+			sum += sep;
+			m++;
+		}
+	if (m == 0)
+		return rq->wshift;
+	avg = sum / m;
+	for (i = 1, sum = 0, m = 0; i < n; i++)
+		if ((sep = smp[i]->t - smp[i - 1]->t) != 0 && sep <= 2 * avg) {
+			sum += sep;
+			m++;
+		}
+	sep = 3 * sum / m;
+
+	return sep > 1 ? 64 - __builtin_clzll(sep - 1): 0;
+}
+
+static void cq_resize(struct cq_rq *rq, unsigned int nbkts) {
+	unsigned int i, obkts = rq->nbkts, wshift;
+	struct list_head *old = rq->bkts;
+	struct cq_task *tsk;
+
+	wshift = cq_width(rq);
+	cq_alloc(rq, nbkts, wshift);
+	rq->n = 0;
+	for (i = 0; i < obkts; i++)
+		while (!list_empty(&old[i])) {
+			tsk = list_entry(old[i].prev, struct cq_task, lnk);
+			list_del(&tsk->lnk);
+			__cq_add(rq, tsk);
+		}
+	free(old);
+}
+
+void cq_queue(struct cq_task *tsk, struct cq_rq *rq, nstime_t t) {
+	tsk->t = t;
+	__cq_add(rq, tsk);
+	if (unlikely(rq->n > 2 * rq->nbkts))
+		cq_resize(rq, 2 * rq->nbkts);
+}
+
+struct cq_task *cq_dequeue(struct cq_rq *rq) {
+	struct cq_task *tsk = __cq_dequeue(rq);
+
+	if (unlikely(rq->n < rq->nbkts / 2 && rq->nbkts > CQ_MIN_BUCKETS))
+		cq_resize(rq, rq->nbkts / 2);
+
+	return tsk;
+}
+
+
+
+/*
+ * Common queue interface, which the benchmark driver goes through.
+ */
+struct pq_ops {
+	char const *name;
+	size_t rqsize, tsksize;
+	void (*init)(void *rq, int ntasks);
+	void (*fini)(void *rq);
+	void (*queue)(void *rq, void *tsk, nstime_t t);
+	void *(*dequeue)(void *rq);
+	nstime_t (*key)(void const *tsk);
+	/*
+	 * Optional, removes the latest task (NULL if the queue cannot
+	 * do that cheaply, in which case stealers take the earliest).
+	 */
+	void *(*dequeue_last)(void *rq);
+};
+
+#define PQ_DEFINE(pfx, rqtype, tsktype, initexp, finiexp)		\
+static void pfx##_pq_init(void *rq, int ntasks) {			\
+	rqtype *__rq = (rqtype *) rq;					\
+									\
+	(void) ntasks;							\
+	initexp;							\
+}									\
+static void pfx##_pq_fini(void *rq) {					\
+	rqtype *__rq = (rqtype *) rq;					\
+									\
+	(void) __rq;							\
+	finiexp;							\
+}									\
+static void pfx##_pq_queue(void *rq, void *tsk, nstime_t t) {		\
+	pfx##_queue((tsktype *) tsk, (rqtype *) rq, t);			\
+}									\
+static void *pfx##_pq_dequeue(void *rq) {				\
+	return pfx##_dequeue((rqtype *) rq);				\
+}									\
+static nstime_t pfx##_pq_key(void const *tsk) {				\
+	return ((tsktype const *) tsk)->t;				\
+}
+
+#define PQ_OPS(pfx, rqtype, tsktype, dqlast) {				\
+	#pfx, sizeof(rqtype), sizeof(tsktype), pfx##_pq_init,		\
+	pfx##_pq_fini, pfx##_pq_queue, pfx##_pq_dequeue, pfx##_pq_key,	\
+	dqlast								\
+}
+
+PQ_DEFINE(cfs, struct cfs_rq, struct cfs_task, cfs_rqinit(__rq), )
+/*
+ * The timed ring flavors share the tr_* code, and differ only in the
+ * slot search. The slot count is global, to be swept by the driver.
+ */
+static unsigned int tr_slots = MAX_RQ;
+
+#define trs_queue	tr_queue
+#define trs_dequeue	tr_dequeue
+#define trv_queue	tr_queue
+#define trv_dequeue	tr_dequeue
+
+PQ_DEFINE(tr, struct tr_rq, struct tr_task,
+	  tr_rqinit(__rq, tr_slots, TR_SCAN_LINEAR), tr_rqfini(__rq))
+PQ_DEFINE(trs, struct tr_rq, struct tr_task,
+	  tr_rqinit(__rq, tr_slots, TR_SCAN_SUMMARY), tr_rqfini(__rq))
+#ifdef __AVX2__
+PQ_DEFINE(trv, struct tr_rq, struct tr_task,
+	  tr_rqinit(__rq, tr_slots, TR_SCAN_AVX2), tr_rqfini(__rq))
+#endif
+PQ_DEFINE(mtr, struct mtr_rq, struct mtr_task, mtr_rqinit(__rq), )
+PQ_DEFINE(htw, struct htw_rq, struct htw_task, htw_rqinit(__rq), )
+PQ_DEFINE(bh, struct hp_rq, struct hp_task, hp_rqinit(__rq, ntasks),
+	  hp_rqfini(__rq))
+PQ_DEFINE(qh, struct hp_rq, struct hp_task, hp_rqinit(__rq, ntasks),
+	  hp_rqfini(__rq))
+PQ_DEFINE(ph, struct ph_rq, struct ph_task, ph_rqinit(__rq), )
+PQ_DEFINE(rh, struct rh_rq, struct rh_task, rh_rqinit(__rq), )
+PQ_DEFINE(cq, struct cq_rq, struct cq_task, cq_rqinit(__rq),
+	  cq_rqfini(__rq))
+
+static void *cfs_pq_dequeue_last(void *rq) {
+	return cfs_dequeue_last((struct cfs_rq *) rq);
+}
+
+static void *tr_pq_dequeue_last(void *rq) {
+	return tr_dequeue_last((struct tr_rq *) rq);
+}
+
+static struct pq_ops const pq_backends[] = {
+	PQ_OPS(cfs, struct cfs_rq, struct cfs_task, cfs_pq_dequeue_last),
+	PQ_OPS(tr, struct tr_rq, struct tr_task, tr_pq_dequeue_last),
+	PQ_OPS(trs, struct tr_rq, struct tr_task, tr_pq_dequeue_last),
+#ifdef __AVX2__
+	PQ_OPS(trv, struct tr_rq, struct tr_task, tr_pq_dequeue_last),
+#endif
+	PQ_OPS(mtr, struct mtr_rq, struct mtr_task, NULL),
+	PQ_OPS(htw, struct htw_rq, struct htw_task, NULL),
+	PQ_OPS(bh, struct hp_rq, struct hp_task, NULL),
+	PQ_OPS(qh, struct hp_rq, struct hp_task, NULL),
+	PQ_OPS(ph, struct ph_rq, struct ph_task, NULL),
+	PQ_OPS(rh, struct rh_rq, struct rh_task, NULL),
+	PQ_OPS(cq, struct cq_rq, struct cq_task, NULL),
+};
+
+#define NUM_BACKENDS	((int) (sizeof(pq_backends) / sizeof(pq_backends[0])))
+
+
+
+/*
+ * Benchmark driver. Every loop dequeues a batch of tasks and requeues
+ * them, each one at the current clock (the latest dequeued time) plus a
+ * delta taken out of the selected distribution. The batch size is what
+ * makes the patterns: one task ("hold", the classic hold model), PQ_BATCH
+ * tasks ("batch"), or the whole queue ("drain").
+ */
+#define PQ_BATCH	64
+#define NUM_DELTAS	(1 << 16)
+
+enum {
+	PQ_HOLD,
+	PQ_BATCHED,
+	PQ_DRAIN,
+	NUM_PATTERNS
+};
+
+enum {
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+	DIST_BIMODAL,
+	NUM_DISTS
+};
+
+static char const * const pq_patterns[NUM_PATTERNS] = {
+	"hold", "batch", "drain"
+};
+
+static char const * const pq_dists[NUM_DISTS] = {
+	"fixed", "uniform", "exp", "bimodal"
+};
+
+
+/*
+ * Deltas are precomputed, to keep rand() and log() out of the timed loop.
+ * The "fixed" one is the original test, requeueing every task times/7
+ * slots ahead, the exponential one has the same mean, and the bimodal
+ * one mixes short sleeps with a 10% of far away timers.
+ */
+static void pq_deltas(nstime_t *deltas, int dist, int times) {
+	int i;
+	double u;
+
+	for (i = 0; i < NUM_DELTAS; i++) {
+		switch (dist) {
+		case DIST_FIXED:
+			deltas[i] = (nstime_t) (times / 7) * NS_SLOT;
+			break;
+		case DIST_UNIFORM:
+			deltas[i] = (nstime_t) (rand() % times) * NS_SLOT;
+			break;
+		case DIST_EXP:
+			u = (rand() + 1.0) / (RAND_MAX + 2.0);
+			deltas[i] = (nstime_t) (-log(u) * (times / 7) * NS_SLOT);
+			break;
+		case DIST_BIMODAL:
+			if (rand() % 10)
+				deltas[i] = (nstime_t) (rand() % (times / 16 + 1)) * NS_SLOT;
+			else
+				deltas[i] = (nstime_t) (times / 2 + rand() % (times / 2 + 1)) *
+					NS_SLOT;
+			break;
+		}
+	}
+}
+
+/*
+ * Hardware counters, opened as a single perf group so that they are all
+ * scheduled (and multiplexed) together around the benchmark loop. Events
+ * the PMU (or the perf_event_paranoid setting) does not allow are left
+ * out of the group, and reported as "-".
+ */
+enum {
+	PE_INSTRUCTIONS,
+	PE_CACHE_MISSES,
+	PE_L1D_MISSES,
+	PE_BRANCH_MISSES,
+	PE_NUM_EVENTS
+};
+
+struct pe_group {
+	int leader;
+	int fds[PE_NUM_EVENTS];
+	int idx[PE_NUM_EVENTS];
+	int nevents;
+};
+
+static struct pe_event {
+	unsigned int type;
+	unsigned long long config;
+} const pe_events[PE_NUM_EVENTS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int pe_open(unsigned int type, unsigned long long config, int group) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void pe_gopen(struct pe_group *pg) {
+	int i, fd;
+
+	pg->leader = -1;
+	pg->nevents = 0;
+	for (i = 0; i < PE_NUM_EVENTS; i++) {
+		pg->idx[i] = -1;
+		if ((fd = pe_open(pe_events[i].type, pe_events[i].config,
+				  pg->leader)) == -1)
+			continue;
+		if (pg->leader == -1)
+			pg->leader = fd;
+		pg->fds[pg->nevents] = fd;
+		pg->idx[i] = pg->nevents++;
+	}
+}
+
+static void pe_gstart(struct pe_group *pg) {
+	if (pg->leader != -1) {
+		ioctl(pg->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(pg->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+/*
+ * Stops the group and formats every event count, divided by ops, into
+ * the matching bufs[] entry ("-" for the ones which are not available).
+ */
+static void pe_gstop(struct pe_group *pg, int ops, char bufs[][32]) {
+	int i;
+	unsigned long long vals[PE_NUM_EVENTS + 1];
+	ssize_t size = (pg->nevents + 1) * sizeof(unsigned long long);
+
+	if (pg->leader != -1) {
+		ioctl(pg->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		if (read(pg->leader, vals, size) != size)
+			vals[0] = 0;
+	}
+	for (i = 0; i < PE_NUM_EVENTS; i++) {
+		if (pg->idx[i] != -1 &&
+		    vals[0] == (unsigned long long) pg->nevents)
+			sprintf(bufs[i], "%.2lf",
+				(double) vals[1 + pg->idx[i]] / ops);
+		else
+			strcpy(bufs[i], "-");
+	}
+}
+
+static void pe_gclose(struct pe_group *pg) {
+	int i;
+
+	for (i = pg->nevents - 1; i >= 0; i--)
+		close(pg->fds[i]);
+	pg->leader = -1;
+	pg->nevents = 0;
+}
+
+void pq_test(struct pq_ops const *ops, int pattern, int dist, int ntasks,
+	     int times, int loops) {
+	int i, j, n, batch, ooo = 0;
+	unsigned int d = 0;
+	unsigned long long ts, te;
+	nstime_t clk = 0, *deltas;
+	char *tasks;
+	void *rq, **tsks;
+	struct pe_group pg;
+	char pbufs[PE_NUM_EVENTS][32];
+
+	/*
+	 * Same seed for every backend, so that they all see the same keys.
+	 */
+	srand(1);
+	deltas = (nstime_t *) malloc(NUM_DELTAS * sizeof(nstime_t));
+	pq_deltas(deltas, dist, times);
+	batch = pattern == PQ_HOLD ? 1: pattern == PQ_BATCHED ? PQ_BATCH: ntasks;
+	if (batch > ntasks)
+		batch = ntasks;
+	if (batch > loops)
+		batch = loops;
+	tsks = (void **) malloc(batch * sizeof(void *));
+	/*
+	 * Tasks are zeroed, since some queue code reads the task time on
+	 * its first insertion.
+	 */
+	tasks = (char *) calloc(ntasks, ops->tsksize);
+	rq = calloc(1, ops->rqsize);
+	ops->init(rq, ntasks);
+	for (i = 0; i < ntasks; i++)
+		ops->queue(rq, tasks + i * ops->tsksize,
+			   (nstime_t) (rand() % times) * NS_SLOT);
+
+	pe_gopen(&pg);
+	pe_gstart(&pg);
+	rdtscll(ts);
+	for (i = 0; i < loops; i += n) {
+		n = loops - i < batch ? loops - i: batch;
+		for (j = 0; j < n; j++) {
+			tsks[j] = ops->dequeue(rq);
+			if (ops->key(tsks[j]) < clk)
+				ooo++;
+			else
+				clk = ops->key(tsks[j]);
+		}
+		for (j = 0; j < n; j++, d++)
+			ops->queue(rq, tsks[j], clk + deltas[d & (NUM_DELTAS - 1)]);
+	}
+	rdtscll(te);
+	pe_gstop(&pg, loops, pbufs);
+	pe_gclose(&pg);
+
+	ops->fini(rq);
+	free(rq);
+	free(tasks);
+	free(tsks);
+	free(deltas);
+
+	fprintf(stdout, "%-4s %-6s %-8s N = %-9d %10.2lf cycles/op, %8s ins/op, "
+		"%8s misses/op, %8s l1d/op, %8s brmiss/op, %d out of order\n",
+		ops->name, pq_patterns[pattern], pq_dists[dist], ntasks,
+		(double) (te - ts) / loops, pbufs[PE_INSTRUCTIONS],
+		pbufs[PE_CACHE_MISSES], pbufs[PE_L1D_MISSES],
+		pbufs[PE_BRANCH_MISSES], ooo);
+}
+
+/*
+ * Scheduler trace replay. The trace is a text file with one event per
+ * line, '#' lines being comments:
+ *
+ *   <ts> wakeup <pid>
+ *   <ts> switch <prev> <next> [<prev_state>]
+ *
+ * where <ts> is either integer nanoseconds or decimal seconds, pid 0 is
+ * the idle task, and a prev_state starting with 'R' means that the
+ * previous task got preempted (so it is runnable again). Events of all
+ * CPUs feed a single queue. This gets one out of perf:
+ *
+ *   perf sched record -- sleep 10
+ *   perf script | awk '
+ *     { for (i = 1; i <= NF && $i !~ /^[0-9]+\.[0-9]+:$/; i++); t = $i; sub(/:$/, "", t) }
+ *     / sched:sched_wakeup(_new)?: / { for (; i <= NF; i++) if (sub(/^pid=/, "", $i)) print t, "wakeup", $i }
+ *     / sched:sched_switch: / {
+ *       for (; i <= NF; i++) {
+ *         if (sub(/^prev_pid=/, "", $i)) p = $i
+ *         if (sub(/^prev_state=/, "", $i)) s = $i
+ *         if (sub(/^next_pid=/, "", $i)) n = $i
+ *       }
+ *       print t, "switch", p, n, s
+ *     }'
+ *
+ * Runnable tasks are queued with their wakeup (or preemption) time plus
+ * the length of their last run in the trace, so a deadline of sorts,
+ * which favors short runners. A switch to a non idle task dequeues from
+ * the queue under test, which is what the replay follows from there on
+ * (the task picked by the trace is only used for the "trace picks" ratio).
+ * Every dequeued task is checked against an exact reference (an rbtree
+ * with every queued task), and the ordering error is its time minus the
+ * earliest queued one.
+ */
+#define LH_SUBBITS	4
+#define LH_SUB		(1 << LH_SUBBITS)
+#define LH_BUCKETS	(64 * LH_SUB)
+
+enum {
+	TEV_WAKEUP,
+	TEV_SWITCH
+};
+
+struct trace_event {
+	nstime_t ts;
+	int type, a, b, runnable;
+};
+
+struct trace {
+	struct trace_event *evs;
+	int nevs, nids;
+};
+
+struct lat_hist {
+	unsigned long long n, sum, max;
+	unsigned long long cnt[LH_BUCKETS];
+};
+
+
+/*
+ * Log-linear histogram, LH_SUB buckets for every power of two.
+ */
+static inline int lh_index(unsigned long long v) {
+	int m;
+
+	if (v < LH_SUB)
+		return (int) v;
+	m = 63 - __builtin_clzll(v);
+
+	return (m - LH_SUBBITS + 1) * LH_SUB + (int) ((v >> (m - LH_SUBBITS)) & (LH_SUB - 1));
+}
+
+static unsigned long long lh_value(int i) {
+	int m;
+
+	if (i < LH_SUB)
+		return i;
+	m = i / LH_SUB + LH_SUBBITS - 1;
+
+	return (unsigned long long) (LH_SUB + i % LH_SUB) << (m - LH_SUBBITS);
+}
+
+static inline void lh_add(struct lat_hist *h, unsigned long long v) {
+	h->cnt[lh_index(v)]++;
+	h->n++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static unsigned long long lh_pct(struct lat_hist const *h, double pct) {
+	int i;
+	unsigned long long n = 0, lim = (unsigned long long) (h->n * pct / 100.0);
+
+	for (i = 0; i < LH_BUCKETS; i++)
+		if ((n += h->cnt[i]) > lim)
+			return lh_value(i);
+
+	return h->max;
+}
+
+static void lh_print(char const *name, char const *op, struct lat_hist const *h) {
+	fprintf(stdout, "%-4s %-8s N = %-9llu avg %8.1lf  p50 %6llu  p90 %6llu  p99 %6llu  "
+		"p99.9 %6llu  max %8llu cycles\n", name, op, h->n,
+		h->n ? (double) h->sum / h->n: 0.0, lh_pct(h, 50), lh_pct(h, 90),
+		lh_pct(h, 99), lh_pct(h, 99.9), h->max);
+}
+
+static int cmp_int(void const *p1, void const *p2) {
+	int const *i1 = p1, *i2 = p2;
+
+	return *i1 > *i2 ? 1: *i1 < *i2 ? -1: 0;
+}
+
+static nstime_t trace_ts(char const *str) {
+	char *end;
+	nstime_t ts = strtoull(str, &end, 10);
+
+	return *end == '.' ? (nstime_t) (strtod(str, NULL) * 1e9): ts;
+}
+
+/*
+ * Loads the trace, and maps pids to dense ids (0 stays the idle task),
+ * with event times rebased to the first one.
+ */
+int trace_load(struct trace *tr, char const *path) {
+	int i, n, npids = 0, *pids, *pid;
+	long size = 0;
+	nstime_t t0;
+	char line[512], tsbuf[64], type[32], state[32];
+	FILE *file;
+	struct trace_event *ev;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	memset(tr, 0, sizeof(*tr));
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (tr->nevs == size) {
+			size = size ? 2 * size: 4096;
+			tr->evs = (struct trace_event *) realloc(tr->evs, size * sizeof(*ev));
+		}
+		ev = &tr->evs[tr->nevs];
+		state[0] = '\0';
+		n = sscanf(line, "%63s %31s %d %d %31s", tsbuf, type, &ev->a, &ev->b, state);
+		if (n >= 3 && !strcmp(type, "wakeup"))
+			ev->type = TEV_WAKEUP;
+		else if (n >= 4 && !strcmp(type, "switch")) {
+			ev->type = TEV_SWITCH;
+			ev->runnable = state[0] == 'R';
+		} else {
+			fprintf(stderr, "%s: bad trace line: %s", path, line);
+			continue;
+		}
+		ev->ts = trace_ts(tsbuf);
+		tr->nevs++;
+	}
+	fclose(file);
+	if (tr->nevs == 0) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		return -1;
+	}
+
+	pids = (int *) malloc(2 * tr->nevs * sizeof(int));
+	for (i = 0; i < tr->nevs; i++) {
+		pids[npids++] = tr->evs[i].a;
+		if (tr->evs[i].type == TEV_SWITCH)
+			pids[npids++] = tr->evs[i].b;
+	}
+	qsort(pids, npids, sizeof(int), cmp_int);
+	for (i = n = 0; i < npids; i++)
+		if (pids[i] != 0 && (n == 0 || pids[i] != pids[n - 1]))
+			pids[n++] = pids[i];
+	t0 = tr->evs[0].ts;
+	for (i = 0; i < tr->nevs; i++) {
+		ev = &tr->evs[i];
+		pid = bsearch(&ev->a, pids, n, sizeof(int), cmp_int);
+		ev->a = pid != NULL ? (int) (pid - pids) + 1: 0;
+		if (ev->type == TEV_SWITCH) {
+			pid = bsearch(&ev->b, pids, n, sizeof(int), cmp_int);
+			ev->b = pid != NULL ? (int) (pid - pids) + 1: 0;
+		}
+		ev->ts -= t0;
+	}
+	tr->nids = n + 1;
+	free(pids);
+
+	return 0;
+}
+
+void trace_free(struct trace *tr) {
+	free(tr->evs);
+}
+
+void replay_test(struct pq_ops const *ops, struct trace const *tr) {
+	int i, id;
+	unsigned long long ts, te, ooo = 0, picks = 0, empty = 0, dups = 0;
+	nstime_t key, rmin, err, errsum = 0, errmax = 0, *runtime, *swin;
+	char *tasks, *queued;
+	void *rq, *tsk;
+	struct cfs_task *ref;
+	struct cfs_rq rrq;
+	struct trace_event const *ev;
+	struct lat_hist *qh, *dqh;
+
+	tasks = (char *) calloc(tr->nids, ops->tsksize);
+	queued = (char *) calloc(tr->nids, 1);
+	runtime = (nstime_t *) calloc(tr->nids, sizeof(nstime_t));
+	swin = (nstime_t *) calloc(tr->nids, sizeof(nstime_t));
+	ref = (struct cfs_task *) calloc(tr->nids, sizeof(struct cfs_task));
+	qh = (struct lat_hist *) calloc(1, sizeof(struct lat_hist));
+	dqh = (struct lat_hist *) calloc(1, sizeof(struct lat_hist));
+	rq = calloc(1, ops->rqsize);
+	ops->init(rq, tr->nids);
+	cfs_rqinit(&rrq);
+
+	for (i = 0; i < tr->nevs; i++) {
+		ev = &tr->evs[i];
+		if (ev->type == TEV_SWITCH) {
+			if (ev->a != 0)
+				runtime[ev->a] = ev->ts - swin[ev->a];
+			swin[ev->b] = ev->ts;
+		}
+		if ((id = ev->a) != 0 &&
+		    (ev->type == TEV_WAKEUP || ev->runnable)) {
+			if (queued[id]) {
+				dups++;
+			} else {
+				key = ev->ts + runtime[id];
+				tsk = tasks + id * ops->tsksize;
+				rdtscll(ts);
+				ops->queue(rq, tsk, key);
+				rdtscll(te);
+				lh_add(qh, te - ts);
+				cfs_queue(&ref[id], &rrq, key);
+				queued[id] = 1;
+			}
+		}
+		if (ev->type != TEV_SWITCH || ev->b == 0)
+			continue;
+		if (RB_EMPTY_ROOT(&rrq.tasks_timeline)) {
+			empty++;
+			continue;
+		}
+		rdtscll(ts);
+		tsk = ops->dequeue(rq);
+		rdtscll(te);
+		lh_add(dqh, te - ts);
+		id = (int) (((char *) tsk - tasks) / ops->tsksize);
+		rmin = rb_entry(first_fair(&rrq), struct cfs_task, run_node)->t;
+		if ((key = ops->key(tsk)) > rmin) {
+			ooo++;
+			err = key - rmin;
+			errsum += err;
+			if (err > errmax)
+				errmax = err;
+		}
+		picks += id == ev->b;
+		queued[id] = 0;
+		__dequeue_task_fair(&rrq, &ref[id]);
+	}
+
+	lh_print(ops->name, "enqueue", qh);
+	lh_print(ops->name, "dequeue", dqh);
+	fprintf(stdout, "%-4s %-8s %llu out of order (%.2lf%%), %.1lf us avg error, "
+		"%.1lf us max error, %.2lf%% trace picks, %llu empty, %llu dups\n",
+		ops->name, "order", ooo, dqh->n ? 100.0 * ooo / dqh->n: 0.0,
+		ooo ? errsum / (ooo * 1000.0): 0.0, errmax / 1000.0,
+		dqh->n ? 100.0 * picks / dqh->n: 0.0, empty, dups);
+
+	ops->fini(rq);
+	free(rq);
+	free(dqh);
+	free(qh);
+	free(ref);
+	free(swin);
+	free(runtime);
+	free(queued);
+	free(tasks);
+}
+
+
+
+/*
+ * Fairness test. All tasks are CPU bound, with a random nice level and
+ * a slice of 0.75, 3 or 6 ms, and every pick runs the task for its whole
+ * slice. The plain key ordering (key) requeues tasks their slice ahead,
+ * ignoring weights (like the other tests do), the weighted CFS (wcfs)
+ * and EEVDF (eevdf) charge the weighted vruntime. Every ntasks picks
+ * (or once at the end, if loops are fewer) the fairness error is sampled,
+ * as the largest lag (ideal weighted share of the elapsed time minus the
+ * actual service) among all the tasks. The wait ratio is the
+ * longest time a task waited between two runs, over the ideal one for
+ * its weight and slice (1 for a perfectly fair pick).
+ */
+enum {
+	FAIR_KEY,
+	FAIR_WCFS,
+	FAIR_EEVDF,
+	NUM_FAIRS
+};
+
+static char const * const fair_names[NUM_FAIRS] = {
+	"key", "wcfs", "eevdf"
+};
+
+void fair_test(int policy, int ntasks, int loops) {
+	int i, j, id, period, nsamples = 0;
+	unsigned long long ts, te, pcycles = 0, qcycles = 0, wsum = 0;
+	nstime_t now = 0, r, *slice, *service, *lastend;
+	double lag, maxlag, wait, lagsum = 0, lagmax = 0, maxwait = 0;
+	unsigned long *weight;
+	struct cfs_task *ctasks = NULL, *ctsk;
+	struct ev_task *etasks = NULL, *etsk;
+	struct cfs_rq crq;
+	struct ev_rq erq;
+	static nstime_t const slices[] = { 750000, 3000000, 6000000 };
+
+	srand(1);
+	weight = (unsigned long *) malloc(ntasks * sizeof(unsigned long));
+	slice = (nstime_t *) malloc(ntasks * sizeof(nstime_t));
+	service = (nstime_t *) calloc(ntasks, sizeof(nstime_t));
+	lastend = (nstime_t *) calloc(ntasks, sizeof(nstime_t));
+	cfs_rqinit(&crq);
+	ev_rqinit(&erq);
+	if (policy == FAIR_EEVDF)
+		etasks = (struct ev_task *) calloc(ntasks, sizeof(struct ev_task));
+	else
+		ctasks = (struct cfs_task *) calloc(ntasks, sizeof(struct cfs_task));
+	for (i = 0; i < ntasks; i++) {
+		weight[i] = prio_to_weight[rand() % 40];
+		slice[i] = slices[rand() % 3];
+		wsum += weight[i];
+		if (policy == FAIR_EEVDF) {
+			etasks[i].weight = weight[i];
+			etasks[i].vd = calc_delta_fair(slice[i], weight[i]);
+			ev_queue(&etasks[i], &erq);
+		} else
+			cfs_queue(&ctasks[i], &crq, 0);
+	}
+
+	period = ntasks > 64 ? ntasks: 64;
+	if (period > loops)
+		period = loops;
+	for (i = 0; i < loops; i++) {
+		if (policy == FAIR_EEVDF) {
+			rdtscll(ts);
+			etsk = ev_pick(&erq);
+			ev_erase(etsk, &erq);
+			rdtscll(te);
+			pcycles += te - ts;
+			id = (int) (etsk - etasks);
+			r = slice[id];
+			etsk->ve += calc_delta_fair(r, etsk->weight);
+			etsk->vd = etsk->ve + calc_delta_fair(r, etsk->weight);
+			rdtscll(ts);
+			ev_queue(etsk, &erq);
+			rdtscll(te);
+		} else {
+			rdtscll(ts);
+			ctsk = cfs_dequeue(&crq);
+			rdtscll(te);
+			pcycles += te - ts;
+			id = (int) (ctsk - ctasks);
+			r = slice[id];
+			rdtscll(ts);
+			cfs_queue(ctsk, &crq, ctsk->t + (policy == FAIR_KEY ? r:
+							 calc_delta_fair(r, weight[id])));
+			rdtscll(te);
+		}
+		qcycles += te - ts;
+
+		wait = (double) (now - lastend[id]) * weight[id] / ((double) r * wsum);
+		if (wait > maxwait)
+			maxwait = wait;
+		now += r;
+		service[id] += r;
+		lastend[id] = now;
+
+		if ((i + 1) % period == 0) {
+			for (j = 0, maxlag = 0; j < ntasks; j++) {
+				lag = fabs((double) now * weight[j] / wsum - (double) service[j]);
+				if (lag > maxlag)
+					maxlag = lag;
+			}
+			lagsum += maxlag;
+			if (maxlag > lagmax)
+				lagmax = maxlag;
+			nsamples++;
+		}
+	}
+
+	free(etasks);
+	free(ctasks);
+	free(lastend);
+	free(service);
+	free(slice);
+	free(weight);
+
+	fprintf(stdout, "%-5s N = %-9d %8.2lf pick cycles, %8.2lf requeue cycles, "
+		"%10.3lf ms avg lag, %10.3lf ms max lag, %8.2lf wait ratio\n",
+		fair_names[policy], ntasks, (double) pcycles / loops,
+		(double) qcycles / loops, nsamples ? lagsum / nsamples / 1e6: 0.0,
+		lagmax / 1e6, maxwait);
+}
+
+
+
+#define MAX_RINGS	32
+
+/*
+ * Returns non zero if NAME is within the comma separated LIST (a NULL
+ * list selects everything).
+ */
+static int in_list(char const *list, char const *name) {
+	size_t len = strlen(name);
+	char const *p;
+
+	if (list == NULL)
+		return 1;
+	for (p = list; p != NULL; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (!strncmp(p, name, len) && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * Multi-core runqueue simulator. One runqueue per simulated CPU, each
+ * one driven by a thread pinned to a real CPU. Threads pick the earliest
+ * task of their own queue, "run" it and wake it up again, either locally,
+ * on a random CPU, or with a bias toward CPU 0, so that one CPU gets
+ * more than its share. Idle CPUs either sit there (none), pull half of
+ * the imbalance off the busiest CPU (pull, also done periodically), or
+ * steal one task from the tail of a random victim (steal). A task which
+ * runs on a different CPU than last time counts as a migration, and can
+ * be charged a fixed cycles penalty, modeling the cache refill.
+ */
+#define SIM_PULL_MAX	32
+
+enum {
+	WAKE_LOCAL,
+	WAKE_UNIFORM,
+	WAKE_HOT,
+	NUM_WAKES
+};
+
+enum {
+	BAL_NONE,
+	BAL_PULL,
+	BAL_STEAL,
+	NUM_BALS
+};
+
+static char const * const sim_wakes[NUM_WAKES] = {
+	"local", "uniform", "hot"
+};
+
+static char const * const sim_bals[NUM_BALS] = {
+	"none", "pull", "steal"
+};
+
+struct sim;
+
+struct sim_cpu {
+	struct sim *sim;
+	int id;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	void *rq;
+	volatile int nr;
+	nstime_t clk;
+	unsigned int seed, d;
+	unsigned long long ops, idle, enq, migrations, pulled, stolen;
+	unsigned long long bcycles, mcycles;
+} __attribute__((__aligned__(128)));
+
+struct sim {
+	struct pq_ops const *ops;
+	int ncpus, wake, bal, hotpct, interval;
+	unsigned long long migcost;
+	volatile int stop;
+	pthread_barrier_t start;
+	char *tasks;
+	int *lastcpu;
+	nstime_t *deltas;
+	struct sim_cpu *cpus;
+};
+
+
+static inline unsigned int sim_rand(struct sim_cpu *cpu) {
+	/*
+	 * Per CPU xorshift, rand() would serialize the threads on its lock.
+	 */
+	cpu->seed ^= cpu->seed << 13;
+	cpu->seed ^= cpu->seed >> 17;
+	cpu->seed ^= cpu->seed << 5;
+
+	return cpu->seed;
+}
+
+static inline void sim_spin(unsigned long long cycles) {
+	unsigned long long ts, te;
+
+	rdtscll(ts);
+	do {
+		asm volatile ("rep ; nop" : : : "memory");
+		rdtscll(te);
+	} while (te - ts < cycles);
+}
+
+static void sim_lock2(struct sim_cpu *a, struct sim_cpu *b) {
+	if (a < b) {
+		pthread_mutex_lock(&a->lock);
+		pthread_mutex_lock(&b->lock);
+	} else {
+		pthread_mutex_lock(&b->lock);
+		pthread_mutex_lock(&a->lock);
+	}
+}
+
+static void sim_pull(struct sim_cpu *cpu, int idle) {
+	struct sim *sim = cpu->sim;
+	struct pq_ops const *ops = sim->ops;
+	int i, n, nr;
+	struct sim_cpu *busiest = NULL;
+	void *tsk;
+
+	/*
+	 * The busiest CPU scan reads the remote counters without locks, the
+	 * imbalance is checked again once both queues are locked.
+	 */
+	for (i = 0, nr = cpu->nr; i < sim->ncpus; i++)
+		if (sim->cpus[i].nr > nr) {
+			busiest = &sim->cpus[i];
+			nr = busiest->nr;
+		}
+	if (busiest == NULL || (nr - cpu->nr < 2 && !(idle && nr > 0)))
+		return;
+	sim_lock2(cpu, busiest);
+	n = (busiest->nr - cpu->nr) / 2;
+	if (idle && n == 0 && busiest->nr > 0)
+		n = 1;
+	if (n > SIM_PULL_MAX)
+		n = SIM_PULL_MAX;
+	for (; n > 0 && (tsk = ops->dequeue(busiest->rq)) != NULL; n--) {
+		busiest->nr--;
+		ops->queue(cpu->rq, tsk, ops->key(tsk));
+		cpu->nr++;
+		cpu->pulled++;
+	}
+	pthread_mutex_unlock(&busiest->lock);
+	pthread_mutex_unlock(&cpu->lock);
+}
+
+static void sim_steal(struct sim_cpu *cpu) {
+	struct sim *sim = cpu->sim;
+	struct pq_ops const *ops = sim->ops;
+	int i, v;
+	struct sim_cpu *victim;
+	void *tsk = NULL;
+
+	v = sim_rand(cpu) % sim->ncpus;
+	for (i = 0; i < sim->ncpus && tsk == NULL; i++, v = (v + 1) % sim->ncpus) {
+		victim = &sim->cpus[v];
+		if (victim == cpu || victim->nr == 0)
+			continue;
+		pthread_mutex_lock(&victim->lock);
+		tsk = ops->dequeue_last != NULL ? ops->dequeue_last(victim->rq):
+			ops->dequeue(victim->rq);
+		if (tsk != NULL)
+			victim->nr--;
+		pthread_mutex_unlock(&victim->lock);
+	}
+	if (tsk != NULL) {
+		pthread_mutex_lock(&cpu->lock);
+		ops->queue(cpu->rq, tsk, ops->key(tsk));
+		cpu->nr++;
+		pthread_mutex_unlock(&cpu->lock);
+		cpu->stolen++;
+	}
+}
+
+static void sim_balance(struct sim_cpu *cpu, int idle) {
+	unsigned long long ts, te;
+
+	rdtscll(ts);
+	if (cpu->sim->bal == BAL_PULL)
+		sim_pull(cpu, idle);
+	else if (cpu->sim->bal == BAL_STEAL && idle)
+		sim_steal(cpu);
+	rdtscll(te);
+	cpu->bcycles += te - ts;
+}
+
+static struct sim_cpu *sim_wake_target(struct sim_cpu *cpu) {
+	struct sim *sim = cpu->sim;
+
+	switch (sim->wake) {
+	case WAKE_UNIFORM:
+		return &sim->cpus[sim_rand(cpu) % sim->ncpus];
+	case WAKE_HOT:
+		if ((int) (sim_rand(cpu) % 100) < sim->hotpct)
+			return &sim->cpus[0];
+	}
+
+	return cpu;
+}
+
+static void *sim_thread(void *data) {
+	struct sim_cpu *cpu = (struct sim_cpu *) data, *tcpu;
+	struct sim *sim = cpu->sim;
+	struct pq_ops const *ops = sim->ops;
+	int *last;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long long ts, te;
+	cpu_set_t mask;
+	void *tsk;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu->id % (ncpus > 0 ? ncpus: 1), &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
+		perror("sched_setaffinity");
+	pthread_barrier_wait(&sim->start);
+
+	while (!sim->stop) {
+		if (sim->bal == BAL_PULL && cpu->ops % sim->interval == 0)
+			sim_balance(cpu, 0);
+		pthread_mutex_lock(&cpu->lock);
+		if ((tsk = ops->dequeue(cpu->rq)) != NULL) {
+			cpu->nr--;
+			if (ops->key(tsk) > cpu->clk)
+				cpu->clk = ops->key(tsk);
+		}
+		pthread_mutex_unlock(&cpu->lock);
+		if (tsk == NULL) {
+			cpu->idle++;
+			if (sim->bal != BAL_NONE)
+				sim_balance(cpu, 1);
+			continue;
+		}
+		last = &sim->lastcpu[((char *) tsk - sim->tasks) / ops->tsksize];
+		if (*last != cpu->id) {
+			cpu->migrations++;
+			*last = cpu->id;
+			if (sim->migcost) {
+				rdtscll(ts);
+				sim_spin(sim->migcost);
+				rdtscll(te);
+				cpu->mcycles += te - ts;
+			}
+		}
+		tcpu = sim_wake_target(cpu);
+		pthread_mutex_lock(&tcpu->lock);
+		ops->queue(tcpu->rq, tsk, cpu->clk + sim->deltas[cpu->d++ & (NUM_DELTAS - 1)]);
+		tcpu->nr++;
+		pthread_mutex_unlock(&tcpu->lock);
+		cpu->enq++;
+		cpu->ops++;
+	}
+
+	return NULL;
+}
+
+void sim_test(struct pq_ops const *ops, int ncpus, int wake, int bal, int dist,
+	      int ntasks, int times, int msecs, int hotpct, int interval,
+	      unsigned long long migcost) {
+	int i, nsamples;
+	double secs;
+	unsigned long long ops_tot = 0, idle = 0, migr = 0, pulled = 0,
+		stolen = 0, bcycles = 0, mcycles = 0;
+	double imbalance = 0, nmax, nsum;
+	struct timespec ts, te;
+	pthread_mutexattr_t mattr;
+	struct sim sim;
+	struct sim_cpu *cpu;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.ops = ops;
+	sim.ncpus = ncpus;
+	sim.wake = wake;
+	sim.bal = bal;
+	sim.hotpct = hotpct;
+	sim.interval = interval > 0 ? interval: 1;
+	sim.migcost = migcost;
+	srand(1);
+	sim.deltas = (nstime_t *) malloc(NUM_DELTAS * sizeof(nstime_t));
+	pq_deltas(sim.deltas, dist, times);
+	sim.tasks = (char *) calloc(ntasks, ops->tsksize);
+	sim.lastcpu = (int *) malloc(ntasks * sizeof(int));
+	if (posix_memalign((void **) &sim.cpus, 128, ncpus * sizeof(struct sim_cpu)))
+		perror("posix_memalign"), exit(1);
+	memset(sim.cpus, 0, ncpus * sizeof(struct sim_cpu));
+	pthread_barrier_init(&sim.start, NULL, ncpus + 1);
+
+	/*
+	 * Adaptive mutexes spin a bit before sleeping, which keeps things
+	 * sane when there are more simulated CPUs than real ones.
+	 */
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ADAPTIVE_NP);
+	for (i = 0; i < ncpus; i++) {
+		cpu = &sim.cpus[i];
+		cpu->sim = &sim;
+		cpu->id = i;
+		cpu->seed = 2463534242U + i;
+		pthread_mutex_init(&cpu->lock, &mattr);
+		cpu->rq = calloc(1, ops->rqsize);
+		ops->init(cpu->rq, ntasks);
+	}
+	for (i = 0; i < ntasks; i++) {
+		cpu = &sim.cpus[i % ncpus];
+		sim.lastcpu[i] = cpu->id;
+		ops->queue(cpu->rq, sim.tasks + i * ops->tsksize,
+			   (nstime_t) (rand() % times) * NS_SLOT);
+		cpu->nr++;
+	}
+
+	for (i = 0; i < ncpus; i++)
+		if (pthread_create(&sim.cpus[i].tid, NULL, sim_thread, &sim.cpus[i]))
+			perror("pthread_create"), exit(1);
+	pthread_barrier_wait(&sim.start);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/*
+	 * The imbalance is sampled every millisecond, as the ratio between
+	 * the longest queue and the average one.
+	 */
+	for (nsamples = 0; nsamples < msecs; nsamples++) {
+		usleep(1000);
+		for (i = 0, nmax = nsum = 0; i < ncpus; i++) {
+			nsum += sim.cpus[i].nr;
+			if (sim.cpus[i].nr > nmax)
+				nmax = sim.cpus[i].nr;
+		}
+		imbalance += nsum > 0 ? nmax * ncpus / nsum: 1;
+	}
+	sim.stop = 1;
+	clock_gettime(CLOCK_MONOTONIC, &te);
+	secs = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) * 1e-9;
+	for (i = 0; i < ncpus; i++)
+		pthread_join(sim.cpus[i].tid, NULL);
+	for (i = 0; i < ncpus; i++) {
+		cpu = &sim.cpus[i];
+		ops_tot += cpu->ops;
+		idle += cpu->idle;
+		migr += cpu->migrations;
+		pulled += cpu->pulled;
+		stolen += cpu->stolen;
+		bcycles += cpu->bcycles;
+		mcycles += cpu->mcycles;
+		ops->fini(cpu->rq);
+		free(cpu->rq);
+		pthread_mutex_destroy(&cpu->lock);
+	}
+	pthread_mutexattr_destroy(&mattr);
+	pthread_barrier_destroy(&sim.start);
+	free(sim.cpus);
+	free(sim.lastcpu);
+	free(sim.tasks);
+	free(sim.deltas);
+
+	if (ops_tot == 0)
+		ops_tot = 1;
+	fprintf(stdout, "%-4s %-7s %-5s %-8s N = %-9d CPUs = %-3d %8.2lf Mops/s, "
+		"%7.2lf imbalance, %6.2lf%% migrations (%llu pulled, %llu stolen), "
+		"%8.2lf bal cycles/op, %8.2lf mig cycles/op, %6.2lf%% idle\n",
+		ops->name, sim_wakes[wake], sim_bals[bal], pq_dists[dist], ntasks,
+		ncpus, ops_tot / (secs * 1e6),
+		imbalance / (nsamples > 0 ? nsamples: 1), 100.0 * migr / ops_tot,
+		pulled, stolen, (double) bcycles / ops_tot, (double) mcycles / ops_tot,
+		100.0 * idle / (idle + ops_tot));
+}
+
+
+
+/*
+ * Multi-producer contention benchmark. NPROD producer threads queue
+ * tasks, with times ahead of the consumer clock, into either the
+ * lock-free timed ring, or a timed ring behind a mutex. A consumer
+ * thread dequeues them and hands them back to their producers through
+ * per-producer return stacks, which are pushed by the consumer only and
+ * emptied all at once by their owners.
+ */
+enum {
+	MP_MTR,
+	MP_LOCKED,
+	NUM_MPS
+};
+
+static char const * const mp_names[NUM_MPS] = {
+	"mtr", "tr+lock"
+};
+
+struct mp_task {
+	union {
+		struct tr_task tr;
+		struct mtr_task mtr;
+	} q;
+	nstime_t t;
+	int owner;
+	struct mp_task *fnext;
+};
+
+struct ltr_rq {
+	pthread_mutex_t lock;
+	struct tr_rq rq;
+};
+
+struct mp_bench;
+
+struct mp_prod {
+	struct mp_bench *mb;
+	int id;
+	pthread_t tid;
+	struct mp_task *free;
+	unsigned int d;
+	unsigned long long enq, cycles;
+} __attribute__((__aligned__(128)));
+
+struct mp_bench {
+	int kind, nprod;
+	volatile int stop;
+	pthread_barrier_t start;
+	nstime_t clk;
+	void *rq;
+	nstime_t *deltas;
+	struct mp_prod *prods;
+	unsigned long long deq, cycles, idle, ooo;
+};
+
+
+static void mp_setaffinity(int cpu) {
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu % (ncpus > 0 ? ncpus: 1), &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask) == -1)
+		perror("sched_setaffinity");
+}
+
+static inline void mp_queue(struct mp_bench *mb, struct mp_task *tsk, nstime_t t) {
+	struct ltr_rq *lrq;
+
+	tsk->t = t;
+	if (mb->kind == MP_MTR)
+		mtr_queue(&tsk->q.mtr, (struct mtr_rq *) mb->rq, t);
+	else {
+		lrq = (struct ltr_rq *) mb->rq;
+		pthread_mutex_lock(&lrq->lock);
+		tr_queue(&tsk->q.tr, &lrq->rq, t);
+		pthread_mutex_unlock(&lrq->lock);
+	}
+}
+
+static inline struct mp_task *mp_dequeue(struct mp_bench *mb) {
+	struct ltr_rq *lrq;
+	void *tsk;
+
+	if (mb->kind == MP_MTR)
+		tsk = mtr_dequeue((struct mtr_rq *) mb->rq);
+	else {
+		lrq = (struct ltr_rq *) mb->rq;
+		pthread_mutex_lock(&lrq->lock);
+		tsk = tr_dequeue(&lrq->rq);
+		pthread_mutex_unlock(&lrq->lock);
+	}
+
+	return (struct mp_task *) tsk;
+}
+
+static void *mp_producer(void *data) {
+	struct mp_prod *prod = (struct mp_prod *) data;
+	struct mp_bench *mb = prod->mb;
+	unsigned long long ts, te;
+	nstime_t t;
+	struct mp_task *tsk, *local = NULL;
+
+	mp_setaffinity(prod->id + 1);
+	pthread_barrier_wait(&mb->start);
+	while (!mb->stop) {
+		if (local == NULL &&
+		    (local = __atomic_exchange_n(&prod->free, NULL, __ATOMIC_ACQUIRE)) == NULL) {
+			asm volatile ("rep ; nop" : : : "memory");
+			continue;
+		}
+		tsk = local;
+		local = tsk->fnext;
+		t = __atomic_load_n(&mb->clk, __ATOMIC_RELAXED) +
+			mb->deltas[prod->d++ & (NUM_DELTAS - 1)];
+		rdtscll(ts);
+		mp_queue(mb, tsk, t);
+		rdtscll(te);
+		prod->cycles += te - ts;
+		prod->enq++;
+	}
+
+	return NULL;
+}
+
+static void *mp_consumer(void *data) {
+	struct mp_bench *mb = (struct mp_bench *) data;
+	unsigned long long ts, te;
+	struct mp_task *tsk;
+	struct mp_prod *prod;
+
+	mp_setaffinity(0);
+	pthread_barrier_wait(&mb->start);
+	while (!mb->stop) {
+		rdtscll(ts);
+		tsk = mp_dequeue(mb);
+		rdtscll(te);
+		if (tsk == NULL) {
+			mb->idle++;
+			continue;
+		}
+		mb->cycles += te - ts;
+		mb->deq++;
+		if (tsk->t < mb->clk)
+			mb->ooo++;
+		else
+			__atomic_store_n(&mb->clk, tsk->t, __ATOMIC_RELAXED);
+		prod = &mb->prods[tsk->owner];
+		tsk->fnext = __atomic_load_n(&prod->free, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&prod->free, &tsk->fnext, tsk, 1,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	return NULL;
+}
+
+void mp_test(int kind, int nprod, int dist, int ntasks, int times, int msecs) {
+	int i;
+	unsigned long long enq = 0, ecycles = 0;
+	double secs;
+	struct timespec ts, te;
+	pthread_t ctid;
+	struct mp_bench mb;
+	struct mp_task *tasks;
+	struct ltr_rq *lrq = NULL;
+
+	memset(&mb, 0, sizeof(mb));
+	mb.kind = kind;
+	mb.nprod = nprod;
+	srand(1);
+	mb.deltas = (nstime_t *) malloc(NUM_DELTAS * sizeof(nstime_t));
+	pq_deltas(mb.deltas, dist, times);
+	if (kind == MP_MTR) {
+		if (posix_memalign(&mb.rq, 128, sizeof(struct mtr_rq)))
+			perror("posix_memalign"), exit(1);
+		mtr_rqinit((struct mtr_rq *) mb.rq);
+	} else {
+		lrq = (struct ltr_rq *) calloc(1, sizeof(struct ltr_rq));
+		pthread_mutex_init(&lrq->lock, NULL);
+		tr_rqinit(&lrq->rq, MAX_RQ, TR_SCAN_LINEAR);
+		mb.rq = lrq;
+	}
+	if (posix_memalign((void **) &mb.prods, 128, nprod * sizeof(struct mp_prod)))
+		perror("posix_memalign"), exit(1);
+	memset(mb.prods, 0, nprod * sizeof(struct mp_prod));
+	tasks = (struct mp_task *) calloc(ntasks, sizeof(struct mp_task));
+	for (i = 0; i < nprod; i++) {
+		mb.prods[i].mb = &mb;
+		mb.prods[i].id = i;
+	}
+	/*
+	 * Tasks start out in the producers return stacks.
+	 */
+	for (i = 0; i < ntasks; i++) {
+		tasks[i].owner = i % nprod;
+		tasks[i].fnext = mb.prods[i % nprod].free;
+		mb.prods[i % nprod].free = &tasks[i];
+	}
+	pthread_barrier_init(&mb.start, NULL, nprod + 2);
+
+	if (pthread_create(&ctid, NULL, mp_consumer, &mb))
+		perror("pthread_create"), exit(1);
+	for (i = 0; i < nprod; i++)
+		if (pthread_create(&mb.prods[i].tid, NULL, mp_producer, &mb.prods[i]))
+			perror("pthread_create"), exit(1);
+	pthread_barrier_wait(&mb.start);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	usleep(msecs * 1000);
+	mb.stop = 1;
+	clock_gettime(CLOCK_MONOTONIC, &te);
+	secs = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) * 1e-9;
+	pthread_join(ctid, NULL);
+	for (i = 0; i < nprod; i++) {
+		pthread_join(mb.prods[i].tid, NULL);
+		enq += mb.prods[i].enq;
+		ecycles += mb.prods[i].cycles;
+	}
+	if (kind == MP_LOCKED) {
+		pthread_mutex_destroy(&lrq->lock);
+		tr_rqfini(&lrq->rq);
+	}
+	pthread_barrier_destroy(&mb.start);
+	free(mb.rq);
+	free(mb.prods);
+	free(tasks);
+	free(mb.deltas);
+
+	fprintf(stdout, "%-7s %-8s N = %-9d P = %-3d %8.2lf Mops/s enqueue, %8.2lf Mops/s "
+		"dequeue, %8.2lf enq cycles, %8.2lf deq cycles, %llu out of order\n",
+		mp_names[kind], pq_dists[dist], ntasks, nprod, enq / (secs * 1e6),
+		mb.deq / (secs * 1e6), (double) ecycles / (enq ? enq: 1),
+		(double) mb.cycles / (mb.deq ? mb.deq: 1), mb.ooo);
+}
+
+
+
+int main(int ac, char **av) {
+	int i, b, p, d, w, l, f, ntasks = 128, loops = 200000, times = MAX_RQ, sweep = 0;
+	int ncpus = 0, msecs = 1000, hotpct = 50, interval = 64, nprod = 0;
+	int r, nrings = 0;
+	unsigned int rings[MAX_RINGS];
+	char *ptr, *end;
+	char const *tpath = NULL, *fairs = NULL;
+	struct trace trace;
+	unsigned long long migcost = 0;
+	char const *backends = NULL, *patterns = "hold", *dists = "fixed";
+	char const *wakes = "uniform", *bals = "pull";
+
+	for (i = 1; i < ac; i++) {
+		if (!strcmp(av[i], "-n")) {
+			if (++i < ac)
+				ntasks = atoi(av[i]);
+		} else if (!strcmp(av[i], "-l")) {
+			if (++i < ac)
+				loops = atoi(av[i]);
+		} else if (!strcmp(av[i], "-t")) {
+			if (++i < ac)
+				times = atoi(av[i]);
+		} else if (!strcmp(av[i], "-s")) {
+			sweep = 1;
+		} else if (!strcmp(av[i], "-b")) {
+			if (++i < ac)
+				backends = strcmp(av[i], "all") ? av[i]: NULL;
+		} else if (!strcmp(av[i], "-p")) {
+			if (++i < ac)
+				patterns = strcmp(av[i], "all") ? av[i]: NULL;
+		} else if (!strcmp(av[i], "-d")) {
+			if (++i < ac)
+				dists = strcmp(av[i], "all") ? av[i]: NULL;
+		} else if (!strcmp(av[i], "-M")) {
+			if (++i < ac)
+				ncpus = atoi(av[i]);
+		} else if (!strcmp(av[i], "-w")) {
+			if (++i < ac)
+				wakes = strcmp(av[i], "all") ? av[i]: NULL;
+		} else if (!strcmp(av[i], "-B")) {
+			if (++i < ac)
+				bals = strcmp(av[i], "all") ? av[i]: NULL;
+		} else if (!strcmp(av[i], "-H")) {
+			if (++i < ac)
+				hotpct = atoi(av[i]);
+		} else if (!strcmp(av[i], "-D")) {
+			if (++i < ac)
+				msecs = atoi(av[i]);
+		} else if (!strcmp(av[i], "-I")) {
+			if (++i < ac)
+				interval = atoi(av[i]);
+		} else if (!strcmp(av[i], "-m")) {
+			if (++i < ac)
+				migcost = strtoull(av[i], NULL, 0);
+		} else if (!strcmp(av[i], "-C")) {
+			if (++i < ac)
+				nprod = atoi(av[i]);
+		} else if (!strcmp(av[i], "-F")) {
+			if (++i < ac)
+				fairs = av[i];
+		} else if (!strcmp(av[i], "-T")) {
+			if (++i < ac)
+				tpath = av[i];
+		} else if (!strcmp(av[i], "-R")) {
+			if (++i < ac)
+				for (ptr = av[i]; *ptr != '\0' && nrings < MAX_RINGS;
+				     ptr = *end != '\0' ? end + 1: end) {
+					rings[nrings] = (unsigned int) strtoul(ptr, &end, 0);
+					if (end == ptr)
+						break;
+					nrings++;
+				}
+		}
+	}
+	if (times < 1)
+		times = 1;
+
+	/*
+	 * With -s, go from 10^3 to 10^7 queued tasks. Key ranges (-t) past
+	 * MAX_RQ slots show the timed ring clamping far away times. The -b,
+	 * -p and -d options take comma separated lists of backends, patterns
+	 * and distributions ("all" for every one of them).
+	 *
+	 * With -M NCPUS the multi-core simulator runs instead, for -D msecs,
+	 * with the wakeup (-w) and balancing (-B) lists, the hot CPU wakeup
+	 * percentage (-H), the periodic pull interval in ops (-I) and the
+	 * migration cost in cycles (-m).
+	 *
+	 * With -C NPROD the multi-producer contention benchmark runs, from 1
+	 * to NPROD producers (doubling), for -D msecs.
+	 *
+	 * The -R option takes a comma separated list of timed ring slot
+	 * counts (rounded up to powers of two) to sweep, for the tr, trs
+	 * (summary bitmap) and trv (AVX2 scan) backends.
+	 *
+	 * With -T TRACE, the scheduler trace gets replayed on the -b backends.
+	 *
+	 * With -F LIST (key, wcfs, eevdf or all), the weighted fairness test
+	 * runs instead, for -l picks.
+	 */
+	if (tpath != NULL && trace_load(&trace, tpath) < 0)
+		return 1;
+	if (nrings == 0)
+		rings[nrings++] = MAX_RQ;
+	for (r = 0; r < nrings; r++) {
+		tr_slots = rings[r];
+		if (nrings > 1)
+			fprintf(stdout, "R = %u slots\n", tr_slots);
+		if (tpath != NULL) {
+			for (b = 0; b < NUM_BACKENDS; b++)
+				if (in_list(backends, pq_backends[b].name))
+					replay_test(&pq_backends[b], &trace);
+			continue;
+		}
+		for (i = sweep ? 1000: ntasks; i <= (sweep ? 10000000: ntasks); i *= 10) {
+			if (fairs != NULL) {
+				for (f = 0; f < NUM_FAIRS; f++)
+					if (!strcmp(fairs, "all") || in_list(fairs, fair_names[f]))
+						fair_test(f, i, loops);
+				continue;
+			}
+			if (nprod > 0) {
+				for (d = 0; d < NUM_DISTS; d++)
+					for (p = 1; p <= nprod; p = p < nprod && 2 * p > nprod ? nprod: 2 * p)
+						for (b = 0; b < NUM_MPS; b++)
+							if (in_list(dists, pq_dists[d]))
+								mp_test(b, p, d, i, times, msecs);
+				continue;
+			}
+			if (ncpus > 0) {
+				for (w = 0; w < NUM_WAKES; w++)
+					for (l = 0; l < NUM_BALS; l++)
+						for (d = 0; d < NUM_DISTS; d++)
+							for (b = 0; b < NUM_BACKENDS; b++)
+								if (in_list(wakes, sim_wakes[w]) &&
+								    in_list(bals, sim_bals[l]) &&
+								    in_list(dists, pq_dists[d]) &&
+								    in_list(backends, pq_backends[b].name))
+									sim_test(&pq_backends[b], ncpus, w, l, d, i,
+										 times, msecs, hotpct, interval,
+										 migcost);
+				continue;
+			}
+			for (p = 0; p < NUM_PATTERNS; p++)
+				for (d = 0; d < NUM_DISTS; d++)
+					for (b = 0; b < NUM_BACKENDS; b++)
+						if (in_list(patterns, pq_patterns[p]) &&
+						    in_list(dists, pq_dists[d]) &&
+						    in_list(backends, pq_backends[b].name))
+							pq_test(&pq_backends[b], p, d, i, times, loops);
+		}
+	}
+	if (tpath != NULL)
+		trace_free(&trace);
+
+	return 0;
+}
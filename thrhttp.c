@@ -23,12 +23,15 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <signal.h>
 #include <netdb.h>
 #include <resolv.h>
@@ -41,16 +44,50 @@
 #include <pthread.h>
 
 #define BSTREAM_BUFSIZE (1024 * 4)
+#define BSTREAM_HDRSIZE 256
+#define BSTREAM_BLKSIZE (BSTREAM_BUFSIZE + BSTREAM_HDRSIZE)
+#define BUF_POOL_MAX 256
+#define MAX_EPOLL_EVENTS 64
+#define STK_POOL_MAX 64
 
 enum tx_modes {
 	TX_SENDFILE,
 	TX_MMAP
 };
 
+/*
+ * The input and header buffers live in a single BSTREAM_BLKSIZE block,
+ * which is taken from the pool only while the session is active. A parked
+ * (idle keep-alive) session holds neither a buffer nor a thread, and sits
+ * on the parked list through @pnext and @pprev.
+ */
 struct bstream {
-	int fd;
+	int fd, parked;
+	struct bstream *pnext, *pprev;
 	size_t ridx, bcnt;
-	char buf[BSTREAM_BUFSIZE];
+	size_t hlen;
+	unsigned long ncalls;
+	unsigned long long tsched;
+	char *hdr;
+	char *buf;
+};
+
+/*
+ * A cached session thread. Once done with a session, it parks on its own
+ * condition variable waiting for the main loop to hand it a new one, and
+ * exits after sitting idle for too long. Stacks of exited threads are
+ * recycled through a pool, as in pth-stk-test.c.
+ */
+struct worker {
+	struct worker *next;
+	pthread_t thid;
+	pthread_cond_t cnd;
+	struct bstream *bstr;
+	char *stk;
+};
+
+struct stack_blk {
+	struct stack_blk *next;
 };
 
 static int stopsvr;
@@ -58,7 +95,18 @@ static char const *rootfs = ".";
 static int oflags;
 static int txmode = TX_MMAP;
 static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-static unsigned long long conns, reqs, tbytes;
+static pthread_cond_t wcnd = PTHREAD_COND_INITIALIZER;
+static unsigned long long conns, reqs, tbytes, txcalls, parks;
+static int parkidle, epfd = -1;
+static void *bfree;
+static int nbfree, nbufs, nbused, maxbused;
+static int thcache, thidle = 5000, nwfree, nstkfree;
+static size_t stksize, pgsize;
+static struct worker *wfree, *wdead;
+static struct bstream *parked;
+static struct stack_blk *stkfree;
+static unsigned long long thcreates, threuses, setup_ns, setup_maxns;
+static char mem_buf[1024 * 8];
 
 static struct bstream *bstream_open(int fd)
 {
@@ -69,13 +117,82 @@ static struct bstream *bstream_open(int fd)
 		return NULL;
 	}
 	bstr->fd = fd;
+	bstr->parked = 0;
+	bstr->buf = bstr->hdr = NULL;
 	bstr->ridx = bstr->bcnt = 0;
+	bstr->hlen = 0;
+	bstr->ncalls = 0;
 
 	return bstr;
 }
 
+static unsigned long long get_nstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bstream_getbuf(struct bstream *bstr)
+{
+	void **blk;
+
+	if (bstr->buf != NULL)
+		return 0;
+
+	pthread_mutex_lock(&mtx);
+	if ((blk = (void **) bfree) != NULL) {
+		bfree = *blk;
+		nbfree--;
+	} else
+		nbufs++;
+	if (++nbused > maxbused)
+		maxbused = nbused;
+	pthread_mutex_unlock(&mtx);
+	if (blk == NULL && (blk = (void **) malloc(BSTREAM_BLKSIZE)) == NULL) {
+		perror("malloc");
+		pthread_mutex_lock(&mtx);
+		nbufs--;
+		nbused--;
+		pthread_mutex_unlock(&mtx);
+		return -1;
+	}
+
+	bstr->buf = (char *) blk;
+	bstr->hdr = bstr->buf + BSTREAM_BUFSIZE;
+
+	return 0;
+}
+
+static void bstream_putbuf(struct bstream *bstr)
+{
+	void **blk;
+
+	if ((blk = (void **) bstr->buf) == NULL)
+		return;
+	bstr->buf = bstr->hdr = NULL;
+
+	pthread_mutex_lock(&mtx);
+	nbused--;
+	if (nbfree < BUF_POOL_MAX) {
+		*blk = bfree;
+		bfree = blk;
+		nbfree++;
+		blk = NULL;
+	} else
+		nbufs--;
+	pthread_mutex_unlock(&mtx);
+	free(blk);
+}
+
 static void bstream_close(struct bstream *bstr)
 {
+	pthread_mutex_lock(&mtx);
+	txcalls += bstr->ncalls;
+	pthread_mutex_unlock(&mtx);
+	bstream_putbuf(bstr);
 	close(bstr->fd);
 	free(bstr);
 }
@@ -88,6 +205,17 @@ static size_t bstream_refil(struct bstream *bstr)
 	return bstr->bcnt;
 }
 
+static ssize_t bstream_refil_nowait(struct bstream *bstr)
+{
+	ssize_t n;
+
+	bstr->ridx = bstr->bcnt = 0;
+	if ((n = recv(bstr->fd, bstr->buf, BSTREAM_BUFSIZE, MSG_DONTWAIT)) > 0)
+		bstr->bcnt = n;
+
+	return n;
+}
+
 static size_t bstream_readsome(struct bstream *bstr, void *buf, size_t n)
 {
 	size_t cnt;
@@ -150,12 +278,15 @@ static char *bstream_readln(struct bstream *bstr, size_t *lnsize)
 	return ln;
 }
 
-static size_t bstream_write(struct bstream *bstr, void const *buf, size_t n)
+static size_t bstream_send(struct bstream *bstr, void const *buf, size_t n,
+			   int flags)
 {
-	size_t cnt, acnt;
+	size_t cnt;
+	ssize_t acnt;
 
 	for (cnt = 0; cnt < n;) {
-		if ((acnt = send(bstr->fd, buf, n - cnt, 0)) < 0) {
+		bstr->ncalls++;
+		if ((acnt = send(bstr->fd, buf, n - cnt, flags)) < 0) {
 			perror("send");
 			return -1;
 		}
@@ -166,6 +297,59 @@ static size_t bstream_write(struct bstream *bstr, void const *buf, size_t n)
 	return cnt;
 }
 
+static size_t bstream_write(struct bstream *bstr, void const *buf, size_t n)
+{
+	return bstream_send(bstr, buf, n, 0);
+}
+
+static size_t bstream_writev(struct bstream *bstr, struct iovec *iov,
+			     int iovcnt)
+{
+	size_t cnt = 0;
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		bstr->ncalls++;
+		if ((n = writev(bstr->fd, iov, iovcnt)) < 0) {
+			perror("writev");
+			return -1;
+		}
+		cnt += n;
+		for (; iovcnt > 0 && (size_t) n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return cnt;
+}
+
+/*
+ * Formats the response header into the per-connection header buffer. It
+ * is then emitted together with the body, either within the same writev(2)
+ * or with MSG_MORE ahead of it, so that no TCP_CORK toggling is needed.
+ */
+static void bstream_header(struct bstream *bstr, char const *ver,
+			   char const *cclose, long size)
+{
+	int n;
+
+	n = snprintf(bstr->hdr, BSTREAM_HDRSIZE,
+		     "%s 200 OK\r\n"
+		     "Connection: %s\r\n"
+		     "Content-Length: %ld\r\n"
+		     "\r\n", ver, cclose, size);
+	bstr->hlen = n < BSTREAM_HDRSIZE ? (size_t) n: BSTREAM_HDRSIZE - 1;
+}
+
+static int bstream_flush_header(struct bstream *bstr, int more)
+{
+	return bstream_send(bstr, bstr->hdr, bstr->hlen,
+			    more ? MSG_MORE: 0) == bstr->hlen ? 0: -1;
+}
+
 static size_t bstream_printf(struct bstream *bstr, char const *fmt, ...)
 {
 	size_t cnt;
@@ -183,10 +367,18 @@ static size_t bstream_printf(struct bstream *bstr, char const *fmt, ...)
 	return cnt;
 }
 
+/*
+ * The *_tx functions emit the pending header together with the body.
+ */
 static int sendfile_tx(int fd, struct bstream *bstr, struct stat const *stb)
 {
 	off_t off = 0;
 
+	if (bstream_flush_header(bstr, stb->st_size > 0) < 0)
+		return -1;
+	if (stb->st_size == 0)
+		return 0;
+	bstr->ncalls++;
 	if (sendfile(bstr->fd, fd, &off, stb->st_size) != stb->st_size) {
 		perror("sendfile");
 		return -1;
@@ -199,23 +391,25 @@ static int mmap_tx(int fd, struct bstream *bstr, struct stat const *stb)
 {
 	void *addr;
 	size_t txcnt;
+	struct iovec iov[2];
 
+	if (stb->st_size == 0)
+		return bstream_flush_header(bstr, 0);
 	if ((addr = mmap(NULL, stb->st_size, PROT_READ, MAP_PRIVATE,
 			 fd, 0)) == (void *) -1) {
 		perror("mmap");
 		return -1;
 	}
-	txcnt = bstream_write(bstr, addr, stb->st_size);
+	iov[0].iov_base = bstr->hdr;
+	iov[0].iov_len = bstr->hlen;
+	iov[1].iov_base = addr;
+	iov[1].iov_len = stb->st_size;
+	txcnt = bstream_writev(bstr, iov, 2) - bstr->hlen;
 	munmap(addr, stb->st_size);
 
 	return txcnt == stb->st_size ? 0: -1;
 }
 
-static int set_cork(int fd, int v)
-{
-	return setsockopt(fd, SOL_TCP, TCP_CORK, &v, sizeof(v));
-}
-
 static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
 		    char const *cclose)
 {
@@ -250,18 +444,12 @@ static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
 		return -1;
 	}
 	free(path);
-	set_cork(bstr->fd, 1);
-	bstream_printf(bstr,
-		       "%s 200 OK\r\n"
-		       "Connection: %s\r\n"
-		       "Content-Length: %ld\r\n"
-		       "\r\n", ver, cclose, (long) stbuf.st_size);
+	bstream_header(bstr, ver, cclose, (long) stbuf.st_size);
 	if (txmode == TX_SENDFILE)
 		error = sendfile_tx(fd, bstr, &stbuf);
 	else if (txmode == TX_MMAP)
 		error = mmap_tx(fd, bstr, &stbuf);
 	close(fd);
-	set_cork(bstr->fd, 0);
 	if (error < 0)
 		return error;
 
@@ -275,25 +463,27 @@ static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
 static int send_mem(struct bstream *bstr, long size, char const *ver,
 		    char const *cclose)
 {
-	size_t csize, n;
+	size_t csize;
 	long msent;
-	static char mbuf[1024 * 8];
-
-	set_cork(bstr->fd, 1);
-	bstream_printf(bstr,
-		       "%s 200 OK\r\n"
-		       "Connection: %s\r\n"
-		       "Content-Length: %ld\r\n"
-		       "\r\n", ver, cclose, size);
-	for (msent = 0; msent < size;) {
-		csize = (size - msent) > sizeof(mbuf) ?
-			sizeof(mbuf): (size_t) (size - msent);
-		if ((n = bstream_write(bstr, mbuf, csize)) > 0)
-			msent += n;
-		if (n != csize)
-			break;
+	struct iovec iov[2];
+
+	bstream_header(bstr, ver, cclose, size);
+	if (size <= (long) sizeof(mem_buf)) {
+		iov[0].iov_base = bstr->hdr;
+		iov[0].iov_len = bstr->hlen;
+		iov[1].iov_base = mem_buf;
+		iov[1].iov_len = size;
+		msent = (long) (bstream_writev(bstr, iov, 2) - bstr->hlen);
+	} else if (bstream_flush_header(bstr, 1) < 0) {
+		return -1;
+	} else {
+		for (msent = 0; msent < size; msent += csize) {
+			csize = (size - msent) > sizeof(mem_buf) ?
+				sizeof(mem_buf): (size_t) (size - msent);
+			if (bstream_write(bstr, mem_buf, csize) != csize)
+				break;
+		}
 	}
-	set_cork(bstr->fd, 0);
 
 	pthread_mutex_lock(&mtx);
 	tbytes += msent;
@@ -315,18 +505,94 @@ static int send_url(struct bstream *bstr, char const *doc, char const *ver,
 	return error;
 }
 
-static void *thproc(void *data)
+static void park_link(struct bstream *bstr)
 {
-	int cfd = (int) (long) data, cclose, chunked;
+	bstr->pprev = NULL;
+	if ((bstr->pnext = parked) != NULL)
+		parked->pprev = bstr;
+	parked = bstr;
+}
+
+static void park_unlink(struct bstream *bstr)
+{
+	if (bstr->pprev != NULL)
+		bstr->pprev->pnext = bstr->pnext;
+	else
+		parked = bstr->pnext;
+	if (bstr->pnext != NULL)
+		bstr->pnext->pprev = bstr->pprev;
+}
+
+/*
+ * Gives the session buffer back to the pool, and hands the connection to
+ * the epoll set watched by the main loop, which spawns a new session thread
+ * once the next request shows up. The current thread then exits. Sessions
+ * are not parked anymore once stopping, and the caller gets the buffer back
+ * with bstream_getbuf() when parking fails.
+ */
+static int park_session(struct bstream *bstr)
+{
+	int op = bstr->parked ? EPOLL_CTL_MOD: EPOLL_CTL_ADD;
+	struct epoll_event ev;
+
+	bstream_putbuf(bstr);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = bstr;
+	/*
+	 * Once armed, the session can be resumed (and closed) by the main
+	 * loop, so @bstr is not touched after that, and it is linked under
+	 * the lock the resume and the exit sweep take.
+	 */
+	pthread_mutex_lock(&mtx);
+	if (stopsvr) {
+		pthread_mutex_unlock(&mtx);
+		return -1;
+	}
+	park_link(bstr);
+	bstr->parked = 1;
+	if (epoll_ctl(epfd, op, bstr->fd, &ev) != 0) {
+		perror("epoll_ctl");
+		park_unlink(bstr);
+		bstr->parked = op == EPOLL_CTL_MOD;
+		pthread_mutex_unlock(&mtx);
+		return -1;
+	}
+	parks++;
+	pthread_mutex_unlock(&mtx);
+
+	return 0;
+}
+
+static void process_session(struct bstream *bstr)
+{
+	int cclose, chunked;
+	ssize_t n;
 	size_t lsize, clen;
-	struct bstream *bstr;
+	unsigned long long delay;
 	char *req, *meth, *doc, *ver, *ln, *auxptr;
 
-	if ((bstr = bstream_open(cfd)) == NULL) {
-		close(cfd);
-		return NULL;
+	delay = get_nstime() - bstr->tsched;
+	pthread_mutex_lock(&mtx);
+	setup_ns += delay;
+	if (delay > setup_maxns)
+		setup_maxns = delay;
+	pthread_mutex_unlock(&mtx);
+
+	if (bstream_getbuf(bstr) < 0) {
+		bstream_close(bstr);
+		return;
 	}
 	do {
+		if (parkidle && bstr->ridx == bstr->bcnt) {
+			if ((n = bstream_refil_nowait(bstr)) == 0)
+				break;
+			if (n < 0 && errno == EAGAIN) {
+				if (park_session(bstr) == 0)
+					return;
+				if (stopsvr || bstream_getbuf(bstr) < 0)
+					break;
+			}
+		}
 		if ((req = bstream_readln(bstr, &lsize)) == NULL)
 			break;
 		if ((meth = strtok_r(req, " ", &auxptr)) == NULL ||
@@ -375,15 +641,256 @@ static void *thproc(void *data)
 		free(req);
 	} while (!stopsvr && !cclose);
 	bstream_close(bstr);
+}
+
+static void *thproc(void *data)
+{
+	process_session((struct bstream *) data);
 
 	return NULL;
 }
 
+static void *worker_thproc(void *data)
+{
+	int error;
+	struct worker *w = (struct worker *) data;
+	struct worker **pw;
+	struct timespec ts;
+
+	for (;;) {
+		process_session(w->bstr);
+
+		pthread_mutex_lock(&mtx);
+		w->bstr = NULL;
+		if (stopsvr || nwfree >= thcache)
+			break;
+		w->next = wfree;
+		wfree = w;
+		nwfree++;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += thidle / 1000;
+		if ((ts.tv_nsec += (thidle % 1000) * 1000000L) >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		for (error = 0; w->bstr == NULL && !stopsvr && error != ETIMEDOUT;)
+			error = pthread_cond_timedwait(&w->cnd, &mtx, &ts);
+		if (w->bstr == NULL) {
+			for (pw = &wfree; *pw != w; pw = &(*pw)->next);
+			*pw = w->next;
+			nwfree--;
+			break;
+		}
+		pthread_mutex_unlock(&mtx);
+	}
+	/*
+	 * We cannot release our own stack, so let the main loop join us and
+	 * recycle it.
+	 */
+	w->next = wdead;
+	wdead = w;
+	if (stopsvr)
+		pthread_cond_signal(&wcnd);
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+static char *get_stack(void)
+{
+	char *stk;
+	struct stack_blk *sb;
+
+	pthread_mutex_lock(&mtx);
+	if ((sb = stkfree) != NULL) {
+		stkfree = sb->next;
+		nstkfree--;
+	}
+	pthread_mutex_unlock(&mtx);
+	if (sb != NULL)
+		return (char *) sb;
+
+	if ((stk = (char *) mmap(NULL, stksize + pgsize, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+				 -1, 0)) == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	mprotect(stk, pgsize, PROT_NONE);
+
+	return stk + pgsize;
+}
+
+static void put_stack(char *stk)
+{
+	struct stack_blk *sb;
+
+	pthread_mutex_lock(&mtx);
+	if (nstkfree < STK_POOL_MAX) {
+		sb = (struct stack_blk *) stk;
+		sb->next = stkfree;
+		stkfree = sb;
+		nstkfree++;
+		stk = NULL;
+	}
+	pthread_mutex_unlock(&mtx);
+	if (stk != NULL)
+		munmap(stk - pgsize, stksize + pgsize);
+}
+
+static void reap_workers(void)
+{
+	struct worker *w, *dead;
+
+	pthread_mutex_lock(&mtx);
+	dead = wdead;
+	wdead = NULL;
+	pthread_mutex_unlock(&mtx);
+
+	while ((w = dead) != NULL) {
+		dead = w->next;
+		pthread_join(w->thid, NULL);
+		put_stack(w->stk);
+		pthread_cond_destroy(&w->cnd);
+		free(w);
+	}
+}
+
+/*
+ * Wakes up the workers idling in the cache, which exit since the server
+ * is stopping, and joins them together with the ones which already did.
+ * Workers still busy with a session are left alone. The stack pool is
+ * released as well.
+ */
+static void stop_workers(void)
+{
+	struct worker *w;
+	struct stack_blk *sb;
+
+	pthread_mutex_lock(&mtx);
+	for (w = wfree; w != NULL; w = w->next)
+		pthread_cond_signal(&w->cnd);
+	while (wfree != NULL)
+		pthread_cond_wait(&wcnd, &mtx);
+	pthread_mutex_unlock(&mtx);
+
+	reap_workers();
+
+	while ((sb = stkfree) != NULL) {
+		stkfree = sb->next;
+		munmap((char *) sb - pgsize, stksize + pgsize);
+	}
+	nstkfree = 0;
+}
+
+static int cached_session(struct bstream *bstr)
+{
+	int error;
+	struct worker *w;
+	pthread_attr_t attr;
+
+	pthread_mutex_lock(&mtx);
+	if ((w = wfree) != NULL) {
+		wfree = w->next;
+		nwfree--;
+		w->bstr = bstr;
+		threuses++;
+		pthread_cond_signal(&w->cnd);
+	}
+	pthread_mutex_unlock(&mtx);
+	if (w != NULL)
+		return 0;
+
+	reap_workers();
+	if ((w = (struct worker *) malloc(sizeof(struct worker))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((w->stk = get_stack()) == NULL) {
+		free(w);
+		return -1;
+	}
+	pthread_cond_init(&w->cnd, NULL);
+	w->bstr = bstr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, w->stk, stksize);
+	error = pthread_create(&w->thid, &attr, worker_thproc, w);
+	pthread_attr_destroy(&attr);
+	if (error != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(error));
+		put_stack(w->stk);
+		pthread_cond_destroy(&w->cnd);
+		free(w);
+		return -1;
+	}
+
+	pthread_mutex_lock(&mtx);
+	thcreates++;
+	pthread_mutex_unlock(&mtx);
+
+	return 0;
+}
+
+static void spawn_session(pthread_attr_t const *thattr, struct bstream *bstr)
+{
+	pthread_t thid;
+
+	bstr->tsched = get_nstime();
+	if (thcache > 0) {
+		if (cached_session(bstr) < 0)
+			bstream_close(bstr);
+		return;
+	}
+	if (pthread_create(&thid, thattr, thproc, bstr) != 0) {
+		perror("pthread_create");
+		bstream_close(bstr);
+		return;
+	}
+	pthread_mutex_lock(&mtx);
+	thcreates++;
+	pthread_mutex_unlock(&mtx);
+}
+
+static void resume_parked(pthread_attr_t const *thattr)
+{
+	int i, n;
+	struct epoll_event evs[MAX_EPOLL_EVENTS];
+
+	n = epoll_wait(epfd, evs, MAX_EPOLL_EVENTS, 0);
+	pthread_mutex_lock(&mtx);
+	for (i = 0; i < n; i++)
+		park_unlink((struct bstream *) evs[i].data.ptr);
+	pthread_mutex_unlock(&mtx);
+	for (i = 0; i < n; i++)
+		spawn_session(thattr, (struct bstream *) evs[i].data.ptr);
+}
+
+/*
+ * Closes the sessions still parked at exit, which only the main loop
+ * could have resumed.
+ */
+static void close_parked(void)
+{
+	struct bstream *bstr, *next;
+
+	pthread_mutex_lock(&mtx);
+	bstr = parked;
+	parked = NULL;
+	pthread_mutex_unlock(&mtx);
+	for (; bstr != NULL; bstr = next) {
+		next = bstr->pnext;
+		bstream_close(bstr);
+	}
+}
+
 static void usage(char const *prg)
 {
 	fprintf(stderr,
 		"Use: %s [-h,--help] [-p,--port PORTNO] [-L,--listen LISBKLOG]\n"
-		"\t[-r,--root ROOTFS] [-S,--sendfile] [-k,--stksize SIZE]\n", prg);
+		"\t[-r,--root ROOTFS] [-S,--sendfile] [-k,--stksize SIZE]\n"
+		"\t[-K,--park-idle] [-C,--thread-cache NUM] [-E,--thread-idle MSEC]\n",
+		prg);
 }
 
 static void sig_int(int sig)
@@ -393,9 +900,9 @@ static void sig_int(int sig)
 
 int main(int ac, char **av)
 {
-	int i, error, sfd, cfd, port = 80, lbklog = 1024, one = 1, stksize = 0;
+	int i, error, sfd, cfd, port = 80, lbklog = 1024, one = 1;
 	socklen_t alen;
-	pthread_t thid;
+	struct bstream *bstr;
 	struct sockaddr_in saddr, caddr;
 	pthread_attr_t thattr;
 	struct linger ling = { 0, 0 };
@@ -419,10 +926,21 @@ int main(int ac, char **av)
 		} else if (strcmp(av[i], "-S") == 0 ||
 			   strcmp(av[i], "--sendfile") == 0) {
 			txmode = TX_SENDFILE;
+		} else if (strcmp(av[i], "--thread-cache") == 0 ||
+			   strcmp(av[i], "-C") == 0) {
+			if (++i < ac)
+				thcache = atoi(av[i]);
+		} else if (strcmp(av[i], "--thread-idle") == 0 ||
+			   strcmp(av[i], "-E") == 0) {
+			if (++i < ac)
+				thidle = atoi(av[i]);
+		} else if (strcmp(av[i], "-K") == 0 ||
+			   strcmp(av[i], "--park-idle") == 0) {
+			parkidle = 1;
 		} else if (strcmp(av[i], "--stksize") == 0 ||
 			   strcmp(av[i], "-k") == 0) {
 			if (++i < ac)
-				stksize = atoi(av[i]);
+				stksize = atol(av[i]);
 		} else if (strcmp(av[i], "--help") == 0||
 			   strcmp(av[i], "-h") == 0) {
 			usage(av[0]);
@@ -439,6 +957,9 @@ int main(int ac, char **av)
 		fprintf(stderr, "Failed to set stack size: %s\n", strerror(error));
 		return 2;
 	}
+	pthread_attr_getstacksize(&thattr, &stksize);
+	pgsize = sysconf(_SC_PAGESIZE);
+	stksize = (stksize + pgsize - 1) & ~(pgsize - 1);
 
 	if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("socket");
@@ -457,7 +978,29 @@ int main(int ac, char **av)
 	}
 	listen(sfd, lbklog);
 
+	if (parkidle && (epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		close(sfd);
+		return 5;
+	}
+
 	while (!stopsvr) {
+		if (parkidle) {
+			struct pollfd pfds[2];
+
+			pfds[0].fd = sfd;
+			pfds[0].events = POLLIN;
+			pfds[0].revents = 0;
+			pfds[1].fd = epfd;
+			pfds[1].events = POLLIN;
+			pfds[1].revents = 0;
+			if (poll(pfds, 2, -1) <= 0)
+				continue;
+			if (pfds[1].revents & POLLIN)
+				resume_parked(&thattr);
+			if ((pfds[0].revents & POLLIN) == 0)
+				continue;
+		}
 		alen = sizeof(caddr);
 		if ((cfd = accept(sfd, (struct sockaddr *) &caddr, &alen)) == -1) {
 			perror("accept");
@@ -467,19 +1010,40 @@ int main(int ac, char **av)
 		pthread_mutex_lock(&mtx);
 		conns++;
 		pthread_mutex_unlock(&mtx);
-		if (pthread_create(&thid, &thattr, thproc,
-				   (void *) (long) cfd) != 0) {
-			perror("pthread_create");
+		if ((bstr = bstream_open(cfd)) == NULL) {
 			close(cfd);
 			continue;
 		}
+		spawn_session(&thattr, bstr);
 	}
 	close(sfd);
+	if (parkidle)
+		close_parked();
+	if (thcache > 0)
+		stop_workers();
 
 	fprintf(stdout,
 		"Connections .....: %llu\n"
 		"Requests ........: %llu\n"
-		"Total Bytes .....: %llu\n", conns, reqs, tbytes);
+		"Total Bytes .....: %llu\n"
+		"TX Syscalls/Req .: %.2lf\n", conns, reqs, tbytes,
+		reqs ? (double) txcalls / reqs: 0.0);
+	fprintf(stdout,
+		"Conn Footprint ..: %zu bytes idle, %zu bytes + stack active\n"
+		"Buffer Pool .....: %d buffers, %d peak in use\n",
+		sizeof(struct bstream), sizeof(struct bstream) + BSTREAM_BLKSIZE,
+		nbufs, maxbused);
+	if (parkidle)
+		fprintf(stdout,
+			"Parked Sessions .: %llu\n", parks);
+	fprintf(stdout,
+		"Thread Creates ..: %llu\n"
+		"Thread Reuses ...: %llu\n"
+		"Setup Latency ...: avg %.2lf us, max %.2lf us\n",
+		thcreates, threuses,
+		thcreates + threuses ?
+		(double) setup_ns / (thcreates + threuses) / 1e3: 0.0,
+		(double) setup_maxns / 1e3);
 
 	return 0;
 }
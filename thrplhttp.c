@@ -24,6 +24,10 @@
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -42,35 +46,271 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <linux/errqueue.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
 
 #define BSTREAM_BUFSIZE (1024 * 4)
+#define BSTREAM_HDRSIZE 256
+#define BSTREAM_BLKSIZE (BSTREAM_BUFSIZE + BSTREAM_HDRSIZE)
+#define MAX_EPOLL_EVENTS 64
+#define COLD_PROBE_SIZE (1024 * 1024)
+#define CORO_POOL_MAX 256
+#define MAX_HANDOFF_FDS 253
+#define HOT_DOCS 64
+#define HOT_PATHSIZE 128
+#define SPIN_MIN_NS 1000
+#define ZC_LINGER_NS 1000000000ULL
+
+#define H2_FRAME_HDRSIZE 9
+#define H2_DEF_FRAMESIZE 16384
+#define H2_DEF_WINDOW 65535
+#define H2_MAX_STREAMS 128
+#define H2_MAX_HBLOCK (64 * 1024)
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+#define HPACK_NSTATIC 61
+#define HPACK_STRMAX 4096
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+#define H2F_END_STREAM 0x01
+#define H2F_ACK 0x01
+#define H2F_END_HEADERS 0x04
+#define H2F_PADDED 0x08
+#define H2F_PRIORITY 0x20
+
+#define H2S_MAX_CONCURRENT_STREAMS 0x3
+#define H2S_INITIAL_WINDOW_SIZE 0x4
+#define H2S_MAX_FRAME_SIZE 0x5
+
+#define H2E_NO_ERROR 0x0
+#define H2E_PROTOCOL_ERROR 0x1
+#define H2E_FLOW_CONTROL_ERROR 0x3
+#define H2E_FRAME_SIZE_ERROR 0x6
+#define H2E_REFUSED_STREAM 0x7
+#define H2E_COMPRESSION_ERROR 0x9
+#define H2E_ENHANCE_YOUR_CALM 0xb
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
 
 #define GET_CPUCTX() (thcpu_ctx + xget_thread_ctx()->cpu)
 
 enum tx_modes {
 	TX_SENDFILE,
-	TX_MMAP
+	TX_MMAP,
+	TX_ZEROCOPY
 };
 
+/*
+ * A file mapping sent with MSG_ZEROCOPY, which cannot be released until
+ * the kernel reports completion of the send with sequence number @seq.
+ */
+struct zc_map {
+	struct zc_map *next;
+	void *addr;
+	size_t size;
+	unsigned int seq;
+};
+
+/*
+ * The input and header buffers live in a single BSTREAM_BLKSIZE block,
+ * which is taken from the per-CPU pool only while the session is active.
+ * A parked (idle keep-alive) session holds just the struct bstream, linked
+ * on the CPU parked list through @pnext and @pprev.
+ */
 struct bstream {
-	int fd;
+	int fd, parked;
+	struct bstream *pnext, *pprev;
 	size_t ridx, bcnt;
-	char buf[BSTREAM_BUFSIZE];
+	size_t hlen;
+	unsigned long ncalls;
+	int zc;
+	unsigned int zcseq, zcdone;
+	struct zc_map *zcmaps;
+	unsigned long long zcexpire;
+	struct h2_conn *h2;
+	char *hdr;
+	char *buf;
+};
+
+struct hpack_hdr {
+	char const *name, *value;
+};
+
+/*
+ * An HTTP/2 response being sent. @fd is -1 for /mem-N bodies. The flow
+ * control window can go negative, when the peer shrinks its initial
+ * window size.
+ */
+struct h2_stream {
+	struct h2_stream *next;
+	unsigned int id;
+	int fd;
+	off_t off, size;
+	long window;
+};
+
+/*
+ * HTTP/2 connection state, hung off the bstream. The HPACK dynamic table
+ * is a ring of HPACK_MAX_ENTRIES (the most a 4KB table can hold), @dhead
+ * being the newest entry, with name and value in a single allocation. The
+ * frame buffer is dropped while the session is parked.
+ */
+struct h2_conn {
+	int goaway;
+	unsigned int last_sid;
+	long window, init_window;
+	size_t max_frame;
+	struct h2_stream *streams;
+	int nstreams;
+	struct hpack_hdr *dtab;
+	int dhead, dcount;
+	size_t dsize, dmaxsize;
+	unsigned char *hblock;
+	size_t hblen, hbsize;
+	unsigned int hbsid;
+	unsigned char *fbuf;
+};
+
+/*
+ * Saved execution context of a coroutine (or of the scheduler which runs
+ * them). On x86-64 this is just the stack pointer, with the callee saved
+ * registers pushed on the stack by coro_switch().
+ */
+struct coro_ctx {
+#if defined(__x86_64__)
+	void *sp;
+#else
+	ucontext_t uc;
+#endif
+};
+
+/*
+ * A session running as a user-space coroutine on the CPU scheduler thread
+ * (--coro mode). Socket I/O which would block switches back to the
+ * scheduler, which resumes the coroutine once epoll reports the socket
+ * ready. The stack has a PROT_NONE guard page at its low end.
+ */
+struct coro {
+	struct coro *next;
+	struct bstream *bstr;
+	int dead, polled;
+	void *stk;
+	struct coro_ctx ctx;
+};
+
+/*
+ * Slot of the per-CPU hot document table, which is direct mapped on the
+ * path hash. A colliding document decays the hit count of the resident
+ * one, and replaces it once that drops to zero.
+ */
+struct hot_doc {
+	unsigned long hits;
+	char path[HOT_PATHSIZE];
 };
 
 struct per_cpu_ctx {
 	pthread_mutex_t mtx;
 	pthread_cond_t cnd;
 	pthread_cond_t dqcnd;
-	unsigned long long tbytes, reqs, conns;
+	unsigned long long tbytes, reqs, conns, closes;
+	unsigned long long cold_reqs, cold_ns, cold_maxns;
+	int node;
 	int nthreads;
 	pthread_t *threads;
 	int qsize, rqpos, wqpos, qcount, qwait;
-	int *squeue;
+	struct bstream **squeue;
+	unsigned long long *sqtime;
+	struct bstream *ovhead, *ovtail;
+	unsigned long long qovfl;
+	unsigned long long qlat_ns, qlat_max, qlat_cnt;
+	int nspin;
+	unsigned long long spinns, spintime, spinhits, sleeps;
+	unsigned long long bpsocks;
+	unsigned long long h2conns, h2streams;
+	struct tx_stream *txhead, *txtail;
+	int txturn;
+	struct bstream *zclinger;
+	unsigned long long txstreams, txchunks;
+	unsigned long long zcsends, zccopied, zcsmall;
+	unsigned long long txcalls;
+	int epfd;
+	unsigned long long parks;
+	struct bstream *parked;
+	void *bfree;
+	int nbfree, bfcap, nbufs, nbused, maxbused;
+	/* Coroutine state, owned by the scheduler thread */
+	struct coro_ctx cosched;
+	struct coro *rqhead, *rqtail, *cofree;
+	int ncofree, colive, comaxlive;
+	unsigned long long cocreates, coswitches;
+	struct hot_doc hot[HOT_DOCS];
+} __attribute__ ((aligned (4096)));
+
+/*
+ * A response body larger than the TX quantum. Service threads send one
+ * quantum of it at a time, and put it back at the tail of the CPU TX list
+ * in between, so that big downloads are round-robin interleaved with each
+ * other and with the session queue. The session is suspended while its
+ * body is in flight, and resumed by whoever sends the last chunk.
+ */
+struct tx_stream {
+	struct tx_stream *next;
+	struct bstream *bstr;
+	int fd, cclose, zc;
+	void *addr;
+	off_t off, size;
+};
+
+/*
+ * A request for a document which is not (fully) in the page cache. The
+ * whole response is handed to the node I/O pool, so that the service
+ * thread does not sit on disk latency, and the session goes back to the
+ * owning CPU queue once the response has been sent.
+ */
+struct cold_req {
+	struct cold_req *next;
+	struct bstream *bstr;
+	int fd, cpu, cclose;
+	struct stat stb;
+	char ver[16];
+	unsigned long long tqueue;
+};
+
+struct io_pool {
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd;
+	struct cold_req *head, *tail;
+	int node, nthreads;
+	pthread_t *threads;
 } __attribute__ ((aligned (64)));
 
+/*
+ * Where a CPU sits in the machine topology. Per-CPU contexts are indexed
+ * by their position in the (topology sorted) cpu_topo array, and @cpu is
+ * the actual CPU number. The LLC domain is named after its first CPU.
+ */
+struct cpu_topo {
+	int cpu, node, pkg, core, llc, smt;
+};
+
 struct thread_ctx {
 	int cpu;
+	struct coro *cur;
 };
 
 static int stopsvr;
@@ -78,9 +318,23 @@ static char const *rootfs = ".";
 static int oflags;
 static int txmode = TX_MMAP;
 static int avail_cpus, num_cpus;
-static int sh_pipe[2];
+static int sh_pipe[2], dr_pipe[2];
 static int svrfd;
+static int *lfds, nlfds;
+static int draining;
+static char const *hoff_path;
+static unsigned long long drain_ns = 30000000000ULL;
+static unsigned long long spinmax;
+static int busypoll, prefbusypoll;
 static struct per_cpu_ctx *thcpu_ctx;
+static struct cpu_topo *cpu_topo;
+static int num_nodes = 1, iothreads;
+static long txquantum, zcthresh = 16 * 1024;
+static int parkidle;
+static int coromode;
+static size_t costksize = 64 * 1024, pgsize;
+static char mem_buf[1024 * 8];
+static struct io_pool *io_pools;
 static pthread_attr_t def_thattr;
 static pthread_key_t thtls_key;
 static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
@@ -241,32 +495,426 @@ static int xasprintf(char **bptr, char const *fmt, ...)
 	return error;
 }
 
+#if defined(__x86_64__)
+/*
+ * Saves the callee saved registers on the current stack, stores the stack
+ * pointer in *@psp, and resumes the context whose stack pointer is @sp.
+ * A fresh coroutine stack is set up by coro_init() so that the first switch
+ * into it returns into coro_entry, which calls %r13 with %r12 as argument.
+ */
+void coro_switch(void **psp, void *sp);
+void coro_entry(void);
+
+__asm__(".text\n"
+	".type coro_switch, @function\n"
+	"coro_switch:\n"
+	"\tpushq %rbp\n"
+	"\tpushq %rbx\n"
+	"\tpushq %r12\n"
+	"\tpushq %r13\n"
+	"\tpushq %r14\n"
+	"\tpushq %r15\n"
+	"\tmovq %rsp, (%rdi)\n"
+	"\tmovq %rsi, %rsp\n"
+	"\tpopq %r15\n"
+	"\tpopq %r14\n"
+	"\tpopq %r13\n"
+	"\tpopq %r12\n"
+	"\tpopq %rbx\n"
+	"\tpopq %rbp\n"
+	"\tret\n"
+	".size coro_switch, .-coro_switch\n"
+	".type coro_entry, @function\n"
+	"coro_entry:\n"
+	"\tmovq %r12, %rdi\n"
+	"\tcall *%r13\n"
+	"\tud2\n"
+	".size coro_entry, .-coro_entry\n");
+
+static void coro_jump(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_switch(&from->sp, to->sp);
+}
+#else
+static void coro_jump(struct coro_ctx *from, struct coro_ctx *to)
+{
+	swapcontext(&from->uc, &to->uc);
+}
+#endif
+
+/*
+ * Called when a socket operation would block. Outside of coroutines, where
+ * sockets are blocking and this does not happen, it fails. Otherwise it arms
+ * the socket in the CPU epoll set and switches to the scheduler, returning
+ * once the socket is ready.
+ */
+static int coro_wait(int fd, unsigned int events)
+{
+	struct thread_ctx *tcx = xget_thread_ctx();
+	struct per_cpu_ctx *pcx;
+	struct coro *co;
+	struct epoll_event ev;
+
+	if ((co = tcx->cur) == NULL)
+		return -1;
+	pcx = thcpu_ctx + tcx->cpu;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = co;
+	if (epoll_ctl(pcx->epfd, co->polled ? EPOLL_CTL_MOD: EPOLL_CTL_ADD,
+		      fd, &ev) != 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	co->polled = 1;
+	coro_jump(&co->ctx, &pcx->cosched);
+
+	return 0;
+}
+
+static void coro_ready(struct per_cpu_ctx *pcx, struct coro *co)
+{
+	co->next = NULL;
+	if (pcx->rqtail != NULL)
+		pcx->rqtail->next = co;
+	else
+		pcx->rqhead = co;
+	pcx->rqtail = co;
+}
+
+/*
+ * Lets the other coroutines of the CPU run. Fails outside of coroutines.
+ */
+static int coro_yield(void)
+{
+	struct thread_ctx *tcx = xget_thread_ctx();
+	struct per_cpu_ctx *pcx;
+	struct coro *co;
+
+	if ((co = tcx->cur) == NULL)
+		return -1;
+	pcx = thcpu_ctx + tcx->cpu;
+	coro_ready(pcx, co);
+	coro_jump(&co->ctx, &pcx->cosched);
+
+	return 0;
+}
+
+/*
+ * The sock_* functions behave like their blocking counterparts, also when
+ * called by a coroutine on a non-blocking socket.
+ */
+static ssize_t sock_recv(int fd, void *buf, size_t n, int flags)
+{
+	ssize_t cnt;
+
+	while ((cnt = recv(fd, buf, n, flags)) < 0 && errno == EAGAIN &&
+	       coro_wait(fd, EPOLLIN) == 0);
+
+	return cnt;
+}
+
+static ssize_t sock_send(int fd, void const *buf, size_t n, int flags)
+{
+	ssize_t cnt;
+
+	while ((cnt = send(fd, buf, n, flags)) < 0 && errno == EAGAIN &&
+	       coro_wait(fd, EPOLLOUT) == 0);
+
+	return cnt;
+}
+
+static ssize_t sock_writev(int fd, struct iovec const *iov, int iovcnt)
+{
+	ssize_t cnt;
+
+	while ((cnt = writev(fd, iov, iovcnt)) < 0 && errno == EAGAIN &&
+	       coro_wait(fd, EPOLLOUT) == 0);
+
+	return cnt;
+}
+
+static ssize_t sock_sendfile(int sfd, int fd, off_t *off, size_t n)
+{
+	size_t cnt;
+	ssize_t acnt;
+
+	for (cnt = 0; cnt < n; cnt += acnt) {
+		if ((acnt = sendfile(sfd, fd, off, n - cnt)) < 0) {
+			if (errno == EAGAIN && coro_wait(sfd, EPOLLOUT) == 0) {
+				acnt = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (acnt == 0)
+			break;
+	}
+
+	return cnt;
+}
+
 static struct bstream *bstream_open(int fd)
 {
 	struct bstream *bstr;
 
 	bstr = (struct bstream *) xmalloc(sizeof(struct bstream));
 	bstr->fd = fd;
+	bstr->parked = 0;
+	bstr->buf = bstr->hdr = NULL;
 	bstr->ridx = bstr->bcnt = 0;
+	bstr->hlen = 0;
+	bstr->ncalls = 0;
+	bstr->zc = 0;
+	bstr->zcseq = bstr->zcdone = 0;
+	bstr->zcmaps = NULL;
+	bstr->h2 = NULL;
 
 	return bstr;
 }
 
-static void bstream_close(struct bstream *bstr)
+static void bstream_getbuf(struct bstream *bstr)
+{
+	void **blk;
+	struct per_cpu_ctx *pcx;
+
+	if (bstr->buf != NULL)
+		return;
+
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	if ((blk = (void **) pcx->bfree) != NULL) {
+		pcx->bfree = *blk;
+		pcx->nbfree--;
+	} else
+		pcx->nbufs++;
+	if (++pcx->nbused > pcx->maxbused)
+		pcx->maxbused = pcx->nbused;
+	pthread_mutex_unlock(&pcx->mtx);
+	if (blk == NULL)
+		blk = (void **) xmalloc(BSTREAM_BLKSIZE);
+
+	bstr->buf = (char *) blk;
+	bstr->hdr = bstr->buf + BSTREAM_BUFSIZE;
+}
+
+static void bstream_putbuf(struct bstream *bstr)
+{
+	void **blk;
+	struct per_cpu_ctx *pcx;
+
+	if ((blk = (void **) bstr->buf) == NULL)
+		return;
+	bstr->buf = bstr->hdr = NULL;
+
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->nbused--;
+	if (pcx->nbfree < pcx->bfcap) {
+		*blk = pcx->bfree;
+		pcx->bfree = blk;
+		pcx->nbfree++;
+		blk = NULL;
+	} else
+		pcx->nbufs--;
+	pthread_mutex_unlock(&pcx->mtx);
+	free(blk);
+}
+
+static unsigned long long get_nstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Collects MSG_ZEROCOPY completion notifications from the socket error
+ * queue, waiting up to @timeo milliseconds for some to show up, and
+ * releases the mappings whose sends have all completed.
+ */
+static void zc_reap(struct bstream *bstr, int timeo)
+{
+	unsigned long long copied = 0;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	struct zc_map *zcm, **pzcm;
+	struct pollfd pfd;
+	char cbuf[128];
+
+	if (timeo > 0 && coro_yield() != 0) {
+		pfd.fd = bstr->fd;
+		pfd.events = 0;
+		pfd.revents = 0;
+		poll(&pfd, 1, timeo);
+	}
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		if (recvmsg(bstr->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/*
+			 * TCP completes sends in order, so the range upper bound
+			 * is all we need to track.
+			 */
+			bstr->zcdone = serr->ee_data + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				copied += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+	for (pzcm = &bstr->zcmaps; (zcm = *pzcm) != NULL;) {
+		if ((int) (bstr->zcdone - zcm->seq) > 0) {
+			munmap(zcm->addr, zcm->size);
+			*pzcm = zcm->next;
+			free(zcm);
+		} else
+			pzcm = &zcm->next;
+	}
+	if (copied) {
+		struct per_cpu_ctx *pcx = GET_CPUCTX();
+
+		pthread_mutex_lock(&pcx->mtx);
+		pcx->zccopied += copied;
+		pthread_mutex_unlock(&pcx->mtx);
+	}
+}
+
+static void zc_release(struct bstream *bstr, void *addr, size_t size)
+{
+	struct zc_map *zcm;
+
+	if (bstr->zcseq == bstr->zcdone) {
+		munmap(addr, size);
+		return;
+	}
+	zcm = (struct zc_map *) xmalloc(sizeof(struct zc_map));
+	zcm->addr = addr;
+	zcm->size = size;
+	zcm->seq = bstr->zcseq - 1;
+	zcm->next = bstr->zcmaps;
+	bstr->zcmaps = zcm;
+
+	zc_reap(bstr, 0);
+}
+
+static void h2_conn_free(struct h2_conn *h2);
+
+/*
+ * Releases what is left of a session, bypassing the buffer pool, which
+ * does not need a thread context (parked or queued sessions at shutdown).
+ */
+static void bstream_free(struct bstream *bstr)
 {
+	struct zc_map *zcm;
+
+	while ((zcm = bstr->zcmaps) != NULL) {
+		bstr->zcmaps = zcm->next;
+		munmap(zcm->addr, zcm->size);
+		free(zcm);
+	}
+	if (bstr->h2 != NULL)
+		h2_conn_free(bstr->h2);
 	close(bstr->fd);
+	free(bstr->buf);
 	free(bstr);
 }
 
-static size_t bstream_refil(struct bstream *bstr)
+/*
+ * Closed sessions with zerocopy sends still in flight linger on a per-CPU
+ * list (linked through @pnext), and get reaped without waiting by the
+ * following closes on the same CPU. The mappings are dropped anyway once
+ * ZC_LINGER_NS have passed, since the kernel holds its own page refs.
+ */
+static void zc_reap_lingering(struct per_cpu_ctx *pcx)
 {
-	size_t n;
+	unsigned long long tnow = get_nstime();
+	struct bstream *bstr, *next, *keep = NULL;
+
+	pthread_mutex_lock(&pcx->mtx);
+	bstr = pcx->zclinger;
+	pcx->zclinger = NULL;
+	pthread_mutex_unlock(&pcx->mtx);
+	for (; bstr != NULL; bstr = next) {
+		next = bstr->pnext;
+		zc_reap(bstr, 0);
+		if (bstr->zcmaps == NULL || tnow > bstr->zcexpire)
+			bstream_free(bstr);
+		else {
+			bstr->pnext = keep;
+			keep = bstr;
+		}
+	}
+	if (keep == NULL)
+		return;
+	pthread_mutex_lock(&pcx->mtx);
+	for (bstr = keep; bstr->pnext != NULL; bstr = bstr->pnext);
+	bstr->pnext = pcx->zclinger;
+	pcx->zclinger = keep;
+	pthread_mutex_unlock(&pcx->mtx);
+}
+
+static void bstream_close(struct bstream *bstr)
+{
+	struct per_cpu_ctx *pcx;
+
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->txcalls += bstr->ncalls;
+	pcx->closes++;
+	pthread_mutex_unlock(&pcx->mtx);
+
+	if (__atomic_load_n(&pcx->zclinger, __ATOMIC_RELAXED) != NULL)
+		zc_reap_lingering(pcx);
+	bstream_putbuf(bstr);
+	if (bstr->zcmaps != NULL)
+		zc_reap(bstr, 0);
+	if (bstr->zcmaps != NULL) {
+		bstr->zcexpire = get_nstime() + ZC_LINGER_NS;
+		pthread_mutex_lock(&pcx->mtx);
+		bstr->pnext = pcx->zclinger;
+		pcx->zclinger = bstr;
+		pthread_mutex_unlock(&pcx->mtx);
+	} else
+		bstream_free(bstr);
+}
+
+static ssize_t bstream_refil(struct bstream *bstr)
+{
+	ssize_t n;
+
+	if (bstr->bcnt > 0 && bstr->ridx > 0)
+		memmove(bstr->buf, bstr->buf + bstr->ridx, bstr->bcnt);
+	bstr->ridx = 0;
+	if ((n = sock_recv(bstr->fd, bstr->buf + bstr->bcnt,
+			   BSTREAM_BUFSIZE - bstr->bcnt, 0)) > 0)
+		bstr->bcnt += n;
+
+	return n;
+}
+
+static ssize_t bstream_refil_nowait(struct bstream *bstr)
+{
+	ssize_t n;
 
 	if (bstr->bcnt > 0 && bstr->ridx > 0)
 		memmove(bstr->buf, bstr->buf + bstr->ridx, bstr->bcnt);
 	bstr->ridx = 0;
 	if ((n = recv(bstr->fd, bstr->buf + bstr->bcnt,
-		      BSTREAM_BUFSIZE - bstr->bcnt, 0)) > 0)
+		      BSTREAM_BUFSIZE - bstr->bcnt, MSG_DONTWAIT)) > 0)
 		bstr->bcnt += n;
 
 	return n;
@@ -283,7 +931,7 @@ static size_t bstream_readsome(struct bstream *bstr, void *buf, size_t n)
 		bstr->ridx += cnt;
 		bstr->bcnt -= cnt;
 	} else
-		cnt = recv(bstr->fd, buf, n, 0);
+		cnt = sock_recv(bstr->fd, buf, n, 0);
 
 	return cnt;
 }
@@ -324,22 +972,136 @@ static char *bstream_readln(struct bstream *bstr, size_t *lnsize)
 	return bstr->buf + bstr->ridx - lsize;
 }
 
+static size_t bstream_send(struct bstream *bstr, void const *buf, size_t n,
+			   int flags)
+{
+	size_t cnt;
+	ssize_t acnt;
+
+	for (cnt = 0; cnt < n;) {
+		bstr->ncalls++;
+		if ((acnt = sock_send(bstr->fd, buf, n - cnt, flags)) < 0) {
+			perror("send");
+			return -1;
+		}
+		cnt += acnt;
+		buf = (char const *) buf + acnt;
+	}
+
+	return cnt;
+}
+
 static size_t bstream_write(struct bstream *bstr, void const *buf, size_t n)
 {
-	size_t cnt, acnt;
+	return bstream_send(bstr, buf, n, 0);
+}
+
+static size_t bstream_writev(struct bstream *bstr, struct iovec *iov,
+			     int iovcnt)
+{
+	size_t cnt = 0;
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		bstr->ncalls++;
+		if ((n = sock_writev(bstr->fd, iov, iovcnt)) < 0) {
+			perror("writev");
+			return -1;
+		}
+		cnt += n;
+		for (; iovcnt > 0 && (size_t) n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return cnt;
+}
+
+/*
+ * Formats the response header into the per-connection header buffer. It
+ * is then emitted together with the body, either within the same writev(2)
+ * or with MSG_MORE ahead of it, so that no TCP_CORK toggling is needed.
+ * Fails rather than sending a truncated header, should it not fit.
+ */
+static int bstream_header(struct bstream *bstr, char const *ver,
+			  char const *cclose, long size)
+{
+	int n;
+
+	n = snprintf(bstr->hdr, BSTREAM_HDRSIZE,
+		     "%s 200 OK\r\n"
+		     "Connection: %s\r\n"
+		     "Content-Length: %ld\r\n"
+		     "\r\n", ver, cclose, size);
+	if (n < 0 || n >= BSTREAM_HDRSIZE) {
+		fprintf(stderr, "Response header too big (%d bytes)\n", n);
+		return -1;
+	}
+	bstr->hlen = (size_t) n;
+
+	return 0;
+}
+
+static int bstream_flush_header(struct bstream *bstr, int more)
+{
+	return bstream_send(bstr, bstr->hdr, bstr->hlen,
+			    more ? MSG_MORE: 0) == bstr->hlen ? 0: -1;
+}
+
+static size_t zc_send(struct bstream *bstr, void const *buf, size_t n)
+{
+	size_t cnt;
+	ssize_t acnt;
+	struct per_cpu_ctx *pcx;
 
 	for (cnt = 0; cnt < n;) {
-		if ((acnt = send(bstr->fd, buf, n - cnt, 0)) < 0) {
+		bstr->ncalls++;
+		if ((acnt = sock_send(bstr->fd, buf, n - cnt,
+				      MSG_ZEROCOPY)) < 0) {
+			/*
+			 * Too many pinned pages accounted to the socket, wait
+			 * for the kernel to give some back.
+			 */
+			if (errno == ENOBUFS) {
+				zc_reap(bstr, 100);
+				continue;
+			}
 			perror("send");
 			return -1;
 		}
+		bstr->zcseq++;
 		cnt += acnt;
 		buf = (char const *) buf + acnt;
 	}
 
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->zcsends++;
+	pthread_mutex_unlock(&pcx->mtx);
+
 	return cnt;
 }
 
+static int use_zerocopy(struct bstream *bstr, size_t size)
+{
+	struct per_cpu_ctx *pcx;
+
+	if (txmode != TX_ZEROCOPY || !bstr->zc)
+		return 0;
+	if (size >= (size_t) zcthresh)
+		return 1;
+
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->zcsmall++;
+	pthread_mutex_unlock(&pcx->mtx);
+
+	return 0;
+}
+
 static size_t bstream_printf(struct bstream *bstr, char const *fmt, ...)
 {
 	size_t cnt;
@@ -356,11 +1118,19 @@ static size_t bstream_printf(struct bstream *bstr, char const *fmt, ...)
 	return cnt;
 }
 
+/*
+ * The *_tx functions emit the pending header together with the body.
+ */
 static int sendfile_tx(int fd, struct bstream *bstr, struct stat const *stb)
 {
 	off_t off = 0;
 
-	if (sendfile(bstr->fd, fd, &off, stb->st_size) != stb->st_size) {
+	if (bstream_flush_header(bstr, stb->st_size > 0) < 0)
+		return -1;
+	if (stb->st_size == 0)
+		return 0;
+	bstr->ncalls++;
+	if (sock_sendfile(bstr->fd, fd, &off, stb->st_size) != stb->st_size) {
 		perror("sendfile");
 		return -1;
 	}
@@ -372,39 +1142,315 @@ static int mmap_tx(int fd, struct bstream *bstr, struct stat const *stb)
 {
 	void *addr;
 	size_t txcnt;
+	struct iovec iov[2];
 
+	if (stb->st_size == 0)
+		return bstream_flush_header(bstr, 0);
 	addr = xmmap(NULL, stb->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	txcnt = bstream_write(bstr, addr, stb->st_size);
-	munmap(addr, stb->st_size);
+	if (use_zerocopy(bstr, stb->st_size)) {
+		/*
+		 * The header buffer is reused by the next response, so it
+		 * cannot be part of a zerocopy send.
+		 */
+		txcnt = bstream_flush_header(bstr, 1) == 0 ?
+			zc_send(bstr, addr, stb->st_size): (size_t) -1;
+		zc_release(bstr, addr, stb->st_size);
+	} else {
+		iov[0].iov_base = bstr->hdr;
+		iov[0].iov_len = bstr->hlen;
+		iov[1].iov_base = addr;
+		iov[1].iov_len = stb->st_size;
+		txcnt = bstream_writev(bstr, iov, 2) - bstr->hlen;
+		munmap(addr, stb->st_size);
+	}
 
-	return txcnt == stb->st_size ? 0: -1;
+	return txcnt == (size_t) stb->st_size ? 0: -1;
 }
 
-static int set_cork(int fd, int v)
+static size_t mem_tx(struct bstream *bstr, size_t size)
 {
-	return setsockopt(fd, SOL_TCP, TCP_CORK, &v, sizeof(v));
-}
+	size_t csize, msent;
 
-static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
-		    char const *cclose)
+	for (msent = 0; msent < size; msent += csize) {
+		csize = (size - msent) > sizeof(mem_buf) ?
+			sizeof(mem_buf): size - msent;
+		if (bstream_write(bstr, mem_buf, csize) != csize)
+			break;
+	}
+
+	return msent;
+}
+
+/*
+ * Checks whether the first COLD_PROBE_SIZE bytes of the file are resident
+ * in the page cache. The MMAP mode is going to map the file anyway, so we
+ * ask mincore(2) about the probe window. The SENDFILE mode never touches
+ * the mm, so we probe one byte of every page in the window with RWF_NOWAIT
+ * reads instead.
+ */
+static int file_is_cold(int fd, struct stat const *stb)
 {
-	int fd, error = -1;
-	char *path = NULL;
+	size_t i, size, pgsize;
+	void *addr;
+	unsigned char vec[COLD_PROBE_SIZE / 4096];
+
+	if ((size = stb->st_size) == 0)
+		return 0;
+	if (size > COLD_PROBE_SIZE)
+		size = COLD_PROBE_SIZE;
+	if (txmode != TX_SENDFILE) {
+		pgsize = sysconf(_SC_PAGESIZE);
+		if (size > sizeof(vec) * pgsize)
+			size = sizeof(vec) * pgsize;
+		if ((addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd,
+				 0)) == MAP_FAILED)
+			return 0;
+		if (mincore(addr, size, vec) != 0) {
+			munmap(addr, size);
+			return 0;
+		}
+		munmap(addr, size);
+		for (i = 0; i < (size + pgsize - 1) / pgsize; i++)
+			if ((vec[i] & 1) == 0)
+				return 1;
+	} else {
+		char c;
+		struct iovec iov = { &c, 1 };
+
+		pgsize = sysconf(_SC_PAGESIZE);
+		for (i = 0; i < size; i += pgsize)
+			if (preadv2(fd, &iov, 1, i, RWF_NOWAIT) < 0 &&
+			    errno == EAGAIN)
+				return 1;
+	}
+
+	return 0;
+}
+
+static void queue_tx_stream(struct per_cpu_ctx *pcx, struct tx_stream *txs)
+{
+	txs->next = NULL;
+	pthread_mutex_lock(&pcx->mtx);
+	if (pcx->txtail != NULL)
+		pcx->txtail->next = txs;
+	else
+		pcx->txhead = txs;
+	pcx->txtail = txs;
+	pthread_cond_signal(&pcx->cnd);
+	pthread_mutex_unlock(&pcx->mtx);
+}
+
+/*
+ * Takes ownership of @fd (-1 for /mem-N bodies) and of the session.
+ */
+static int start_tx_stream(struct per_cpu_ctx *pcx, struct bstream *bstr,
+			   int fd, off_t size, char const *cclose)
+{
+	struct tx_stream *txs;
+
+	txs = (struct tx_stream *) xmalloc(sizeof(struct tx_stream));
+	txs->bstr = bstr;
+	txs->fd = fd;
+	txs->cclose = strcmp(cclose, "close") == 0;
+	txs->addr = NULL;
+	txs->off = 0;
+	txs->size = size;
+	txs->zc = 0;
+	if (fd != -1 && txmode != TX_SENDFILE) {
+		txs->addr = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		txs->zc = use_zerocopy(bstr, txquantum);
+	}
+
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->txstreams++;
+	pthread_mutex_unlock(&pcx->mtx);
+
+	queue_tx_stream(pcx, txs);
+
+	return 1;
+}
+
+/*
+ * Sends the next quantum of the body. Returns 1 if there is more to send,
+ * 0 if the body is complete, -1 on error.
+ */
+static int tx_stream_chunk(struct tx_stream *txs)
+{
+	size_t n;
+
+	n = txs->size - txs->off > txquantum ? (size_t) txquantum:
+		(size_t) (txs->size - txs->off);
+	if (txs->fd == -1) {
+		if (mem_tx(txs->bstr, n) != n)
+			return -1;
+		txs->off += n;
+	} else if (txs->addr != NULL) {
+		if ((txs->zc ? zc_send(txs->bstr, (char *) txs->addr + txs->off, n):
+		     bstream_write(txs->bstr, (char *) txs->addr + txs->off,
+				   n)) != n)
+			return -1;
+		txs->off += n;
+	} else {
+		txs->bstr->ncalls++;
+		if (sock_sendfile(txs->bstr->fd, txs->fd, &txs->off, n) !=
+		    (ssize_t) n) {
+			perror("sendfile");
+			return -1;
+		}
+	}
+
+	return txs->off < txs->size;
+}
+
+/*
+ * Returns the session to be resumed, or NULL if it has been terminated.
+ */
+static struct bstream *end_tx_stream(struct per_cpu_ctx *pcx,
+				     struct tx_stream *txs, int error)
+{
+	struct bstream *bstr = txs->bstr;
+
+	if (txs->zc)
+		zc_release(bstr, txs->addr, txs->size);
+	else if (txs->addr != NULL)
+		munmap(txs->addr, txs->size);
+	if (txs->fd != -1)
+		close(txs->fd);
+
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->tbytes += txs->off;
+	pcx->txcalls += bstr->ncalls;
+	pthread_mutex_unlock(&pcx->mtx);
+	bstr->ncalls = 0;
+
+	if (error < 0 || txs->cclose || stopsvr) {
+		bstream_close(bstr);
+		bstr = NULL;
+	}
+	free(txs);
+
+	return bstr;
+}
+
+/*
+ * Takes ownership of @fd. Returns 1 if the session has been handed off.
+ */
+static int send_file(struct bstream *bstr, int fd, struct stat const *stb,
+		     char const *ver, char const *cclose)
+{
+	int error = -1;
 	struct per_cpu_ctx *pcx;
-	struct stat stbuf;
 
 	pcx = GET_CPUCTX();
 
+	if (bstream_header(bstr, ver, cclose, (long) stb->st_size) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (txquantum > 0 && stb->st_size > txquantum) {
+		if (bstream_flush_header(bstr, 1) < 0) {
+			close(fd);
+			return -1;
+		}
+		return start_tx_stream(pcx, bstr, fd, stb->st_size, cclose);
+	}
+	if (txmode == TX_SENDFILE)
+		error = sendfile_tx(fd, bstr, stb);
+	else
+		error = mmap_tx(fd, bstr, stb);
+	close(fd);
+	if (error < 0)
+		return error;
+
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->tbytes += stb->st_size;
+	pthread_mutex_unlock(&pcx->mtx);
+
+	return 0;
+}
+
+static void queue_cold_req(struct per_cpu_ctx *pcx, struct bstream *bstr,
+			   int fd, struct stat const *stb, char const *ver,
+			   char const *cclose)
+{
+	struct cold_req *crq;
+	struct io_pool *iop;
+
+	crq = (struct cold_req *) xmalloc(sizeof(struct cold_req));
+	crq->next = NULL;
+	crq->bstr = bstr;
+	crq->fd = fd;
+	crq->cpu = (int) (pcx - thcpu_ctx);
+	crq->cclose = strcmp(cclose, "close") == 0;
+	crq->stb = *stb;
+	snprintf(crq->ver, sizeof(crq->ver), "%s", ver);
+	crq->tqueue = get_nstime();
+
+	iop = io_pools + pcx->node;
+	pthread_mutex_lock(&iop->mtx);
+	if (iop->tail != NULL)
+		iop->tail->next = crq;
+	else
+		iop->head = crq;
+	iop->tail = crq;
+	pthread_cond_signal(&iop->cnd);
+	pthread_mutex_unlock(&iop->mtx);
+}
+
+static void hot_doc_hit(struct per_cpu_ctx *pcx, char const *doc)
+{
+	unsigned long hash = 5381;
+	char const *ptr;
+	struct hot_doc *hd;
+
+	for (ptr = doc; *ptr != '\0'; ptr++)
+		hash = hash * 33 + (unsigned char) *ptr;
+	if (ptr - doc >= HOT_PATHSIZE)
+		return;
+	hd = pcx->hot + hash % HOT_DOCS;
+
+	pthread_mutex_lock(&pcx->mtx);
+	if (strcmp(hd->path, doc) == 0)
+		hd->hits++;
+	else if (hd->hits == 0 || --hd->hits == 0) {
+		strcpy(hd->path, doc);
+		hd->hits = 1;
+	}
+	pthread_mutex_unlock(&pcx->mtx);
+}
+
+static int open_doc(char const *doc, struct stat *stb)
+{
+	int fd;
+	char *path = NULL;
+
 	/*
 	 * Ok, this is a dumb server, don't expect protection against '..'
 	 * root path back-tracking tricks ;)
 	 */
 	xasprintf(&path, "%s/%s", rootfs, *doc == '/' ? doc + 1: doc);
-	if ((fd = open(path, oflags | O_RDONLY)) == -1 ||
-	    fstat(fd, &stbuf)) {
+	if ((fd = open(path, oflags | O_RDONLY)) == -1 || fstat(fd, stb)) {
 		perror(path);
-		close(fd);
-		free(path);
+		if (fd != -1)
+			close(fd);
+		fd = -1;
+	}
+	free(path);
+
+	return fd;
+}
+
+/*
+ * Returns 1 if the response (and with it the session) has been handed
+ * to the I/O pool, in which case the caller must not touch @bstr anymore.
+ */
+static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
+		    char const *cclose)
+{
+	int fd;
+	struct stat stbuf;
+
+	if ((fd = open_doc(doc, &stbuf)) == -1) {
 		bstream_printf(bstr,
 			       "%s 404 Not found\r\n"
 			       "Connection: %s\r\n"
@@ -412,27 +1458,14 @@ static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
 			       "\r\n", ver, cclose);
 		return -1;
 	}
-	free(path);
-	set_cork(bstr->fd, 1);
-	bstream_printf(bstr,
-		       "%s 200 OK\r\n"
-		       "Connection: %s\r\n"
-		       "Content-Length: %ld\r\n"
-		       "\r\n", ver, cclose, (long) stbuf.st_size);
-	if (txmode == TX_SENDFILE)
-		error = sendfile_tx(fd, bstr, &stbuf);
-	else if (txmode == TX_MMAP)
-		error = mmap_tx(fd, bstr, &stbuf);
-	close(fd);
-	set_cork(bstr->fd, 0);
-	if (error < 0)
-		return error;
-
-	pthread_mutex_lock(&pcx->mtx);
-	pcx->tbytes += stbuf.st_size;
-	pthread_mutex_unlock(&pcx->mtx);
+	if (hoff_path != NULL)
+		hot_doc_hit(GET_CPUCTX(), doc);
+	if (iothreads > 0 && file_is_cold(fd, &stbuf)) {
+		queue_cold_req(GET_CPUCTX(), bstr, fd, &stbuf, ver, cclose);
+		return 1;
+	}
 
-	return 0;
+	return send_file(bstr, fd, &stbuf, ver, cclose);
 }
 
 
@@ -440,28 +1473,26 @@ static int send_doc(struct bstream *bstr, char const *doc, char const *ver,
 static int send_mem(struct bstream *bstr, long size, char const *ver,
 		    char const *cclose)
 {
-	size_t csize, n;
 	long msent;
 	struct per_cpu_ctx *pcx;
-	static char mbuf[1024 * 8];
+	struct iovec iov[2];
 
 	pcx = GET_CPUCTX();
 
-	set_cork(bstr->fd, 1);
-	bstream_printf(bstr,
-		       "%s 200 OK\r\n"
-		       "Connection: %s\r\n"
-		       "Content-Length: %ld\r\n"
-		       "\r\n", ver, cclose, size);
-	for (msent = 0; msent < size;) {
-		csize = (size - msent) > sizeof(mbuf) ?
-			sizeof(mbuf): (size_t) (size - msent);
-		if ((n = bstream_write(bstr, mbuf, csize)) > 0)
-			msent += n;
-		if (n != csize)
-			break;
-	}
-	set_cork(bstr->fd, 0);
+	if (bstream_header(bstr, ver, cclose, size) < 0)
+		return -1;
+	if (size <= (long) sizeof(mem_buf)) {
+		iov[0].iov_base = bstr->hdr;
+		iov[0].iov_len = bstr->hlen;
+		iov[1].iov_base = mem_buf;
+		iov[1].iov_len = size;
+		msent = (long) (bstream_writev(bstr, iov, 2) - bstr->hlen);
+	} else if (bstream_flush_header(bstr, 1) < 0) {
+		return -1;
+	} else if (txquantum > 0 && size > txquantum) {
+		return start_tx_stream(pcx, bstr, -1, size, cclose);
+	} else
+		msent = (long) mem_tx(bstr, size);
 
 	pthread_mutex_lock(&pcx->mtx);
 	pcx->tbytes += msent;
@@ -483,254 +1514,2340 @@ static int send_url(struct bstream *bstr, char const *doc, char const *ver,
 	return error;
 }
 
-static int process_session(int cfd)
+static void park_link(struct per_cpu_ctx *pcx, struct bstream *bstr)
 {
-	int cclose, chunked;
-	size_t lsize, clen;
-	struct per_cpu_ctx *pcx;
-	struct bstream *bstr;
-	char *meth, *doc, *ver, *ln, *auxptr;
-	char req[2048];
+	bstr->pprev = NULL;
+	if ((bstr->pnext = pcx->parked) != NULL)
+		bstr->pnext->pprev = bstr;
+	pcx->parked = bstr;
+}
+
+static void park_unlink(struct per_cpu_ctx *pcx, struct bstream *bstr)
+{
+	if (bstr->pprev != NULL)
+		bstr->pprev->pnext = bstr->pnext;
+	else
+		pcx->parked = bstr->pnext;
+	if (bstr->pnext != NULL)
+		bstr->pnext->pprev = bstr->pprev;
+}
+
+/*
+ * Gives the session buffer back to the pool, and hands the connection to
+ * the CPU epoll set, whose readiness the acceptor thread turns into a
+ * session queue entry once the next request shows up. Sessions are not
+ * parked anymore once draining or stopping, and the caller gets the
+ * buffer back with bstream_getbuf() when parking fails.
+ */
+static int park_session(struct per_cpu_ctx *pcx, struct bstream *bstr)
+{
+	int op = bstr->parked ? EPOLL_CTL_MOD: EPOLL_CTL_ADD;
+	struct epoll_event ev;
 
+	bstream_putbuf(bstr);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = bstr;
 	/*
-	 * This could be easily be passed from the top, but I want to test
-	 * the pthread TLS access performance, since in big projects, passing
-	 * down the pointers might make the interface ugly.
+	 * Once armed, the session can be resumed (and closed) by another
+	 * thread, so @bstr is not touched after that, and it is linked under
+	 * the lock the resume and the drain sweep take.
 	 */
-	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	if (draining || stopsvr) {
+		pthread_mutex_unlock(&pcx->mtx);
+		return -1;
+	}
+	pcx->txcalls += bstr->ncalls;
+	bstr->ncalls = 0;
+	park_link(pcx, bstr);
+	bstr->parked = 1;
+	if (epoll_ctl(pcx->epfd, op, bstr->fd, &ev) != 0) {
+		perror("epoll_ctl");
+		park_unlink(pcx, bstr);
+		bstr->parked = op == EPOLL_CTL_MOD;
+		pthread_mutex_unlock(&pcx->mtx);
+		return -1;
+	}
+	pcx->parks++;
+	pthread_mutex_unlock(&pcx->mtx);
 
-	bstr = bstream_open(cfd);
-	do {
-		if ((ln = bstream_readln(bstr, &lsize)) == NULL)
-			break;
-		strncpy(req, ln, sizeof(req));
-		if ((meth = strtok_r(req, " ", &auxptr)) == NULL ||
-		    (doc = strtok_r(NULL, " ", &auxptr)) == NULL ||
-		    (ver = strtok_r(NULL, " \r", &auxptr)) == NULL ||
-		    strcasecmp(meth, "GET") != 0) {
-		bad_request:
-			bstream_printf(bstr,
-				       "HTTP/1.1 400 Bad request\r\n"
-				       "Connection: close\r\n"
-				       "Content-Length: 0\r\n"
-				       "\r\n");
-			break;
+	return 0;
+}
+
+/*
+ * HTTP/2 (h2c, prior knowledge) support. A connection opening with the
+ * client preface is served by h2_session(), still on the CPU service thread
+ * (or coroutine) which got it, multiplexing its streams: pending input is
+ * processed between rounds in which each stream with flow control credit
+ * gets a DATA frame out. File bodies are sent with sendfile(2).
+ */
+static struct hpack_hdr const hpack_static[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+static struct {
+	unsigned int code;
+	int len;
+} const huff_codes[256] = {
+	{ 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+	{ 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+	{ 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+	{ 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+	{ 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+	{ 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+	{ 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+	{ 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+	{ 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+	{ 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+	{ 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+	{ 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+	{ 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+	{ 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+	{ 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+	{ 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+	{ 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+	{ 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+	{ 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+	{ 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+	{ 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+	{ 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+	{ 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+	{ 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+	{ 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+	{ 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+	{ 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+	{ 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+	{ 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+	{ 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+	{ 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+	{ 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+	{ 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+	{ 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+	{ 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+	{ 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+	{ 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+	{ 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+	{ 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+	{ 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+	{ 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+	{ 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+	{ 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+	{ 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+	{ 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+	{ 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+	{ 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+	{ 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+	{ 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+	{ 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+	{ 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+	{ 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+	{ 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+	{ 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+	{ 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+	{ 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+	{ 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+	{ 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+	{ 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+	{ 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+	{ 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+	{ 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+	{ 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+	{ 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+};
+
+/*
+ * Binary decoding tree of the HPACK Huffman code. Positive entries are
+ * child node indexes, negative ones leaves holding -(symbol + 1).
+ */
+static short huff_tree[512][2];
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+static void huff_build(void)
+{
+	int i, j, bit, node, nnodes = 1;
+	unsigned int code;
+
+	for (i = 0; i <= 256; i++) {
+		code = i < 256 ? huff_codes[i].code: 0x3fffffff;
+		for (node = 0, j = (i < 256 ? huff_codes[i].len: 30) - 1; j > 0;
+		     j--) {
+			bit = (code >> j) & 1;
+			if (huff_tree[node][bit] == 0)
+				huff_tree[node][bit] = nnodes++;
+			node = huff_tree[node][bit];
 		}
-		pthread_mutex_lock(&pcx->mtx);
-		pcx->reqs++;
-		pthread_mutex_unlock(&pcx->mtx);
-		cclose = strcasecmp(ver, "HTTP/1.1") != 0;
-		for (clen = 0, chunked = 0;;) {
-			if ((ln = bstream_readln(bstr, &lsize)) == NULL)
-				break;
-			if (strcmp(ln, "\r") == 0)
-				break;
-			if (strncasecmp(ln, "Content-Length:", 15) == 0) {
-				for (auxptr = ln + 15; *auxptr == ' '; auxptr++);
-				clen = atoi(auxptr);
-			} else if (strncasecmp(ln, "Connection:", 11) == 0) {
-				for (auxptr = ln + 11; *auxptr == ' '; auxptr++);
-				cclose = strncasecmp(auxptr, "close", 5) == 0;
-			} else if (strncasecmp(ln, "Transfer-Encoding:", 18) == 0) {
-				for (auxptr = ln + 18; *auxptr == ' '; auxptr++);
-				chunked = strncasecmp(auxptr, "chunked", 7) == 0;
+		huff_tree[node][code & 1] = -(i + 1);
+	}
+}
+
+static int huff_decode(unsigned char const *src, size_t n, char *dst,
+		       size_t size, size_t *len)
+{
+	int node = 0, bit, nbits = 0, ones = 1;
+	size_t i, cnt = 0;
+
+	pthread_once(&huff_once, huff_build);
+	for (i = 0; i < n; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			node = huff_tree[node][(src[i] >> bit) & 1];
+			nbits++;
+			ones = ones && ((src[i] >> bit) & 1);
+			if (node > 0)
+				continue;
+			if (node == 0 || node == -257 || cnt + 1 >= size)
+				return -1;
+			dst[cnt++] = (char) (-node - 1);
+			node = 0;
+			nbits = 0;
+			ones = 1;
+		}
+	}
+	/*
+	 * Whatever is left must be (at most 7 bits of) EOS prefix padding.
+	 */
+	if (nbits > 7 || !ones)
+		return -1;
+	dst[cnt] = '\0';
+	*len = cnt;
+
+	return 0;
+}
+
+static int hpack_int(unsigned char const **pp, unsigned char const *end,
+		     int nbits, size_t *val)
+{
+	int shift = 0;
+	size_t mask = (1U << nbits) - 1, v;
+	unsigned char const *p = *pp;
+
+	if (p >= end)
+		return -1;
+	if ((v = *p++ & mask) == mask) {
+		do {
+			if (p >= end || shift > 28)
+				return -1;
+			v += (size_t) (*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+	}
+	*pp = p;
+	*val = v;
+
+	return 0;
+}
+
+static int hpack_str(unsigned char const **pp, unsigned char const *end,
+		     char *buf, size_t size, size_t *len)
+{
+	int huff;
+	size_t slen;
+
+	if (*pp >= end)
+		return -1;
+	huff = **pp & 0x80;
+	if (hpack_int(pp, end, 7, &slen) != 0 || slen > (size_t) (end - *pp))
+		return -1;
+	if (huff) {
+		if (huff_decode(*pp, slen, buf, size, len) != 0)
+			return -1;
+	} else {
+		if (slen >= size)
+			return -1;
+		memcpy(buf, *pp, slen);
+		buf[slen] = '\0';
+		*len = slen;
+	}
+	*pp += slen;
+
+	return 0;
+}
+
+static void hpack_evict(struct h2_conn *h2, size_t maxsize)
+{
+	struct hpack_hdr *hh;
+
+	while (h2->dcount > 0 && h2->dsize > maxsize) {
+		hh = h2->dtab + (h2->dhead - h2->dcount + 1 + HPACK_MAX_ENTRIES) %
+			HPACK_MAX_ENTRIES;
+		h2->dsize -= strlen(hh->name) + strlen(hh->value) + 32;
+		free((char *) hh->name);
+		h2->dcount--;
+	}
+}
+
+static void hpack_add(struct h2_conn *h2, char const *name, size_t nlen,
+		      char const *value, size_t vlen)
+{
+	size_t esize = nlen + vlen + 32;
+	char *ent;
+	struct hpack_hdr *hh;
+
+	/*
+	 * Copy first, @name might be an entry about to be evicted.
+	 */
+	ent = (char *) xmalloc(nlen + vlen + 2);
+	memcpy(ent, name, nlen + 1);
+	memcpy(ent + nlen + 1, value, vlen + 1);
+	hpack_evict(h2, esize <= h2->dmaxsize ? h2->dmaxsize - esize: 0);
+	if (esize > h2->dmaxsize) {
+		free(ent);
+		return;
+	}
+	if (h2->dcount == HPACK_MAX_ENTRIES)
+		hpack_evict(h2, h2->dsize - 1);
+	h2->dhead = (h2->dhead + 1) % HPACK_MAX_ENTRIES;
+	hh = h2->dtab + h2->dhead;
+	hh->name = ent;
+	hh->value = ent + nlen + 1;
+	h2->dsize += esize;
+	h2->dcount++;
+}
+
+static struct hpack_hdr const *hpack_lookup(struct h2_conn *h2, size_t idx)
+{
+	if (idx == 0)
+		return NULL;
+	if (idx <= HPACK_NSTATIC)
+		return hpack_static + idx - 1;
+	if ((idx -= HPACK_NSTATIC + 1) >= (size_t) h2->dcount)
+		return NULL;
+
+	return h2->dtab + (h2->dhead - (int) idx + HPACK_MAX_ENTRIES) %
+		HPACK_MAX_ENTRIES;
+}
+
+/*
+ * Decodes a request header block, keeping the dynamic table in sync, and
+ * picks out :method and :path. Fields coming out of the static table (as
+ * well as static names) need no string handling at all, and only the
+ * pseudo-headers are looked at.
+ */
+static int hpack_decode(struct h2_conn *h2, unsigned char const *p, size_t n,
+			char *method, size_t msize, char *path, size_t psize)
+{
+	int nbits, indexing;
+	size_t idx, nlen, vlen;
+	unsigned char const *end = p + n;
+	struct hpack_hdr const *hh;
+	char const *name, *value;
+	char nbuf[HPACK_STRMAX], vbuf[HPACK_STRMAX];
+
+	*method = *path = '\0';
+	while (p < end) {
+		if (*p & 0x80) {
+			if (hpack_int(&p, end, 7, &idx) != 0 ||
+			    (hh = hpack_lookup(h2, idx)) == NULL)
+				return -1;
+			name = hh->name;
+			value = hh->value;
+		} else if ((*p & 0xe0) == 0x20) {
+			if (hpack_int(&p, end, 5, &idx) != 0 ||
+			    idx > HPACK_TABLE_SIZE)
+				return -1;
+			h2->dmaxsize = idx;
+			hpack_evict(h2, idx);
+			continue;
+		} else {
+			indexing = (*p & 0xc0) == 0x40;
+			nbits = indexing ? 6: 4;
+			if (hpack_int(&p, end, nbits, &idx) != 0)
+				return -1;
+			if (idx > 0) {
+				if ((hh = hpack_lookup(h2, idx)) == NULL)
+					return -1;
+				name = hh->name;
+				nlen = strlen(name);
+			} else {
+				if (hpack_str(&p, end, nbuf, sizeof(nbuf),
+					      &nlen) != 0)
+					return -1;
+				name = nbuf;
+			}
+			if (hpack_str(&p, end, vbuf, sizeof(vbuf), &vlen) != 0)
+				return -1;
+			value = vbuf;
+			if (indexing) {
+				hpack_add(h2, name, nlen, value, vlen);
+				hh = hpack_lookup(h2, HPACK_NSTATIC + 1);
+				name = hh != NULL ? hh->name: "";
 			}
 		}
-		/*
-		 * Sorry, really stupid HTTP server here. Neither GET payload nor
-		 * chunked encoding allowed.
-		 */
-		if (clen || chunked)
-			goto bad_request;
-		send_url(bstr, doc, ver, cclose ? "close": "keep-alive");
-	} while (!stopsvr && !cclose);
-	bstream_close(bstr);
+		if (*name != ':')
+			continue;
+		if (strcmp(name, ":method") == 0 && strlen(value) < msize)
+			strcpy(method, value);
+		else if (strcmp(name, ":path") == 0 && strlen(value) < psize)
+			strcpy(path, value);
+	}
+
+	return 0;
+}
+
+static void h2_frame_hdr(unsigned char *p, size_t len, int type, int flags,
+			 unsigned int sid)
+{
+	p[0] = (unsigned char) (len >> 16);
+	p[1] = (unsigned char) (len >> 8);
+	p[2] = (unsigned char) len;
+	p[3] = (unsigned char) type;
+	p[4] = (unsigned char) flags;
+	p[5] = (unsigned char) ((sid >> 24) & 0x7f);
+	p[6] = (unsigned char) (sid >> 16);
+	p[7] = (unsigned char) (sid >> 8);
+	p[8] = (unsigned char) sid;
+}
+
+static unsigned int h2_get32(unsigned char const *p)
+{
+	return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) |
+		((unsigned int) p[2] << 8) | p[3];
+}
+
+static int h2_send_frame(struct bstream *bstr, int type, int flags,
+			 unsigned int sid, void const *data, size_t len)
+{
+	unsigned char fh[H2_FRAME_HDRSIZE];
+	struct iovec iov[2];
+
+	h2_frame_hdr(fh, len, type, flags, sid);
+	iov[0].iov_base = fh;
+	iov[0].iov_len = sizeof(fh);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	return bstream_writev(bstr, iov, len > 0 ? 2: 1) == sizeof(fh) + len ?
+		0: -1;
+}
+
+static int h2_send_u32(struct bstream *bstr, int type, unsigned int sid,
+		       unsigned int val)
+{
+	unsigned char data[4];
+
+	data[0] = (unsigned char) (val >> 24);
+	data[1] = (unsigned char) (val >> 16);
+	data[2] = (unsigned char) (val >> 8);
+	data[3] = (unsigned char) val;
+
+	return h2_send_frame(bstr, type, 0, sid, data, sizeof(data));
+}
+
+static int h2_goaway(struct h2_conn *h2, struct bstream *bstr, int error)
+{
+	unsigned char data[8];
+
+	data[0] = (unsigned char) ((h2->last_sid >> 24) & 0x7f);
+	data[1] = (unsigned char) (h2->last_sid >> 16);
+	data[2] = (unsigned char) (h2->last_sid >> 8);
+	data[3] = (unsigned char) h2->last_sid;
+	data[4] = data[5] = data[6] = 0;
+	data[7] = (unsigned char) error;
+	h2_send_frame(bstr, H2_GOAWAY, 0, 0, data, sizeof(data));
+
+	return -1;
+}
+
+/*
+ * Sends the response HEADERS: the :status comes out of the static table,
+ * and content-length is a literal with a static name, not indexed.
+ */
+static int h2_send_headers(struct bstream *bstr, unsigned int sid, int status,
+			   long clen)
+{
+	int n;
+	unsigned char blk[32];
+
+	blk[0] = status == 200 ? 0x88: status == 404 ? 0x8d: 0x8c;
+	blk[1] = 0x0f;
+	blk[2] = 28 - 15;
+	n = snprintf((char *) blk + 4, sizeof(blk) - 4, "%ld", clen);
+	blk[3] = (unsigned char) n;
+
+	return h2_send_frame(bstr, H2_HEADERS, H2F_END_HEADERS |
+			     (clen == 0 ? H2F_END_STREAM: 0), sid, blk, 4 + n);
+}
+
+static void h2_close_stream(struct h2_conn *h2, struct h2_stream *st)
+{
+	if (st->fd != -1)
+		close(st->fd);
+	free(st);
+	h2->nstreams--;
+}
+
+static int h2_open_stream(struct h2_conn *h2, struct bstream *bstr,
+			  unsigned int sid, char const *method,
+			  char const *doc)
+{
+	int fd = -1;
+	off_t size;
+	struct per_cpu_ctx *pcx;
+	struct h2_stream *st, **pst;
+	struct stat stbuf;
+
+	if (h2->nstreams >= H2_MAX_STREAMS)
+		return h2_send_u32(bstr, H2_RST_STREAM, sid, H2E_REFUSED_STREAM);
+
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->reqs++;
+	pcx->h2streams++;
+	pcx->txcalls += bstr->ncalls;
+	pthread_mutex_unlock(&pcx->mtx);
+	bstr->ncalls = 0;
+
+	if (strcmp(method, "GET") != 0 || *doc == '\0')
+		return h2_send_headers(bstr, sid, 400, 0);
+	if (strncmp(doc, "/mem-", 5) == 0)
+		size = atol(doc + 5);
+	else if ((fd = open_doc(doc, &stbuf)) == -1)
+		return h2_send_headers(bstr, sid, 404, 0);
+	else {
+		size = stbuf.st_size;
+		if (hoff_path != NULL)
+			hot_doc_hit(pcx, doc);
+	}
+	if (h2_send_headers(bstr, sid, 200, (long) size) < 0) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if (size == 0) {
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+
+	st = (struct h2_stream *) xmalloc(sizeof(struct h2_stream));
+	st->next = NULL;
+	st->id = sid;
+	st->fd = fd;
+	st->off = 0;
+	st->size = size;
+	st->window = h2->init_window;
+	for (pst = &h2->streams; *pst != NULL; pst = &(*pst)->next);
+	*pst = st;
+	h2->nstreams++;
+
+	return 0;
+}
+
+static int h2_headers_done(struct h2_conn *h2, struct bstream *bstr)
+{
+	char method[16], doc[1024];
+
+	if (hpack_decode(h2, h2->hblock, h2->hblen, method, sizeof(method),
+			 doc, sizeof(doc)) != 0)
+		return h2_goaway(h2, bstr, H2E_COMPRESSION_ERROR);
+	h2->hblen = 0;
+	h2->hbsid = 0;
+	if (h2->goaway)
+		return 0;
+
+	return h2_open_stream(h2, bstr, h2->last_sid, method, doc);
+}
+
+static int h2_add_hblock(struct h2_conn *h2, unsigned char const *frag,
+			 size_t n)
+{
+	if (h2->hblen + n > H2_MAX_HBLOCK)
+		return -1;
+	if (h2->hblen + n > h2->hbsize) {
+		h2->hbsize = h2->hblen + n;
+		h2->hblock = (unsigned char *) xrealloc(h2->hblock, h2->hbsize);
+	}
+	memcpy(h2->hblock + h2->hblen, frag, n);
+	h2->hblen += n;
+
+	return 0;
+}
+
+static int h2_settings(struct h2_conn *h2, struct bstream *bstr,
+		       unsigned char const *p, size_t len, int flags)
+{
+	unsigned int id, val;
+	long delta;
+	struct h2_stream *st;
+
+	if (flags & H2F_ACK)
+		return 0;
+	if (len % 6 != 0)
+		return h2_goaway(h2, bstr, H2E_FRAME_SIZE_ERROR);
+	for (; len > 0; p += 6, len -= 6) {
+		id = ((unsigned int) p[0] << 8) | p[1];
+		val = h2_get32(p + 2);
+		if (id == H2S_INITIAL_WINDOW_SIZE) {
+			if (val > 0x7fffffff)
+				return h2_goaway(h2, bstr, H2E_FLOW_CONTROL_ERROR);
+			delta = (long) val - h2->init_window;
+			h2->init_window = val;
+			for (st = h2->streams; st != NULL; st = st->next)
+				st->window += delta;
+		} else if (id == H2S_MAX_FRAME_SIZE) {
+			if (val < H2_DEF_FRAMESIZE || val > 0xffffff)
+				return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+			h2->max_frame = val;
+		}
+	}
+
+	return h2_send_frame(bstr, H2_SETTINGS, H2F_ACK, 0, NULL, 0);
+}
+
+/*
+ * Reads and handles one frame. With @wait clear, it does not block unless
+ * a frame has already started to come in, and returns 0 if none has.
+ * Returns 1 after handling a frame, -1 if the connection has to go.
+ */
+static int h2_input(struct h2_conn *h2, struct bstream *bstr, int wait)
+{
+	int type, flags;
+	unsigned int sid;
+	size_t len, pad = 0, skip = 0;
+	ssize_t n;
+	unsigned char fh[H2_FRAME_HDRSIZE], *p = h2->fbuf;
+	struct h2_stream *st, **pst;
+
+	if (!wait && bstr->bcnt < H2_FRAME_HDRSIZE) {
+		if ((n = bstream_refil_nowait(bstr)) == 0 ||
+		    (n < 0 && errno != EAGAIN))
+			return -1;
+		if (bstr->bcnt < H2_FRAME_HDRSIZE)
+			return 0;
+	}
+	if (bstream_read(bstr, fh, sizeof(fh)) != sizeof(fh))
+		return -1;
+	len = ((size_t) fh[0] << 16) | ((size_t) fh[1] << 8) | fh[2];
+	type = fh[3];
+	flags = fh[4];
+	sid = h2_get32(fh + 5) & 0x7fffffff;
+	if (len > H2_DEF_FRAMESIZE)
+		return h2_goaway(h2, bstr, H2E_FRAME_SIZE_ERROR);
+	if (len > 0 && bstream_read(bstr, p, len) != len)
+		return -1;
+	if (h2->hbsid != 0 && (type != H2_CONTINUATION || sid != h2->hbsid))
+		return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+
+	switch (type) {
+	case H2_DATA:
+		/*
+		 * GET only server, just give the credit back, to both the
+		 * connection and the stream (unless it is done sending), or
+		 * bodies bigger than the initial window stall.
+		 */
+		if (len > 0 &&
+		    (h2_send_u32(bstr, H2_WINDOW_UPDATE, 0, len) < 0 ||
+		     (!(flags & H2F_END_STREAM) &&
+		      h2_send_u32(bstr, H2_WINDOW_UPDATE, sid, len) < 0)))
+			return -1;
+		break;
+
+	case H2_HEADERS:
+		if (flags & H2F_PADDED) {
+			if (len < 1 || (pad = *p) >= len)
+				return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+			skip = 1;
+		}
+		if (flags & H2F_PRIORITY)
+			skip += 5;
+		if (skip + pad > len || sid == 0 || (sid & 1) == 0 ||
+		    sid <= h2->last_sid)
+			return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+		h2->last_sid = sid;
+		if (h2_add_hblock(h2, p + skip, len - skip - pad) != 0)
+			return h2_goaway(h2, bstr, H2E_ENHANCE_YOUR_CALM);
+		if (flags & H2F_END_HEADERS)
+			return h2_headers_done(h2, bstr) < 0 ? -1: 1;
+		h2->hbsid = sid;
+		break;
+
+	case H2_CONTINUATION:
+		if (sid != h2->hbsid)
+			return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+		if (h2_add_hblock(h2, p, len) != 0)
+			return h2_goaway(h2, bstr, H2E_ENHANCE_YOUR_CALM);
+		if (flags & H2F_END_HEADERS)
+			return h2_headers_done(h2, bstr) < 0 ? -1: 1;
+		break;
+
+	case H2_RST_STREAM:
+		for (pst = &h2->streams; (st = *pst) != NULL; pst = &st->next)
+			if (st->id == sid) {
+				*pst = st->next;
+				h2_close_stream(h2, st);
+				break;
+			}
+		break;
+
+	case H2_SETTINGS:
+		if (sid != 0)
+			return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+		if (h2_settings(h2, bstr, p, len, flags) < 0)
+			return -1;
+		break;
+
+	case H2_PING:
+		if (len != 8)
+			return h2_goaway(h2, bstr, H2E_FRAME_SIZE_ERROR);
+		if (!(flags & H2F_ACK) &&
+		    h2_send_frame(bstr, H2_PING, H2F_ACK, 0, p, len) < 0)
+			return -1;
+		break;
+
+	case H2_GOAWAY:
+		h2->goaway = 1;
+		break;
+
+	case H2_WINDOW_UPDATE:
+		if (len != 4)
+			return h2_goaway(h2, bstr, H2E_FRAME_SIZE_ERROR);
+		if (sid == 0)
+			h2->window += h2_get32(p) & 0x7fffffff;
+		for (st = h2->streams; sid != 0 && st != NULL; st = st->next)
+			if (st->id == sid) {
+				st->window += h2_get32(p) & 0x7fffffff;
+				break;
+			}
+		break;
+
+	case H2_PUSH_PROMISE:
+		return h2_goaway(h2, bstr, H2E_PROTOCOL_ERROR);
+	}
+
+	return 1;
+}
+
+/*
+ * One round robin pass over the streams, sending a DATA frame for each one
+ * which has flow control credit. Returns the number of frames sent.
+ */
+static int h2_send_data(struct h2_conn *h2, struct bstream *bstr)
+{
+	int nsent = 0, last;
+	size_t n;
+	unsigned long long tbytes = 0;
+	struct per_cpu_ctx *pcx;
+	struct h2_stream *st, **pst;
+	unsigned char fh[H2_FRAME_HDRSIZE];
+	struct iovec iov[2];
+
+	for (pst = &h2->streams; (st = *pst) != NULL && h2->window > 0;) {
+		if (st->window <= 0) {
+			pst = &st->next;
+			continue;
+		}
+		n = (size_t) (st->size - st->off);
+		if (n > (size_t) st->window)
+			n = (size_t) st->window;
+		if (n > (size_t) h2->window)
+			n = (size_t) h2->window;
+		if (n > h2->max_frame)
+			n = h2->max_frame;
+		if (st->fd == -1 && n > sizeof(mem_buf))
+			n = sizeof(mem_buf);
+		last = st->off + (off_t) n == st->size;
+		h2_frame_hdr(fh, n, H2_DATA, last ? H2F_END_STREAM: 0, st->id);
+		if (st->fd == -1) {
+			iov[0].iov_base = fh;
+			iov[0].iov_len = sizeof(fh);
+			iov[1].iov_base = mem_buf;
+			iov[1].iov_len = n;
+			if (bstream_writev(bstr, iov, 2) != sizeof(fh) + n)
+				return -1;
+			st->off += n;
+		} else {
+			if (bstream_send(bstr, fh, sizeof(fh), MSG_MORE) !=
+			    sizeof(fh))
+				return -1;
+			bstr->ncalls++;
+			if (sock_sendfile(bstr->fd, st->fd, &st->off, n) !=
+			    (ssize_t) n) {
+				perror("sendfile");
+				return -1;
+			}
+		}
+		st->window -= n;
+		h2->window -= n;
+		tbytes += n;
+		nsent++;
+		if (last) {
+			*pst = st->next;
+			h2_close_stream(h2, st);
+		} else
+			pst = &st->next;
+	}
+
+	pcx = GET_CPUCTX();
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->tbytes += tbytes;
+	pthread_mutex_unlock(&pcx->mtx);
+
+	return nsent;
+}
+
+static struct h2_conn *h2_conn_new(void)
+{
+	struct h2_conn *h2;
+
+	h2 = (struct h2_conn *) xmalloc(sizeof(struct h2_conn));
+	memset(h2, 0, sizeof(*h2));
+	h2->window = h2->init_window = H2_DEF_WINDOW;
+	h2->max_frame = H2_DEF_FRAMESIZE;
+	h2->dmaxsize = HPACK_TABLE_SIZE;
+	h2->dtab = (struct hpack_hdr *)
+		xmalloc(HPACK_MAX_ENTRIES * sizeof(struct hpack_hdr));
+
+	return h2;
+}
+
+static void h2_conn_free(struct h2_conn *h2)
+{
+	struct h2_stream *st;
+
+	while ((st = h2->streams) != NULL) {
+		h2->streams = st->next;
+		h2_close_stream(h2, st);
+	}
+	hpack_evict(h2, 0);
+	free(h2->dtab);
+	free(h2->hblock);
+	free(h2->fbuf);
+	free(h2);
+}
+
+/*
+ * Serves an HTTP/2 connection, whose client preface has been consumed.
+ * Like process_session(), returns 1 if the session has been parked.
+ */
+static int h2_session(struct bstream *bstr)
+{
+	int n, one = 1;
+	struct h2_conn *h2;
+	struct per_cpu_ctx *pcx;
+	unsigned char set[6] = { 0, H2S_MAX_CONCURRENT_STREAMS, 0, 0, 0,
+				 H2_MAX_STREAMS };
+
+	pcx = GET_CPUCTX();
+	if ((h2 = bstr->h2) == NULL) {
+		h2 = bstr->h2 = h2_conn_new();
+		pthread_mutex_lock(&pcx->mtx);
+		pcx->h2conns++;
+		pthread_mutex_unlock(&pcx->mtx);
+		/*
+		 * Small control frames and HEADERS must not wait on Nagle.
+		 */
+		setsockopt(bstr->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (h2_send_frame(bstr, H2_SETTINGS, 0, 0, set,
+				  sizeof(set)) < 0)
+			goto out;
+	}
+	if (h2->fbuf == NULL)
+		h2->fbuf = (unsigned char *) xmalloc(H2_DEF_FRAMESIZE);
+
+	while (!stopsvr) {
+		if (h2->streams == NULL) {
+			if (h2->goaway)
+				break;
+			if (draining && h2->hbsid == 0) {
+				h2_goaway(h2, bstr, H2E_NO_ERROR);
+				break;
+			}
+			if (parkidle && bstr->bcnt == 0 && h2->hbsid == 0) {
+				if ((n = bstream_refil_nowait(bstr)) == 0)
+					break;
+				if (n < 0 && errno == EAGAIN) {
+					free(h2->fbuf);
+					h2->fbuf = NULL;
+					if (park_session(pcx, bstr) == 0)
+						return 1;
+					bstream_getbuf(bstr);
+					h2->fbuf = (unsigned char *)
+						xmalloc(H2_DEF_FRAMESIZE);
+					if (draining || stopsvr)
+						continue;
+				}
+			}
+			if (h2_input(h2, bstr, 1) < 0)
+				break;
+			continue;
+		}
+		while ((n = h2_input(h2, bstr, 0)) > 0);
+		if (n < 0 || (n = h2_send_data(h2, bstr)) < 0)
+			break;
+		/*
+		 * Every stream is out of flow control credit, we need a
+		 * WINDOW_UPDATE to go on.
+		 */
+		if (n == 0 && h2_input(h2, bstr, 1) < 0)
+			break;
+	}
+out:
+	bstream_close(bstr);
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the session has been handed off to someone else, 0 if it
+ * has been terminated (and @bstr closed).
+ */
+static int process_session(struct bstream *bstr)
+{
+	ssize_t n;
+	int cclose, chunked;
+	size_t lsize, clen;
+	struct per_cpu_ctx *pcx;
+	char *meth, *doc, *ver, *ln, *auxptr;
+	char req[2048];
+
+	/*
+	 * This could be easily be passed from the top, but I want to test
+	 * the pthread TLS access performance, since in big projects, passing
+	 * down the pointers might make the interface ugly.
+	 */
+	pcx = GET_CPUCTX();
+
+	bstream_getbuf(bstr);
+	if (bstr->h2 != NULL)
+		return h2_session(bstr);
+	do {
+		if (parkidle && bstr->bcnt == 0) {
+			if ((n = bstream_refil_nowait(bstr)) == 0)
+				break;
+			if (n < 0 && errno == EAGAIN) {
+				if (park_session(pcx, bstr) == 0)
+					return 1;
+				if (draining || stopsvr)
+					break;
+				bstream_getbuf(bstr);
+			}
+		}
+		if ((ln = bstream_readln(bstr, &lsize)) == NULL)
+			break;
+		if (strcmp(ln, "PRI * HTTP/2.0\r") == 0) {
+			if (bstream_read(bstr, req, 8) != 8 ||
+			    memcmp(req, "\r\nSM\r\n\r\n", 8) != 0)
+				break;
+			return h2_session(bstr);
+		}
+		strncpy(req, ln, sizeof(req));
+		if ((meth = strtok_r(req, " ", &auxptr)) == NULL ||
+		    (doc = strtok_r(NULL, " ", &auxptr)) == NULL ||
+		    (ver = strtok_r(NULL, " \r", &auxptr)) == NULL ||
+		    strncmp(ver, "HTTP/", 5) != 0 || strlen(ver) > 8 ||
+		    strcasecmp(meth, "GET") != 0) {
+		bad_request:
+			bstream_printf(bstr,
+				       "HTTP/1.1 400 Bad request\r\n"
+				       "Connection: close\r\n"
+				       "Content-Length: 0\r\n"
+				       "\r\n");
+			break;
+		}
+		/*
+		 * The TX calls made so far (the previous response) are folded
+		 * in per request, so that the long lived sessions show up in
+		 * the totals before they get closed.
+		 */
+		pthread_mutex_lock(&pcx->mtx);
+		pcx->reqs++;
+		pcx->txcalls += bstr->ncalls;
+		pthread_mutex_unlock(&pcx->mtx);
+		bstr->ncalls = 0;
+		cclose = strcasecmp(ver, "HTTP/1.1") != 0;
+		for (clen = 0, chunked = 0;;) {
+			if ((ln = bstream_readln(bstr, &lsize)) == NULL)
+				break;
+			if (strcmp(ln, "\r") == 0)
+				break;
+			if (strncasecmp(ln, "Content-Length:", 15) == 0) {
+				for (auxptr = ln + 15; *auxptr == ' '; auxptr++);
+				clen = atoi(auxptr);
+			} else if (strncasecmp(ln, "Connection:", 11) == 0) {
+				for (auxptr = ln + 11; *auxptr == ' '; auxptr++);
+				cclose = strncasecmp(auxptr, "close", 5) == 0;
+			} else if (strncasecmp(ln, "Transfer-Encoding:", 18) == 0) {
+				for (auxptr = ln + 18; *auxptr == ' '; auxptr++);
+				chunked = strncasecmp(auxptr, "chunked", 7) == 0;
+			}
+		}
+		/*
+		 * Sorry, really stupid HTTP server here. Neither GET payload nor
+		 * chunked encoding allowed.
+		 */
+		if (clen || chunked)
+			goto bad_request;
+		/*
+		 * The listener has been handed off to a new server, which is
+		 * where the client should go next.
+		 */
+		if (draining)
+			cclose = 1;
+		if (send_url(bstr, doc, ver, cclose ? "close": "keep-alive") > 0)
+			return 1;
+	} while (!stopsvr && !cclose);
+	bstream_close(bstr);
+
+	return 0;
+}
+
+#define HAS_WORK(pcx) ((pcx)->qcount > 0 || (pcx)->txhead != NULL)
+
+/*
+ * Called with @pcx->mtx held, spins waiting for work for up to the current
+ * spin budget, with the lock released. The budget doubles when the spin
+ * pays off and halves when it does not, within [SPIN_MIN_NS, --spin-us],
+ * as the kernel halt-polling does, so that spinning fades out at low load.
+ * One thread per CPU spins at a time, and it yields rather than pausing,
+ * since the producers (acceptor and I/O threads) share the CPU with it.
+ */
+static void spin_for_work(struct per_cpu_ctx *pcx)
+{
+	unsigned long long ts, tnow;
+
+	pcx->nspin++;
+	pthread_mutex_unlock(&pcx->mtx);
+	ts = tnow = get_nstime();
+	while (!stopsvr && tnow - ts < pcx->spinns &&
+	       __atomic_load_n(&pcx->qcount, __ATOMIC_RELAXED) == 0 &&
+	       __atomic_load_n(&pcx->txhead, __ATOMIC_RELAXED) == NULL) {
+		sched_yield();
+		tnow = get_nstime();
+	}
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->nspin--;
+	pcx->spintime += tnow - ts;
+	if (HAS_WORK(pcx)) {
+		pcx->spinhits++;
+		if ((pcx->spinns *= 2) > spinmax)
+			pcx->spinns = spinmax;
+	} else if ((pcx->spinns /= 2) < SPIN_MIN_NS)
+		pcx->spinns = SPIN_MIN_NS;
+}
+
+/*
+ * Moves the oldest overflowed session into the slot just freed in the
+ * queue. Overflowed sessions go ahead of the acceptor, which keeps waiting
+ * until the overflow list is empty. Called with the CPU lock held.
+ */
+static void queue_overflow_pop(struct per_cpu_ctx *pcx)
+{
+	struct bstream *bstr = pcx->ovhead;
+
+	if ((pcx->ovhead = bstr->pnext) == NULL)
+		pcx->ovtail = NULL;
+	bstr->pnext = NULL;
+	pcx->qcount++;
+	pcx->squeue[pcx->wqpos] = bstr;
+	pcx->sqtime[pcx->wqpos] = get_nstime();
+	pcx->wqpos = (pcx->wqpos + 1) % pcx->qsize;
+}
+
+/*
+ * Picks either a session or a TX stream chunk to work on. When both are
+ * pending, the two alternate, so that neither small requests queue behind
+ * big transfers, nor big transfers starve under request load.
+ */
+static int dequeue_work(struct per_cpu_ctx *pcx, struct bstream **pbstr,
+			struct tx_stream **ptxs)
+{
+	int error = -1;
+	unsigned long long lat;
+
+	*pbstr = NULL;
+	*ptxs = NULL;
+	pthread_mutex_lock(&pcx->mtx);
+	if (spinmax > 0 && !stopsvr && !HAS_WORK(pcx) && pcx->nspin == 0)
+		spin_for_work(pcx);
+	while (!stopsvr && !HAS_WORK(pcx)) {
+		pcx->sleeps++;
+		pthread_cond_wait(&pcx->cnd, &pcx->mtx);
+	}
+	if (!stopsvr && pcx->txhead != NULL &&
+	    (pcx->qcount == 0 || pcx->txturn)) {
+		*ptxs = pcx->txhead;
+		if ((pcx->txhead = pcx->txhead->next) == NULL)
+			pcx->txtail = NULL;
+		pcx->txchunks++;
+		pcx->txturn = 0;
+		error = 0;
+	} else if (pcx->qcount > 0) {
+		*pbstr = pcx->squeue[pcx->rqpos];
+		lat = get_nstime() - pcx->sqtime[pcx->rqpos];
+		pcx->qlat_ns += lat;
+		pcx->qlat_cnt++;
+		if (lat > pcx->qlat_max)
+			pcx->qlat_max = lat;
+		pcx->rqpos = (pcx->rqpos + 1) % pcx->qsize;
+		pcx->qcount--;
+		pcx->txturn = 1;
+		if (pcx->ovhead != NULL)
+			queue_overflow_pop(pcx);
+		else if (pcx->qwait > 0)
+			pthread_cond_signal(&pcx->dqcnd);
+		error = 0;
+	}
+	pthread_mutex_unlock(&pcx->mtx);
+
+	return error;
+}
+
+static int queue_client_session(struct per_cpu_ctx *pcx, struct bstream *bstr)
+{
+	int error = -1;
+
+	pthread_mutex_lock(&pcx->mtx);
+	while (!stopsvr && pcx->qcount >= pcx->qsize) {
+		pcx->qwait++;
+		pthread_cond_wait(&pcx->dqcnd, &pcx->mtx);
+		pcx->qwait--;
+	}
+	if (pcx->qcount < pcx->qsize) {
+		pcx->qcount++;
+		pcx->squeue[pcx->wqpos] = bstr;
+		pcx->sqtime[pcx->wqpos] = get_nstime();
+		pcx->wqpos = (pcx->wqpos + 1) % pcx->qsize;
+		pthread_cond_signal(&pcx->cnd);
+		error = 0;
+	}
+	pthread_mutex_unlock(&pcx->mtx);
+
+	return error;
+}
+
+/*
+ * Like queue_client_session(), for the I/O pool threads, which must not
+ * stall behind a full CPU queue. When the queue is full, the session is
+ * appended to the CPU overflow list instead (linked through @pnext, as the
+ * session is not parked), from where the service threads pull it as they
+ * free queue slots.
+ */
+static void requeue_client_session(struct per_cpu_ctx *pcx,
+				   struct bstream *bstr)
+{
+	pthread_mutex_lock(&pcx->mtx);
+	if (pcx->qcount < pcx->qsize) {
+		pcx->qcount++;
+		pcx->squeue[pcx->wqpos] = bstr;
+		pcx->sqtime[pcx->wqpos] = get_nstime();
+		pcx->wqpos = (pcx->wqpos + 1) % pcx->qsize;
+	} else {
+		bstr->pnext = NULL;
+		if (pcx->ovtail != NULL)
+			pcx->ovtail->pnext = bstr;
+		else
+			pcx->ovhead = bstr;
+		pcx->ovtail = bstr;
+		pcx->qovfl++;
+	}
+	pthread_cond_signal(&pcx->cnd);
+	pthread_mutex_unlock(&pcx->mtx);
+}
+
+static pid_t gettid(void)
+{
+	return (pid_t) syscall(SYS_gettid);
+}
+
+static struct thread_ctx *setup_thread_ctx(int cpu)
+{
+	struct thread_ctx *tcx;
+	cpu_set_t cset;
+
+	CPU_ZERO(&cset);
+	CPU_SET(cpu_topo[cpu].cpu, &cset);
+	xsched_setaffinity(gettid(), sizeof(cset), &cset);
+
+	tcx = (struct thread_ctx *) xmalloc(sizeof(struct thread_ctx));
+	tcx->cpu = cpu;
+	tcx->cur = NULL;
+
+	xpthread_setspecific(thtls_key, tcx);
+
+	return tcx;
+}
+
+static void *service_thproc(void *data)
+{
+	int error, cpu = (int) (long) data;
+	struct per_cpu_ctx *pcx;
+	struct thread_ctx *tcx;
+	struct bstream *bstr;
+	struct tx_stream *txs;
+
+	pcx = thcpu_ctx + cpu;
+	tcx = setup_thread_ctx(cpu);
+
+	while (dequeue_work(pcx, &bstr, &txs) == 0) {
+		if (txs != NULL) {
+			if ((error = tx_stream_chunk(txs)) > 0) {
+				queue_tx_stream(pcx, txs);
+				continue;
+			}
+			if ((bstr = end_tx_stream(pcx, txs, error)) == NULL)
+				continue;
+		}
+		process_session(bstr);
+	}
+
+	return NULL;
+}
+
+static struct cold_req *dequeue_cold_req(struct io_pool *iop)
+{
+	struct cold_req *crq;
+
+	pthread_mutex_lock(&iop->mtx);
+	while (!stopsvr && iop->head == NULL)
+		pthread_cond_wait(&iop->cnd, &iop->mtx);
+	if ((crq = iop->head) != NULL &&
+	    (iop->head = crq->next) == NULL)
+		iop->tail = NULL;
+	pthread_mutex_unlock(&iop->mtx);
+
+	return crq;
+}
+
+static void *io_thproc(void *data)
+{
+	int error;
+	unsigned long long delay;
+	struct io_pool *iop = (struct io_pool *) data;
+	struct per_cpu_ctx *pcx;
+	struct thread_ctx *tcx;
+	struct cold_req *crq;
+	cpu_set_t cset;
+	int i;
+
+	/*
+	 * Kept on the node CPUs, so that the page cache pages read in on
+	 * behalf of the node sessions get allocated there.
+	 */
+	CPU_ZERO(&cset);
+	for (i = 0; i < num_cpus; i++)
+		if (cpu_topo[i].node == iop->node)
+			CPU_SET(cpu_topo[i].cpu, &cset);
+	if (CPU_COUNT(&cset) > 0)
+		xsched_setaffinity(gettid(), sizeof(cset), &cset);
+
+	tcx = (struct thread_ctx *) xmalloc(sizeof(struct thread_ctx));
+	tcx->cur = NULL;
+	xpthread_setspecific(thtls_key, tcx);
+
+	while ((crq = dequeue_cold_req(iop)) != NULL) {
+		/*
+		 * The I/O thread acts on behalf of the CPU owning the session,
+		 * so that the accounting done in the send path lands there.
+		 */
+		tcx->cpu = crq->cpu;
+		pcx = thcpu_ctx + crq->cpu;
+
+		posix_fadvise(crq->fd, 0, crq->stb.st_size, POSIX_FADV_WILLNEED);
+		readahead(crq->fd, 0, crq->stb.st_size);
+		error = send_file(crq->bstr, crq->fd, &crq->stb, crq->ver,
+				  crq->cclose ? "close": "keep-alive");
+		delay = get_nstime() - crq->tqueue;
+
+		pthread_mutex_lock(&pcx->mtx);
+		pcx->cold_reqs++;
+		pcx->cold_ns += delay;
+		if (delay > pcx->cold_maxns)
+			pcx->cold_maxns = delay;
+		if (error <= 0) {
+			pcx->txcalls += crq->bstr->ncalls;
+			crq->bstr->ncalls = 0;
+		}
+		pthread_mutex_unlock(&pcx->mtx);
+
+		if (error <= 0) {
+			if (crq->cclose || stopsvr)
+				bstream_close(crq->bstr);
+			else
+				requeue_client_session(pcx, crq->bstr);
+		}
+		free(crq);
+	}
+
+	return NULL;
+}
+
+static void resume_parked(struct per_cpu_ctx *pcx)
+{
+	int i, n;
+	struct bstream *bstr;
+	struct epoll_event evs[MAX_EPOLL_EVENTS];
+
+	n = epoll_wait(pcx->epfd, evs, MAX_EPOLL_EVENTS, 0);
+	pthread_mutex_lock(&pcx->mtx);
+	for (i = 0; i < n; i++)
+		park_unlink(pcx, (struct bstream *) evs[i].data.ptr);
+	pthread_mutex_unlock(&pcx->mtx);
+	for (i = 0; i < n; i++) {
+		bstr = (struct bstream *) evs[i].data.ptr;
+		if (queue_client_session(pcx, bstr) < 0)
+			bstream_close(bstr);
+	}
+}
+
+/*
+ * Parked sessions are idle, so a drain does not need to wait for them.
+ * Shutting down their read side makes them ready, and the acceptor then
+ * resumes them as usual, which lets the session code see the EOF (or,
+ * for HTTP/2, the drain) and close them from their own CPU context.
+ */
+static void shut_parked(struct per_cpu_ctx *pcx)
+{
+	struct bstream *bstr;
+
+	pthread_mutex_lock(&pcx->mtx);
+	for (bstr = pcx->parked; bstr != NULL; bstr = bstr->pnext)
+		shutdown(bstr->fd, SHUT_RD);
+	pthread_mutex_unlock(&pcx->mtx);
+}
+
+/*
+ * Frees the sessions still parked once the CPU threads are gone, and
+ * nobody can resume them anymore.
+ */
+static void close_parked(struct per_cpu_ctx *pcx)
+{
+	struct bstream *bstr;
+
+	while ((bstr = pcx->parked) != NULL) {
+		park_unlink(pcx, bstr);
+		pcx->txcalls += bstr->ncalls;
+		pcx->closes++;
+		bstream_free(bstr);
+	}
+}
+
+/*
+ * Closes the sessions still sitting in the CPU queue, or in its overflow
+ * list, the TX streams still waiting for a service thread, and the closed
+ * sessions lingering on zerocopy completions, once the service threads
+ * are gone.
+ */
+static void close_queued(struct per_cpu_ctx *pcx)
+{
+	struct bstream *bstr;
+	struct tx_stream *txs;
+
+	for (; pcx->qcount > 0; pcx->qcount--) {
+		bstr = pcx->squeue[pcx->rqpos];
+		pcx->rqpos = (pcx->rqpos + 1) % pcx->qsize;
+		pcx->txcalls += bstr->ncalls;
+		pcx->closes++;
+		bstream_free(bstr);
+	}
+	while ((bstr = pcx->ovhead) != NULL) {
+		pcx->ovhead = bstr->pnext;
+		pcx->txcalls += bstr->ncalls;
+		pcx->closes++;
+		bstream_free(bstr);
+	}
+	pcx->ovtail = NULL;
+	while ((txs = pcx->txhead) != NULL) {
+		pcx->txhead = txs->next;
+		if (txs->addr != NULL)
+			munmap(txs->addr, txs->size);
+		if (txs->fd != -1)
+			close(txs->fd);
+		pcx->tbytes += txs->off;
+		pcx->txcalls += txs->bstr->ncalls;
+		pcx->closes++;
+		bstream_free(txs->bstr);
+		free(txs);
+	}
+	pcx->txtail = NULL;
+	while ((bstr = pcx->zclinger) != NULL) {
+		pcx->zclinger = bstr->pnext;
+		bstream_free(bstr);
+	}
+}
+
+static int accept_session(struct per_cpu_ctx *pcx, struct sockaddr_in *caddr)
+{
+	int cfd;
+	socklen_t alen;
+	struct pollfd pfds[3];
+
+	for (;;) {
+		pfds[0].fd = draining ? -1: svrfd;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		pfds[1].fd = sh_pipe[0];
+		pfds[1].events = POLLIN;
+		pfds[1].revents = 0;
+		pfds[2].fd = pcx->epfd;
+		pfds[2].events = POLLIN;
+		pfds[2].revents = 0;
+		if (poll(pfds, parkidle ? 3: 2, -1) <= 0 ||
+		    pfds[1].revents & POLLIN)
+			break;
+		if (pfds[2].revents & POLLIN)
+			resume_parked(pcx);
+		if (pfds[0].revents & POLLIN && !draining) {
+			alen = sizeof(*caddr);
+			if ((cfd = accept(svrfd, (struct sockaddr *) caddr,
+					  &alen)) == -1) {
+				if (errno != EAGAIN) {
+					perror("accept");
+					break;
+				}
+				continue;
+			}
+
+			return cfd;
+		}
+	}
+
+	return -1;
+}
+
+static struct bstream *open_session(struct per_cpu_ctx *pcx, int cfd)
+{
+	int one = 1, bpoll = 0;
+	struct bstream *bstr;
+	struct linger ling = { 0, 0 };
+
+	setsockopt(cfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+	/*
+	 * Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN,
+	 * hence the accounting of the sockets where it did stick.
+	 */
+	if (busypoll > 0 &&
+	    setsockopt(cfd, SOL_SOCKET, SO_BUSY_POLL, &busypoll,
+		       sizeof(busypoll)) == 0 &&
+	    (!prefbusypoll ||
+	     setsockopt(cfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+			sizeof(one)) == 0))
+		bpoll = 1;
+
+	pthread_mutex_lock(&pcx->mtx);
+	pcx->conns++;
+	pcx->bpsocks += bpoll;
+	pthread_mutex_unlock(&pcx->mtx);
+
+	bstr = bstream_open(cfd);
+	if (txmode == TX_ZEROCOPY)
+		bstr->zc = setsockopt(cfd, SOL_SOCKET, SO_ZEROCOPY, &one,
+				      sizeof(one)) == 0;
+
+	return bstr;
+}
+
+static void *acceptor_thproc(void *data)
+{
+	int cfd, cpu = (int) (long) data;
+	struct per_cpu_ctx *pcx;
+	struct thread_ctx *tcx;
+	struct bstream *bstr;
+	struct sockaddr_in caddr;
+
+	pcx = thcpu_ctx + cpu;
+	tcx = setup_thread_ctx(cpu);
+
+	while (!stopsvr) {
+		if ((cfd = accept_session(pcx, &caddr)) < 0)
+			break;
+		bstr = open_session(pcx, cfd);
+		if (queue_client_session(pcx, bstr) < 0)
+			bstream_close(bstr);
+	}
+
+	return NULL;
+}
+
+static void coro_main(struct coro *co)
+{
+	process_session(co->bstr);
+	co->dead = 1;
+	coro_jump(&co->ctx, &GET_CPUCTX()->cosched);
+}
+
+#if !defined(__x86_64__)
+static void coro_start(void)
+{
+	coro_main(xget_thread_ctx()->cur);
+}
+#endif
+
+static void coro_init(struct coro *co)
+{
+#if defined(__x86_64__)
+	void **sp;
+
+	sp = (void **) ((char *) co->stk + pgsize + costksize);
+	*--sp = (void *) coro_entry;
+	*--sp = NULL;			/* %rbp */
+	*--sp = NULL;			/* %rbx */
+	*--sp = co;			/* %r12 */
+	*--sp = (void *) coro_main;	/* %r13 */
+	*--sp = NULL;			/* %r14 */
+	*--sp = NULL;			/* %r15 */
+	co->ctx.sp = sp;
+#else
+	getcontext(&co->ctx.uc);
+	co->ctx.uc.uc_stack.ss_sp = (char *) co->stk + pgsize;
+	co->ctx.uc.uc_stack.ss_size = costksize;
+	co->ctx.uc.uc_link = NULL;
+	makecontext(&co->ctx.uc, coro_start, 0);
+#endif
+}
+
+static void coro_spawn(struct per_cpu_ctx *pcx, struct bstream *bstr)
+{
+	struct coro *co;
+
+	if ((co = pcx->cofree) != NULL) {
+		pcx->cofree = co->next;
+		pcx->ncofree--;
+	} else {
+		co = (struct coro *) xmalloc(sizeof(struct coro));
+		co->stk = xmmap(NULL, pgsize + costksize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (mprotect(co->stk, pgsize, PROT_NONE) != 0) {
+			perror("Setting up stack guard page");
+			exit(1);
+		}
+		pcx->cocreates++;
+	}
+	co->bstr = bstr;
+	co->dead = co->polled = 0;
+	coro_init(co);
+	if (++pcx->colive > pcx->comaxlive)
+		pcx->comaxlive = pcx->colive;
+
+	coro_ready(pcx, co);
+}
+
+static void coro_free(struct per_cpu_ctx *pcx, struct coro *co)
+{
+	pcx->colive--;
+	if (pcx->ncofree < CORO_POOL_MAX) {
+		co->next = pcx->cofree;
+		pcx->cofree = co;
+		pcx->ncofree++;
+	} else {
+		munmap(co->stk, pgsize + costksize);
+		free(co);
+	}
+}
+
+static void coro_accept(struct per_cpu_ctx *pcx)
+{
+	int i, cfd;
+
+	/*
+	 * Bounded, so that with EPOLLEXCLUSIVE wakeups a connection burst
+	 * still gets spread over the CPUs.
+	 */
+	for (i = 0; i < MAX_EPOLL_EVENTS && !draining; i++) {
+		if ((cfd = accept4(svrfd, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("accept");
+			break;
+		}
+		coro_spawn(pcx, open_session(pcx, cfd));
+	}
+}
+
+/*
+ * The --coro mode CPU thread. Runs the ready coroutines, each one until it
+ * blocks on its socket or terminates, and then collects from epoll new
+ * connections and sockets which became ready. Coroutines made ready while
+ * running the current batch wait for the next round, so that yielding ones
+ * do not starve the epoll set.
+ */
+static void *coro_thproc(void *data)
+{
+	int i, n, cpu = (int) (long) data;
+	struct per_cpu_ctx *pcx;
+	struct thread_ctx *tcx;
+	struct coro *co, *next;
+	struct epoll_event ev, evs[MAX_EPOLL_EVENTS];
+
+	pcx = thcpu_ctx + cpu;
+	tcx = setup_thread_ctx(cpu);
+
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(pcx->epfd, EPOLL_CTL_ADD, svrfd, &ev) != 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = sh_pipe;
+	if (epoll_ctl(pcx->epfd, EPOLL_CTL_ADD, sh_pipe[0], &ev) != 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	while (!stopsvr) {
+		co = pcx->rqhead;
+		pcx->rqhead = pcx->rqtail = NULL;
+		for (; co != NULL; co = next) {
+			next = co->next;
+			tcx->cur = co;
+			pcx->coswitches++;
+			coro_jump(&pcx->cosched, &co->ctx);
+			tcx->cur = NULL;
+			if (co->dead)
+				coro_free(pcx, co);
+		}
+		if ((n = epoll_wait(pcx->epfd, evs, MAX_EPOLL_EVENTS,
+				    pcx->rqhead != NULL ? 0: -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr == NULL)
+				coro_accept(pcx);
+			else if (evs[i].data.ptr != sh_pipe)
+				coro_ready(pcx, (struct coro *) evs[i].data.ptr);
+		}
+	}
+
+	return NULL;
+}
+
+static void thtls_dtor(void *data)
+{
+	free(data);
+}
+
+static int cpu_node(int cpu)
+{
+	int node = 0;
+	char path[128];
+	DIR *dir;
+	struct dirent *dent;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+	while ((dent = readdir(dir)) != NULL)
+		if (sscanf(dent->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+
+	return node;
+}
+
+static int read_cpu_int(int cpu, char const *name, int defval)
+{
+	int val;
+	char path[256];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s",
+		 cpu, name);
+	if ((file = fopen(path, "r")) == NULL)
+		return defval;
+	if (fscanf(file, "%d", &val) != 1)
+		val = defval;
+	fclose(file);
+
+	return val;
+}
+
+/*
+ * The last level cache is the highest level one listed for the CPU, and
+ * the first CPU of its shared_cpu_list names the domain. Without cache
+ * information, the package is taken as LLC domain.
+ */
+static int cpu_llc(int cpu, int pkg)
+{
+	int i, level, maxlevel = 0, llc = -1 - pkg;
+	char name[64];
+
+	for (i = 0; i < 16; i++) {
+		snprintf(name, sizeof(name), "cache/index%d/level", i);
+		if ((level = read_cpu_int(cpu, name, -1)) < 0)
+			break;
+		if (level < maxlevel)
+			continue;
+		snprintf(name, sizeof(name), "cache/index%d/shared_cpu_list", i);
+		llc = read_cpu_int(cpu, name, llc);
+		maxlevel = level;
+	}
+
+	return llc;
+}
+
+/*
+ * Parses a Linux CPU list ("0-3,8,10-11") into @cset.
+ */
+static int parse_cpu_list(char const *str, cpu_set_t *cset)
+{
+	int first, last, n;
+
+	CPU_ZERO(cset);
+	while (*str != '\0') {
+		if (sscanf(str, "%d%n", &first, &n) != 1)
+			return -1;
+		str += n;
+		last = first;
+		if (*str == '-') {
+			if (sscanf(str + 1, "%d%n", &last, &n) != 1)
+				return -1;
+			str += n + 1;
+		}
+		if (first < 0 || last >= CPU_SETSIZE || first > last)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, cset);
+		if (*str == ',')
+			str++;
+		else if (*str != '\0')
+			return -1;
+	}
+
+	return 0;
+}
+
+static int cpu_topo_cmp(void const *a, void const *b)
+{
+	struct cpu_topo const *ta = (struct cpu_topo const *) a,
+		*tb = (struct cpu_topo const *) b;
+
+	if (ta->node != tb->node)
+		return ta->node - tb->node;
+	if (ta->pkg != tb->pkg)
+		return ta->pkg - tb->pkg;
+	if (ta->llc != tb->llc)
+		return ta->llc - tb->llc;
+	if (ta->core != tb->core)
+		return ta->core - tb->core;
+
+	return ta->cpu - tb->cpu;
+}
+
+/*
+ * Builds cpu_topo out of the CPUs in @cset, dropping the SMT siblings
+ * other than the first of each core if @nosmt is set. The result is sorted
+ * by node, package, LLC and core, so that neighbour contexts share as much
+ * of the cache hierarchy as possible. Returns the number of CPUs.
+ */
+static int load_topology(cpu_set_t const *cset, int nosmt)
+{
+	int i, n = 0;
+	struct cpu_topo *ct;
+
+	cpu_topo = (struct cpu_topo *)
+		xmalloc((CPU_COUNT(cset) + 1) * sizeof(struct cpu_topo));
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, cset))
+			continue;
+		ct = cpu_topo + n;
+		ct->cpu = i;
+		ct->node = cpu_node(i);
+		ct->pkg = read_cpu_int(i, "topology/physical_package_id", 0);
+		ct->core = read_cpu_int(i, "topology/core_id", i);
+		ct->llc = cpu_llc(i, ct->pkg);
+		ct->smt = read_cpu_int(i, "topology/thread_siblings_list", i) != i;
+		if (!nosmt || !ct->smt)
+			n++;
+	}
+	qsort(cpu_topo, n, sizeof(struct cpu_topo), cpu_topo_cmp);
+
+	return n;
+}
+
+static int count_distinct(int ncpus, int what)
+{
+	int i, j, n = 0, vi, vj;
+
+	for (i = 0; i < ncpus; i++) {
+		vi = what == 0 ? cpu_topo[i].node: what == 1 ? cpu_topo[i].llc:
+			cpu_topo[i].pkg * 65536 + cpu_topo[i].core;
+		for (j = 0; j < i; j++) {
+			vj = what == 0 ? cpu_topo[j].node:
+				what == 1 ? cpu_topo[j].llc:
+				cpu_topo[j].pkg * 65536 + cpu_topo[j].core;
+			if (vi == vj)
+				break;
+		}
+		if (j == i)
+			n++;
+	}
+
+	return n;
+}
+
+static void init_io_pool(struct io_pool *iop, int node, int nthreads)
+{
+	int i;
+
+	memset(iop, 0, sizeof(*iop));
+	xpthread_mutex_init(&iop->mtx, NULL);
+	xpthread_cond_init(&iop->cnd, NULL);
+
+	iop->node = node;
+	iop->nthreads = nthreads;
+	iop->threads = (pthread_t *) xmalloc(nthreads * sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++)
+		xpthread_create(iop->threads + i, &def_thattr, io_thproc, iop);
+}
+
+struct ctx_init {
+	int cpu, nthreads, qsize;
+};
+
+/*
+ * Runs on the context CPU, so that the context, its queues and its epoll
+ * set are first touched, and hence allocated, on the CPU local node. The
+ * context threads then keep their own allocations local as well.
+ */
+static void *ctx_init_thproc(void *data)
+{
+	struct ctx_init *cin = (struct ctx_init *) data;
+	int cpu = cin->cpu, nthreads = cin->nthreads, qsize = cin->qsize;
+	struct per_cpu_ctx *pcx = thcpu_ctx + cpu;
+
+	setup_thread_ctx(cpu);
+
+	memset(pcx, 0, sizeof(*pcx));
+	xpthread_mutex_init(&pcx->mtx, NULL);
+	xpthread_cond_init(&pcx->cnd, NULL);
+	xpthread_cond_init(&pcx->dqcnd, NULL);
+
+	pcx->nthreads = nthreads + 1;
+	pcx->threads = (pthread_t *) xmalloc(pcx->nthreads * sizeof(pthread_t));
+
+	pcx->node = cpu_topo[cpu].node;
+	if (pcx->node >= num_nodes)
+		pcx->node = 0;
+
+	pcx->qsize = qsize;
+	pcx->squeue = (struct bstream **) xmalloc(qsize * sizeof(struct bstream *));
+	pcx->sqtime = (unsigned long long *)
+		xmalloc(qsize * sizeof(unsigned long long));
+	pcx->spinns = spinmax;
+
+	pcx->epfd = -1;
+	if ((parkidle || coromode) && (pcx->epfd = epoll_create1(0)) == -1) {
+		perror("Creating epoll fd");
+		exit(1);
+	}
+	pcx->bfcap = 2 * nthreads;
+	if (coromode) {
+		pcx->nthreads = 1;
+		pcx->bfcap = CORO_POOL_MAX;
+	}
 
-	return 0;
+	return NULL;
 }
 
-static int dequeue_client_session(struct per_cpu_ctx *pcx)
+static void init_per_cpu_ctx(struct per_cpu_ctx *pcx, int cpu, int nthreads,
+			     int qsize)
 {
-	int cfd = -1;
+	int i;
+	pthread_t thid;
+	struct ctx_init cin;
 
-	pthread_mutex_lock(&pcx->mtx);
-	while (!stopsvr && pcx->qcount == 0)
-		pthread_cond_wait(&pcx->cnd, &pcx->mtx);
-	if (pcx->qcount > 0) {
-		cfd = pcx->squeue[pcx->rqpos];
-		pcx->rqpos = (pcx->rqpos + 1) % pcx->qsize;
-		pcx->qcount--;
-		if (pcx->qwait > 0)
-			pthread_cond_signal(&pcx->dqcnd);
+	cin.cpu = cpu;
+	cin.nthreads = nthreads;
+	cin.qsize = qsize;
+	xpthread_create(&thid, &def_thattr, ctx_init_thproc, &cin);
+	pthread_join(thid, NULL);
+
+	if (coromode) {
+		xpthread_create(pcx->threads, &def_thattr, coro_thproc,
+				(void *) (long) cpu);
+		return;
 	}
-	pthread_mutex_unlock(&pcx->mtx);
+	for (i = 0; i < nthreads; i++)
+		xpthread_create(pcx->threads + i, &def_thattr, service_thproc,
+				(void *) (long) cpu);
 
-	return cfd;
+	xpthread_create(pcx->threads + i, &def_thattr, acceptor_thproc,
+			(void *) (long) cpu);
 }
 
-static void queue_client_session(struct per_cpu_ctx *pcx, int cfd)
+static void usage(char const *prg)
 {
-	pthread_mutex_lock(&pcx->mtx);
-	while (!stopsvr && pcx->qcount >= pcx->qsize) {
-		pcx->qwait++;
-		pthread_cond_wait(&pcx->dqcnd, &pcx->mtx);
-		pcx->qwait--;
-	}
-	if (pcx->qcount < pcx->qsize) {
-		pcx->qcount++;
-		pcx->squeue[pcx->wqpos] = cfd;
-		pcx->wqpos = (pcx->wqpos + 1) % pcx->qsize;
-		pthread_cond_signal(&pcx->cnd);
-	}
-	pthread_mutex_unlock(&pcx->mtx);
+	fprintf(stderr,
+		"Use: %s [-h,--help] [-p,--port PORTNO] [-L,--listen LISBKLOG]\n"
+		"\t[-r,--root ROOTFS] [-S,--sendfile] [-k,--stksize SIZE]\n"
+		"\t[-T,--num-threads NUM] [-Q,--queue-size SIZE] [-R,--res-cpu NCPU]\n"
+		"\t[-I,--io-threads NUM] [-U,--tx-quantum SIZE] [-Z,--zerocopy]\n"
+		"\t[-z,--zc-thresh SIZE] [-K,--park-idle] [-G,--coro]\n"
+		"\t[-g,--coro-stack SIZE] [-P,--procs] [-H,--handoff PATH]\n"
+		"\t[-t,--takeover PATH] [-D,--drain-time SEC] [-W,--spin-us USEC]\n"
+		"\t[-B,--busy-poll USEC] [-b,--prefer-busy-poll] [-c,--cpus LIST]\n"
+		"\t[-x,--exclude-cpus LIST] [-n,--no-smt]\n", prg);
 }
 
-static pid_t gettid(void)
+static void sig_int(int sig)
 {
-	return (pid_t) syscall(SYS_gettid);
+	++stopsvr;
+	write(sh_pipe[1], &sig, sizeof(int));
 }
 
-static struct thread_ctx *setup_thread_ctx(int cpu)
+static void sig_drain(int sig)
 {
-	struct thread_ctx *tcx;
-	cpu_set_t cset;
+	draining = 1;
+	write(dr_pipe[1], &sig, sizeof(int));
+}
 
-	CPU_ZERO(&cset);
-	CPU_SET(cpu, &cset);
-	xsched_setaffinity(gettid(), sizeof(cset), &cset);
+static int open_listener(int port, int lbklog, int reuseport)
+{
+	int sfd, one = 1;
+	struct sockaddr_in saddr;
+	struct linger ling = { 0, 0 };
 
-	tcx = (struct thread_ctx *) xmalloc(sizeof(struct thread_ctx));
-	tcx->cpu = cpu;
+	sfd = xsocket(AF_INET, SOCK_STREAM, 0);
+	fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL, 0) | O_NONBLOCK);
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (reuseport)
+		setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	setsockopt(sfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons((short int) port);
+	saddr.sin_addr.s_addr = INADDR_ANY;
+	xbind(sfd, (struct sockaddr *) &saddr, sizeof(saddr));
+	listen(sfd, lbklog);
 
-	xpthread_setspecific(thtls_key, tcx);
+	return sfd;
+}
 
-	return tcx;
+static int open_handoff(char const *path)
+{
+	int hfd;
+	struct sockaddr_un uaddr;
+
+	hfd = xsocket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&uaddr, 0, sizeof(uaddr));
+	uaddr.sun_family = AF_UNIX;
+	snprintf(uaddr.sun_path, sizeof(uaddr.sun_path), "%s", path);
+	unlink(uaddr.sun_path);
+	xbind(hfd, (struct sockaddr *) &uaddr, sizeof(uaddr));
+	listen(hfd, 1);
+
+	return hfd;
 }
 
-static void *service_thproc(void *data)
+static int hot_doc_cmp(void const *a, void const *b)
 {
-	int cfd, cpu = (int) (long) data;
-	struct per_cpu_ctx *pcx;
-	struct thread_ctx *tcx;
+	unsigned long ha = (*(struct hot_doc * const *) a)->hits,
+		hb = (*(struct hot_doc * const *) b)->hits;
 
-	pcx = thcpu_ctx + cpu;
-	tcx = setup_thread_ctx(cpu);
+	return ha < hb ? 1: ha > hb ? -1: 0;
+}
 
-	while ((cfd = dequeue_client_session(pcx)) != -1)
-		process_session(cfd);
+/*
+ * Writes the hot document paths of all the CPUs, hottest first.
+ */
+static void export_hot_docs(FILE *file)
+{
+	int i, j, n = 0;
+	struct hot_doc **hdocs;
 
-	return NULL;
+	hdocs = (struct hot_doc **)
+		xmalloc(num_cpus * HOT_DOCS * sizeof(struct hot_doc *));
+	for (i = 0; i < num_cpus; i++) {
+		pthread_mutex_lock(&thcpu_ctx[i].mtx);
+		for (j = 0; j < HOT_DOCS; j++)
+			if (thcpu_ctx[i].hot[j].hits > 0)
+				hdocs[n++] = thcpu_ctx[i].hot + j;
+		pthread_mutex_unlock(&thcpu_ctx[i].mtx);
+	}
+	qsort(hdocs, n, sizeof(struct hot_doc *), hot_doc_cmp);
+	for (i = 0; i < n; i++)
+		fprintf(file, "%s\n", hdocs[i]->path);
+	free(hdocs);
 }
 
-static int accept_session(struct sockaddr_in *caddr)
+/*
+ * Serves a --takeover request on the handoff socket: the listening sockets
+ * are sent over with SCM_RIGHTS, followed by the hot document list.
+ */
+static int handoff_listeners(int hfd)
 {
 	int cfd;
-	socklen_t alen;
-	struct pollfd pfds[2];
-
-	for (;;) {
-		pfds[0].fd = svrfd;
-		pfds[0].events = POLLIN;
-		pfds[0].revents = 0;
-		pfds[1].fd = sh_pipe[0];
-		pfds[1].events = POLLIN;
-		pfds[1].revents = 0;
-		if (poll(pfds, 2, -1) <= 0 || pfds[1].revents & POLLIN)
-			break;
-		if (pfds[0].revents & POLLIN) {
-			alen = sizeof(*caddr);
-			if ((cfd = accept(svrfd, (struct sockaddr *) caddr,
-					  &alen)) == -1) {
-				if (errno != EAGAIN) {
-					perror("accept");
-					break;
-				}
-				continue;
-			}
-
-			return cfd;
-		}
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	FILE *file;
+	char cbuf[CMSG_SPACE(MAX_HANDOFF_FDS * sizeof(int))];
+
+	if ((cfd = accept(hfd, NULL, NULL)) == -1) {
+		perror("accept");
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &nlfds;
+	iov.iov_len = sizeof(nlfds);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(nlfds * sizeof(int));
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(nlfds * sizeof(int));
+	memcpy(CMSG_DATA(cm), lfds, nlfds * sizeof(int));
+	if (sendmsg(cfd, &msg, 0) != sizeof(nlfds)) {
+		perror("Handing off listeners");
+		close(cfd);
+		return -1;
+	}
+	if ((file = fdopen(cfd, "w")) == NULL) {
+		close(cfd);
+		return 0;
 	}
+	export_hot_docs(file);
+	fclose(file);
 
-	return -1;
+	return 0;
 }
 
-static void *acceptor_thproc(void *data)
+static int prewarm_doc(char const *doc)
 {
-	int cfd, cpu = (int) (long) data;
-	struct per_cpu_ctx *pcx;
-	struct thread_ctx *tcx;
-	struct sockaddr_in caddr;
-	struct linger ling = { 0, 0 };
-
-	pcx = thcpu_ctx + cpu;
-	tcx = setup_thread_ctx(cpu);
+	int fd;
+	char *path = NULL;
+	struct stat stbuf;
 
-	while (!stopsvr) {
-		if ((cfd = accept_session(&caddr)) < 0)
-			break;
-		setsockopt(cfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+	xasprintf(&path, "%s/%s", rootfs, *doc == '/' ? doc + 1: doc);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &stbuf) == 0)
+		posix_fadvise(fd, 0, stbuf.st_size, POSIX_FADV_WILLNEED);
+	close(fd);
 
-		pthread_mutex_lock(&pcx->mtx);
-		pcx->conns++;
-		pthread_mutex_unlock(&pcx->mtx);
+	return 0;
+}
 
-		queue_client_session(pcx, cfd);
+/*
+ * Asks the server listening on the @path handoff socket for its listeners,
+ * and pre-warms the page cache with the hot documents it sends along.
+ * Returns the number of listeners received.
+ */
+static int takeover_listeners(char const *path, int *nwarm)
+{
+	int sfd, n;
+	struct sockaddr_un uaddr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	FILE *file;
+	char cbuf[CMSG_SPACE(MAX_HANDOFF_FDS * sizeof(int))];
+	char ln[HOT_PATHSIZE + 2];
+
+	sfd = xsocket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&uaddr, 0, sizeof(uaddr));
+	uaddr.sun_family = AF_UNIX;
+	snprintf(uaddr.sun_path, sizeof(uaddr.sun_path), "%s", path);
+	if (connect(sfd, (struct sockaddr *) &uaddr, sizeof(uaddr)) == -1) {
+		perror(path);
+		exit(1);
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &n;
+	iov.iov_len = sizeof(n);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sfd, &msg, 0) != sizeof(n) ||
+	    (cm = CMSG_FIRSTHDR(&msg)) == NULL ||
+	    cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "Invalid listener handoff from %s\n", path);
+		exit(1);
 	}
+	nlfds = (int) ((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+	lfds = (int *) xmalloc(nlfds * sizeof(int));
+	memcpy(lfds, CMSG_DATA(cm), nlfds * sizeof(int));
+
+	*nwarm = 0;
+	if ((file = fdopen(sfd, "r")) == NULL) {
+		close(sfd);
+		return nlfds;
+	}
+	while (fgets(ln, sizeof(ln), file) != NULL) {
+		ln[strcspn(ln, "\n")] = '\0';
+		if (prewarm_doc(ln) == 0)
+			(*nwarm)++;
+	}
+	fclose(file);
 
-	return NULL;
+	return nlfds;
 }
 
-static void thtls_dtor(void *data)
+/*
+ * Brings up the CPUs [@cpu, @cpu + @ncpus), together with the I/O pools
+ * of the nodes they belong to.
+ */
+static void start_cpus(int cpu, int ncpus, int nthreads, int qsize)
 {
-	free(data);
+	int i, j;
+
+	if (iothreads > 0) {
+		for (i = cpu; i < cpu + ncpus; i++)
+			if (cpu_topo[i].node >= num_nodes)
+				num_nodes = cpu_topo[i].node + 1;
+		io_pools = (struct io_pool *)
+			xmalloc(num_nodes * sizeof(struct io_pool));
+		for (i = 0; i < num_nodes; i++) {
+			for (j = cpu; j < cpu + ncpus && cpu_topo[j].node != i;
+			     j++);
+			init_io_pool(io_pools + i, i,
+				     j < cpu + ncpus ? iothreads: 0);
+		}
+	}
+	for (i = cpu; i < cpu + ncpus; i++)
+		init_per_cpu_ctx(thcpu_ctx + i, i, nthreads, qsize);
 }
 
-static void init_per_cpu_ctx(struct per_cpu_ctx *pcx, int cpu, int nthreads,
-			     int qsize)
+static int live_conns(int cpu, int ncpus)
 {
 	int i;
+	unsigned long long n = 0;
 
-	memset(pcx, 0, sizeof(*pcx));
-	xpthread_mutex_init(&pcx->mtx, NULL);
-	xpthread_cond_init(&pcx->cnd, NULL);
-	xpthread_cond_init(&pcx->dqcnd, NULL);
+	for (i = cpu; i < cpu + ncpus; i++) {
+		pthread_mutex_lock(&thcpu_ctx[i].mtx);
+		n += thcpu_ctx[i].conns - thcpu_ctx[i].closes;
+		pthread_mutex_unlock(&thcpu_ctx[i].mtx);
+	}
 
-	pcx->nthreads = nthreads + 1;
-	pcx->threads = (pthread_t *) xmalloc(pcx->nthreads * sizeof(pthread_t));
+	return (int) n;
+}
 
-	pcx->qsize = qsize;
-	pcx->squeue = (int *) xmalloc(qsize * sizeof(int));
+/*
+ * Stops taking new connections. Acceptor threads notice the flag the next
+ * time they wake up, coroutine schedulers have the listener removed from
+ * their epoll set right away, since an EPOLLEXCLUSIVE wakeup they would not
+ * act upon could leave the new server unaware of a pending connection.
+ * Parked sessions are kicked out of their idle wait.
+ */
+static void start_drain(int cpu, int ncpus)
+{
+	int i;
 
-	for (i = 0; i < nthreads; i++)
-		xpthread_create(pcx->threads + i, &def_thattr, service_thproc,
-				(void *) (long) cpu);
+	draining = 1;
+	for (i = cpu; coromode && i < cpu + ncpus; i++)
+		epoll_ctl(thcpu_ctx[i].epfd, EPOLL_CTL_DEL, svrfd, NULL);
+	for (i = cpu; parkidle && i < cpu + ncpus; i++)
+		shut_parked(thcpu_ctx + i);
+}
 
-	xpthread_create(pcx->threads + i, &def_thattr, acceptor_thproc,
-			(void *) (long) cpu);
+/*
+ * Runs until shutdown or, once draining after a listener handoff, until
+ * the connections of the CPUs [@cpu, @cpu + @ncpus) are gone or the drain
+ * time expires. Returns the number of connections still open.
+ */
+static int serve_cpus(int *phfd, int cpu, int ncpus)
+{
+	int n, left = 0;
+	unsigned long long tdrain = 0;
+	struct pollfd pfds[3];
+
+	for (;;) {
+		pfds[0].fd = sh_pipe[0];
+		pfds[1].fd = dr_pipe[0];
+		pfds[2].fd = *phfd;
+		pfds[0].events = pfds[1].events = pfds[2].events = POLLIN;
+		pfds[0].revents = pfds[1].revents = pfds[2].revents = 0;
+		n = poll(pfds, 3, draining ? 100: -1);
+		if (n > 0 && pfds[0].revents & POLLIN)
+			break;
+		if (n > 0 && pfds[1].revents & POLLIN)
+			read(dr_pipe[0], &n, sizeof(n));
+		if (n > 0 && pfds[2].revents & POLLIN &&
+		    handoff_listeners(*phfd) == 0) {
+			close(*phfd);
+			*phfd = -1;
+			draining = 1;
+		}
+		if (draining) {
+			if (tdrain == 0) {
+				start_drain(cpu, ncpus);
+				tdrain = get_nstime();
+			}
+			if ((left = live_conns(cpu, ncpus)) == 0 ||
+			    get_nstime() - tdrain > drain_ns) {
+				++stopsvr;
+				write(sh_pipe[1], &n, sizeof(int));
+				break;
+			}
+		}
+	}
+
+	return left;
 }
 
-static void usage(char const *prg)
+/*
+ * Sessions still blocked on idle connections at the end of a drain would
+ * never let their threads go, so in that case they are not waited for.
+ */
+static void stop_cpus(int cpu, int ncpus, int join)
 {
-	fprintf(stderr,
-		"Use: %s [-h,--help] [-p,--port PORTNO] [-L,--listen LISBKLOG]\n"
-		"\t[-r,--root ROOTFS] [-S,--sendfile] [-k,--stksize SIZE]\n"
-		"\t[-T,--num-threads NUM] [-Q,--queue-size SIZE] [-R,--res-cpu NCPU]\n", prg);
+	int i, j;
+
+	close(svrfd);
+
+	for (i = cpu; i < cpu + ncpus; i++)
+		pthread_cond_broadcast(&thcpu_ctx[i].cnd);
+	for (i = 0; io_pools != NULL && i < num_nodes; i++) {
+		pthread_mutex_lock(&io_pools[i].mtx);
+		pthread_cond_broadcast(&io_pools[i].cnd);
+		pthread_mutex_unlock(&io_pools[i].mtx);
+		for (j = 0; join && j < io_pools[i].nthreads; j++)
+			pthread_join(io_pools[i].threads[j], NULL);
+	}
+	for (i = cpu; join && i < cpu + ncpus; i++) {
+		for (j = 0; j < thcpu_ctx[i].nthreads; j++)
+			pthread_join(thcpu_ctx[i].threads[j], NULL);
+		close_parked(thcpu_ctx + i);
+		close_queued(thcpu_ctx + i);
+	}
 }
 
-static void sig_int(int sig)
+/*
+ * Shared-nothing mode, one process per CPU, each with its own SO_REUSEPORT
+ * listener, fd table and mm. The per-CPU contexts live in a MAP_SHARED
+ * mapping, and each child only ever touches its own, so that once all the
+ * children have exited the parent can collect the counters from there.
+ * The parent keeps all the listeners, to be able to hand them off.
+ */
+static void run_procs(int *phfd, int nthreads, int qsize)
 {
-	++stopsvr;
-	write(sh_pipe[1], &sig, sizeof(int));
+	int i, j, sig = SIGINT, nohfd = -1;
+	pid_t *pids;
+	struct pollfd pfds[2];
+
+	pids = (pid_t *) xmalloc(num_cpus * sizeof(pid_t));
+	fflush(stdout);
+	for (i = 0; i < num_cpus; i++) {
+		if ((pids[i] = fork()) == -1) {
+			perror("Forking server process");
+			exit(1);
+		}
+		if (pids[i] == 0) {
+			close(sh_pipe[0]);
+			close(sh_pipe[1]);
+			close(dr_pipe[0]);
+			close(dr_pipe[1]);
+			xpipe(sh_pipe);
+			xpipe(dr_pipe);
+			signal(SIGUSR1, sig_drain);
+			if (*phfd != -1)
+				close(*phfd);
+			for (j = 0; j < nlfds; j++)
+				if (j != i)
+					close(lfds[j]);
+			svrfd = lfds[i];
+			start_cpus(i, 1, nthreads, qsize);
+			stop_cpus(i, 1, serve_cpus(&nohfd, i, 1) == 0);
+			_exit(0);
+		}
+	}
+
+	for (;;) {
+		pfds[0].fd = sh_pipe[0];
+		pfds[1].fd = *phfd;
+		pfds[0].events = pfds[1].events = POLLIN;
+		pfds[0].revents = pfds[1].revents = 0;
+		if (poll(pfds, 2, -1) <= 0)
+			continue;
+		if (pfds[0].revents & POLLIN)
+			break;
+		if (pfds[1].revents & POLLIN && handoff_listeners(*phfd) == 0) {
+			close(*phfd);
+			*phfd = -1;
+			draining = 1;
+			sig = SIGUSR1;
+			break;
+		}
+	}
+	for (i = 0; i < num_cpus; i++)
+		kill(pids[i], sig);
+	for (i = 0; i < num_cpus; i++)
+		while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+			if (stopsvr)
+				kill(pids[i], SIGINT);
+	free(pids);
 }
 
 int main(int ac, char **av)
 {
-	int i, error, port = 80, lbklog = 1024, one = 1,
-		stksize = 0, nthreads = 16, qsize = 32, rescpu = 0;
-	unsigned long long conns, tbytes, reqs;
-	struct sockaddr_in saddr;
-	struct linger ling = { 0, 0 };
+	int i, error, port = 80, lbklog = 1024, stksize = 0, nthreads = 16,
+		qsize = 32, rescpu = 0, procs = 0, hfd = -1, nwarm = 0;
+	char const *tkov_path = NULL, *cpulist = NULL, *xcpulist = NULL;
+	int nosmt = 0;
+	cpu_set_t cset, aset;
+	unsigned long long conns, tbytes, reqs, cold_reqs, cold_ns, cold_maxns, qovfl,
+		txstreams, txchunks, zcsends, zccopied, zcsmall, txcalls, parks,
+		cocreates, coswitches, qlat_ns, qlat_max, qlat_cnt, spintime,
+		spinhits, sleeps, bpsocks, h2conns, h2streams, tstart;
+	double cpus;
+	struct rusage ru, ruc;
+	int nbufs, maxbused, comaxlive;
 
 	for (i = 1; i < ac; i++) {
 		if (strcmp(av[i], "--port") == 0 ||
@@ -751,6 +3868,50 @@ int main(int ac, char **av)
 		} else if (strcmp(av[i], "-S") == 0 ||
 			   strcmp(av[i], "--sendfile") == 0) {
 			txmode = TX_SENDFILE;
+		} else if (strcmp(av[i], "-Z") == 0 ||
+			   strcmp(av[i], "--zerocopy") == 0) {
+			txmode = TX_ZEROCOPY;
+		} else if (strcmp(av[i], "--zc-thresh") == 0 ||
+			   strcmp(av[i], "-z") == 0) {
+			if (++i < ac)
+				zcthresh = atol(av[i]);
+		} else if (strcmp(av[i], "-K") == 0 ||
+			   strcmp(av[i], "--park-idle") == 0) {
+			parkidle = 1;
+		} else if (strcmp(av[i], "--handoff") == 0 ||
+			   strcmp(av[i], "-H") == 0) {
+			if (++i < ac)
+				hoff_path = av[i];
+		} else if (strcmp(av[i], "--takeover") == 0 ||
+			   strcmp(av[i], "-t") == 0) {
+			if (++i < ac)
+				tkov_path = av[i];
+		} else if (strcmp(av[i], "--drain-time") == 0 ||
+			   strcmp(av[i], "-D") == 0) {
+			if (++i < ac)
+				drain_ns = (unsigned long long) atol(av[i]) *
+					1000000000ULL;
+		} else if (strcmp(av[i], "--spin-us") == 0 ||
+			   strcmp(av[i], "-W") == 0) {
+			if (++i < ac)
+				spinmax = (unsigned long long) atol(av[i]) * 1000;
+		} else if (strcmp(av[i], "--busy-poll") == 0 ||
+			   strcmp(av[i], "-B") == 0) {
+			if (++i < ac)
+				busypoll = atoi(av[i]);
+		} else if (strcmp(av[i], "-b") == 0 ||
+			   strcmp(av[i], "--prefer-busy-poll") == 0) {
+			prefbusypoll = 1;
+		} else if (strcmp(av[i], "-P") == 0 ||
+			   strcmp(av[i], "--procs") == 0) {
+			procs = 1;
+		} else if (strcmp(av[i], "-G") == 0 ||
+			   strcmp(av[i], "--coro") == 0) {
+			coromode = 1;
+		} else if (strcmp(av[i], "--coro-stack") == 0 ||
+			   strcmp(av[i], "-g") == 0) {
+			if (++i < ac)
+				costksize = (size_t) atol(av[i]);
 		} else if (strcmp(av[i], "--stksize") == 0 ||
 			   strcmp(av[i], "-k") == 0) {
 			if (++i < ac)
@@ -759,6 +3920,17 @@ int main(int ac, char **av)
 			   strcmp(av[i], "-R") == 0) {
 			if (++i < ac)
 				rescpu = atoi(av[i]);
+		} else if (strcmp(av[i], "--cpus") == 0 ||
+			   strcmp(av[i], "-c") == 0) {
+			if (++i < ac)
+				cpulist = av[i];
+		} else if (strcmp(av[i], "--exclude-cpus") == 0 ||
+			   strcmp(av[i], "-x") == 0) {
+			if (++i < ac)
+				xcpulist = av[i];
+		} else if (strcmp(av[i], "-n") == 0 ||
+			   strcmp(av[i], "--no-smt") == 0) {
+			nosmt = 1;
 		} else if (strcmp(av[i], "--num-threads") == 0 ||
 			   strcmp(av[i], "-T") == 0) {
 			if (++i < ac)
@@ -767,6 +3939,14 @@ int main(int ac, char **av)
 			   strcmp(av[i], "-Q") == 0) {
 			if (++i < ac)
 				qsize = atoi(av[i]);
+		} else if (strcmp(av[i], "--io-threads") == 0 ||
+			   strcmp(av[i], "-I") == 0) {
+			if (++i < ac)
+				iothreads = atoi(av[i]);
+		} else if (strcmp(av[i], "--tx-quantum") == 0 ||
+			   strcmp(av[i], "-U") == 0) {
+			if (++i < ac)
+				txquantum = atol(av[i]);
 		} else if (strcmp(av[i], "--help") == 0||
 			   strcmp(av[i], "-h") == 0) {
 			usage(av[0]);
@@ -785,64 +3965,220 @@ int main(int ac, char **av)
 	}
 
 	xpipe(sh_pipe);
+	xpipe(dr_pipe);
+
+	pgsize = sysconf(_SC_PAGESIZE);
+	if (coromode) {
+		/*
+		 * Sessions do not leave their coroutine, so the hand-off based
+		 * features, which need service threads to pick them up, are off.
+		 */
+		costksize = (costksize + pgsize - 1) & ~(pgsize - 1);
+		nthreads = 1;
+		iothreads = 0;
+		txquantum = 0;
+		parkidle = 0;
+	}
 
+	/*
+	 * Start from the CPUs we are allowed to run on, which --cpus can
+	 * narrow down further, and take away the --exclude-cpus ones (the
+	 * housekeeping or IRQ handling ones, typically). --res-cpu then trims
+	 * the topology sorted list from the top.
+	 */
 	avail_cpus = sysconf(_SC_NPROCESSORS_CONF);
-	if ((num_cpus = avail_cpus - rescpu) <= 0)
+	sched_getaffinity(0, sizeof(cset), &cset);
+	if (cpulist != NULL) {
+		if (parse_cpu_list(cpulist, &aset) != 0) {
+			fprintf(stderr, "Invalid CPU list: %s\n", cpulist);
+			return 2;
+		}
+		CPU_AND(&cset, &cset, &aset);
+	}
+	if (xcpulist != NULL) {
+		if (parse_cpu_list(xcpulist, &aset) != 0) {
+			fprintf(stderr, "Invalid CPU list: %s\n", xcpulist);
+			return 2;
+		}
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &aset))
+				CPU_CLR(i, &cset);
+	}
+	if ((num_cpus = load_topology(&cset, nosmt)) == 0) {
+		fprintf(stderr, "No usable CPUs left\n");
+		return 2;
+	}
+	if (rescpu > 0 && (num_cpus -= rescpu) <= 0)
 		num_cpus = 1;
 
 	fprintf(stdout,
 		"Number of CPU(s)            : %d\n"
 		"Number of used CPU(s)       : %d\n"
+		"Used Cores/LLCs/Nodes       : %d/%d/%d\n"
 		"Number of Thread(s) per CPU : %d\n",
-		avail_cpus, num_cpus, nthreads);
+		avail_cpus, num_cpus, count_distinct(num_cpus, 2),
+		count_distinct(num_cpus, 1), count_distinct(num_cpus, 0),
+		nthreads);
+	if (procs)
+		fprintf(stdout,
+			"Number of Process(es)       : %d\n", num_cpus);
 
-	svrfd = xsocket(AF_INET, SOCK_STREAM, 0);
-	fcntl(svrfd, F_SETFL, fcntl(svrfd, F_GETFL, 0) | O_NONBLOCK);
-	setsockopt(svrfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-	setsockopt(svrfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
-	memset(&saddr, 0, sizeof(saddr));
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons((short int) port);
-	saddr.sin_addr.s_addr = INADDR_ANY;
-	xbind(svrfd, (struct sockaddr *) &saddr, sizeof(saddr));
-	listen(svrfd, lbklog);
+	/*
+	 * A taken over listener keeps its accept backlog, and whatever was
+	 * queued while the old server was handing it off. Listeners in excess
+	 * of what this configuration needs are dropped, missing ones are
+	 * opened (which requires the old server to have been in --procs mode
+	 * as well, for SO_REUSEPORT to allow it).
+	 */
+	if (tkov_path != NULL) {
+		takeover_listeners(tkov_path, &nwarm);
+		fprintf(stdout,
+			"Taken Over Listener(s)      : %d\n"
+			"Prewarmed Document(s)       : %d\n", nlfds, nwarm);
+	}
+	i = procs ? num_cpus: 1;
+	lfds = (int *) xrealloc(lfds, (nlfds > i ? nlfds: i) * sizeof(int));
+	for (; nlfds < i; nlfds++)
+		lfds[nlfds] = open_listener(port, lbklog, procs);
+	for (; nlfds > i; nlfds--)
+		close(lfds[nlfds - 1]);
+	if (hoff_path != NULL)
+		hfd = open_handoff(hoff_path);
 
 	xpthread_key_create(&thtls_key, thtls_dtor);
+	tstart = get_nstime();
+	/*
+	 * The contexts are page aligned, and not touched here, so that each
+	 * one gets its pages from the node of its CPU (see ctx_init_thproc).
+	 */
 	thcpu_ctx = (struct per_cpu_ctx *)
-		xmalloc(num_cpus * sizeof(struct per_cpu_ctx));
-	for (i = 0; i < num_cpus; i++)
-		init_per_cpu_ctx(thcpu_ctx + i, i, nthreads, qsize);
-
-	for (;;) {
-		struct pollfd pfd;
-
-		pfd.fd = sh_pipe[0];
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-		if (poll(&pfd, 1, -1) > 0 && pfd.revents & POLLIN)
-			break;
+		xmmap(NULL, num_cpus * sizeof(struct per_cpu_ctx),
+		      PROT_READ | PROT_WRITE,
+		      (procs ? MAP_SHARED: MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+	if (procs) {
+		run_procs(&hfd, nthreads, qsize);
+	} else {
+		svrfd = lfds[0];
+		start_cpus(0, num_cpus, nthreads, qsize);
+		stop_cpus(0, num_cpus, serve_cpus(&hfd, 0, num_cpus) == 0);
+	}
+	/*
+	 * After a handoff the socket path belongs to the new server.
+	 */
+	if (hfd != -1) {
+		close(hfd);
+		unlink(hoff_path);
 	}
 
-	close(svrfd);
-
-	for (i = 0; i < num_cpus; i++)
-		pthread_cond_broadcast(&thcpu_ctx[i].cnd);
-	tbytes = reqs = conns = 0;
+	tbytes = reqs = conns = cold_reqs = cold_ns = cold_maxns = qovfl = 0;
+	txstreams = txchunks = zcsends = zccopied = zcsmall = txcalls = 0;
+	parks = cocreates = coswitches = h2conns = h2streams = 0;
+	qlat_ns = qlat_max = qlat_cnt = spintime = spinhits = sleeps = bpsocks = 0;
+	nbufs = maxbused = comaxlive = 0;
 	for (i = 0; i < num_cpus; i++) {
-		int j;
-
-		for (j = 0; j < thcpu_ctx[i].nthreads; j++)
-			pthread_join(thcpu_ctx[i].threads[j], NULL);
-
 		tbytes += thcpu_ctx[i].tbytes;
 		reqs += thcpu_ctx[i].reqs;
 		conns += thcpu_ctx[i].conns;
+		txstreams += thcpu_ctx[i].txstreams;
+		txchunks += thcpu_ctx[i].txchunks;
+		txcalls += thcpu_ctx[i].txcalls;
+		parks += thcpu_ctx[i].parks;
+		qlat_ns += thcpu_ctx[i].qlat_ns;
+		qlat_cnt += thcpu_ctx[i].qlat_cnt;
+		if (thcpu_ctx[i].qlat_max > qlat_max)
+			qlat_max = thcpu_ctx[i].qlat_max;
+		spintime += thcpu_ctx[i].spintime;
+		spinhits += thcpu_ctx[i].spinhits;
+		sleeps += thcpu_ctx[i].sleeps;
+		bpsocks += thcpu_ctx[i].bpsocks;
+		h2conns += thcpu_ctx[i].h2conns;
+		h2streams += thcpu_ctx[i].h2streams;
+		nbufs += thcpu_ctx[i].nbufs;
+		maxbused += thcpu_ctx[i].maxbused;
+		cocreates += thcpu_ctx[i].cocreates;
+		coswitches += thcpu_ctx[i].coswitches;
+		comaxlive += thcpu_ctx[i].comaxlive;
+		zcsends += thcpu_ctx[i].zcsends;
+		zccopied += thcpu_ctx[i].zccopied;
+		zcsmall += thcpu_ctx[i].zcsmall;
+		cold_reqs += thcpu_ctx[i].cold_reqs;
+		cold_ns += thcpu_ctx[i].cold_ns;
+		if (thcpu_ctx[i].cold_maxns > cold_maxns)
+			cold_maxns = thcpu_ctx[i].cold_maxns;
+		qovfl += thcpu_ctx[i].qovfl;
 	}
 
 	fprintf(stdout,
 		"Connections .....: %llu\n"
 		"Requests ........: %llu\n"
-		"Total Bytes .....: %llu\n", conns, reqs, tbytes);
+		"Total Bytes .....: %llu\n"
+		"TX Syscalls/Req .: %.2lf\n", conns, reqs, tbytes,
+		reqs ? (double) txcalls / reqs: 0.0);
+	fprintf(stdout,
+		"Conn Footprint ..: %zu bytes idle, %zu bytes active\n"
+		"Buffer Pool .....: %d buffers, %d peak in use\n",
+		sizeof(struct bstream), sizeof(struct bstream) + BSTREAM_BLKSIZE,
+		nbufs, maxbused);
+	/*
+	 * What the spinning and busy polling cost, against what they buy in
+	 * queue latency. In --procs mode the work is done by the children.
+	 */
+	getrusage(RUSAGE_SELF, &ru);
+	getrusage(RUSAGE_CHILDREN, &ruc);
+	cpus = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		ruc.ru_utime.tv_sec + ruc.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec +
+		 ruc.ru_utime.tv_usec + ruc.ru_stime.tv_usec) / 1e6;
+	fprintf(stdout,
+		"CPU Time ........: %.3lf s (%.1lf%% of %d CPUs), %.1lf us/req\n"
+		"Ctx Switches ....: %ld voluntary, %ld involuntary\n", cpus,
+		100.0 * cpus / ((get_nstime() - tstart) / 1e9) / num_cpus,
+		num_cpus, reqs ? cpus * 1e6 / reqs: 0.0,
+		ru.ru_nvcsw + ruc.ru_nvcsw, ru.ru_nivcsw + ruc.ru_nivcsw);
+	if (qlat_cnt > 0)
+		fprintf(stdout,
+			"Queue Latency ...: %.3lf us avg, %.3lf us max\n",
+			(double) qlat_ns / qlat_cnt / 1e3, (double) qlat_max / 1e3);
+	if (spinmax > 0)
+		fprintf(stdout,
+			"Worker Spins ....: %llu hits, %.3lf s spinning\n"
+			"Worker Sleeps ...: %llu\n", spinhits, spintime / 1e9,
+			sleeps);
+	if (h2conns > 0)
+		fprintf(stdout,
+			"H2 Connections ..: %llu, %.1lf streams/conn\n", h2conns,
+			(double) h2streams / h2conns);
+	if (busypoll > 0)
+		fprintf(stdout,
+			"Busy Poll Socks .: %llu of %llu\n", bpsocks, conns);
+	if (draining)
+		fprintf(stdout,
+			"Drain Leftovers .: %d conns\n", live_conns(0, num_cpus));
+	if (parkidle)
+		fprintf(stdout,
+			"Parked Sessions .: %llu\n", parks);
+	if (coromode)
+		fprintf(stdout,
+			"Coro Stacks .....: %llu created, %d peak live, %zu bytes\n"
+			"Coro Switches ...: %llu\n", cocreates, comaxlive,
+			costksize, coswitches);
+	if (txquantum > 0)
+		fprintf(stdout,
+			"TX Streams ......: %llu\n"
+			"TX Chunks .......: %llu\n", txstreams, txchunks);
+	if (txmode == TX_ZEROCOPY)
+		fprintf(stdout,
+			"ZC Sends ........: %llu\n"
+			"ZC Copied .......: %llu\n"
+			"ZC Small Copies .: %llu\n", zcsends, zccopied, zcsmall);
+	if (iothreads > 0)
+		fprintf(stdout,
+			"Cold Requests ...: %llu\n"
+			"Cold Avg Delay ..: %.3lf ms\n"
+			"Cold Max Delay ..: %.3lf ms\n"
+			"Queue Overflows .: %llu\n", cold_reqs,
+			cold_reqs ? (double) cold_ns / cold_reqs / 1e6: 0.0,
+			(double) cold_maxns / 1e6, qovfl);
 
 	return 0;
 }